@@ -1,5 +1,5 @@
 // Include necessary headers
-#define _XOPEN_SOURCE 500 // Defined a macro _XOPEN_SOURCE 500 for nftw() function.
+#define _GNU_SOURCE // Defined a macro _GNU_SOURCE for nftw(), fstatat(), DTTOIF() and syscall()
 #include <stdio.h> // Standard input-output functions
 #include <stdlib.h> // Standard library functions
 #include <string.h> // String manipulation functions
@@ -8,6 +8,42 @@
 #include <errno.h> // Include errno.h for errno and EISDIR
 #include <limits.h> // Definitions of system limits
 #include <zlib.h> // Functions for gzip compression
+#include <pthread.h> // POSIX threads for the parallel directory walker
+#include <stdatomic.h> // Atomic counters shared between walker threads
+#include <unistd.h> // sysconf() for the number of online CPUs
+#include <dirent.h> // opendir()/readdir() used by the parallel walker
+#include <time.h> // nanosleep() for idle walker threads
+#include <fcntl.h> // open() flags and AT_SYMLINK_NOFOLLOW for directory-relative stats
+#include <stdint.h> // Fixed-width integers for the getdents64 record layout
+#include <sys/syscall.h> // SYS_getdents64, __NR_io_uring_setup and __NR_io_uring_enter
+#include <sys/mman.h> // mmap() of the io_uring queues
+#include <sys/sysmacros.h> // makedev() when converting statx results
+#include <linux/io_uring.h> // io_uring structures and opcodes (used through raw system calls, no liburing needed)
+#include <sys/socket.h> // Unix domain sockets for the daemon and server modes
+#include <sys/un.h> // struct sockaddr_un
+#include <poll.h> // poll() event loop of the resident modes
+#include <signal.h> // Clean shutdown of the resident modes on SIGINT/SIGTERM
+#include <sys/inotify.h> // Recursive inotify watches (daemon fallback)
+#include <sys/fanotify.h> // Filesystem-wide fanotify marks (daemon)
+#include <sys/sendfile.h> // sendfile() fallback of the copy engine
+#include <sys/ioctl.h> // ioctl() for reflink copies
+#include <linux/fs.h> // FICLONE and FICLONERANGE
+#include <sys/xattr.h> // Extended attributes kept by cross-filesystem moves
+#include <sys/uio.h> // struct iovec for registering io_uring copy buffers
+#include <pwd.h> // getpwuid() for the user name in tar headers
+#include <grp.h> // getgrgid() for the group name in tar headers
+#include <stddef.h> // offsetof() for the copy journal record
+#ifdef HAVE_ZSTD
+#include <zstd.h> // zstd archive codec
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h> // lz4 archive codec
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 byte compares for the short-query name scan
+#endif
+// Build: gcc FileUtilOperationTask.c -o fileutil -lz -pthread
+// Optional archive codecs: add -DHAVE_ZSTD -lzstd for zstd and -DHAVE_LZ4 -llz4 for lz4
 
 // Declaration for snprintf
 int snprintf(char *s, size_t n, const char *format, ...); 
@@ -27,6 +63,82 @@ const char *storageDir; // Stores the storage directory path
 const char *operation; // Stores the operation to be performed (copy or move)
 const char *extension; // Stores the file extension to filter files
 char *found_file = NULL; // Stores the path of the found file
+struct archive_writer *tar_archive = NULL; // Archive written by the tar mode, open for the whole search
+long match_count = 0; // Number of files found so far
+long max_results = 0; // Stop the walk after this many matches (--first sets 1, --max-results N sets N), 0 means no limit; with --ordered the whole tree is walked first
+
+#define WALK_STOP 2 // Callback return value that ends the walk early without signalling an error
+
+// Walker options (set from command-line flags such as --threads before the positional arguments are parsed)
+const char *walker = "parallel"; // Traversal backend: "parallel" (work-stealing threads) or "nftw" (single-threaded libc walk)
+int walk_threads = 0; // Number of walker threads, 0 means one per online CPU
+int walk_ordered = 0; // When set, callbacks are replayed in sorted path order after the walk so output is deterministic (no early exit)
+const char *walk_reader = "getdents"; // Directory reader: "getdents" (batched getdents64 trusting d_type) or "readdir" (readdir() plus a stat per entry)
+size_t walk_dirent_buffer_size = 1 << 20; // Size of each worker's getdents64 buffer in bytes
+int walk_need_stat = 0; // Set by modes whose callbacks read sizes, modes or times from the stat buffer; otherwise only the file type is filled in
+int (*walk_stat_filter)(const char *name) = NULL; // With walk_need_stat, only files whose name passes this filter are stat'ed (NULL: all files)
+int (*walk_name_filter)(const char *name) = NULL; // Files whose name fails this filter are skipped by the parallel walker before the callback (NULL: report all)
+const char *stat_engine = "uring"; // How the getdents reader stats entries: "uring" (batched IORING_OP_STATX) or "sync" (fstatat per entry)
+int walk_uring_depth = 64; // io_uring queue depth, which is also the number of stats issued per batch
+
+// Index options
+const char *index_path = NULL; // --index FILE: answer searches from this prebuilt index instead of walking rootDir
+const char *index_build_path = NULL; // --index-build FILE: walk rootDir and write an index to FILE
+const char *index_update_path = NULL; // --index-update FILE: refresh FILE, re-reading only changed directories
+
+// Batch search options
+const char *names_path = NULL; // --names FILE: resolve every name listed in FILE ("-" for standard input) in one traversal
+const char *names_match = "exact"; // --names-match: "exact" (basename equals a name) or "substring" (basename contains a name)
+
+// Copy options
+// COPY_METHOD_DIRECT and COPY_METHOD_URING are not part of the fallback chain: they are only used when asked for
+// with --copy-method direct or --copy-method uring
+enum copy_method { COPY_METHOD_CLONE, COPY_METHOD_RANGE, COPY_METHOD_SENDFILE, COPY_METHOD_SPLICE, COPY_METHOD_READWRITE,
+                   COPY_METHOD_DIRECT, COPY_METHOD_URING };
+const char *copy_method_names[] = { "reflink", "copy_file_range", "sendfile", "splice", "readwrite", "direct", "uring" }; // Indexed by enum copy_method
+int copy_method = COPY_METHOD_CLONE; // --copy-method: first method the copy engine tries (it falls back from there)
+enum reflink_mode { REFLINK_AUTO, REFLINK_ALWAYS, REFLINK_NEVER };
+int reflink_mode = REFLINK_AUTO; // --reflink: "auto" (clone when possible), "always" (fail unless cloned) or "never"
+int copy_threads = 0; // --copy-threads: threads copying one large file, 0 means one per online CPU
+off_t copy_parallel_threshold = (off_t)256 << 20; // --copy-parallel-threshold (MiB): files at least this large are copied in parallel chunks
+enum sparse_mode { SPARSE_AUTO, SPARSE_ALWAYS, SPARSE_NEVER };
+int copy_uring_depth = 32; // --copy-uring-depth: read/write pairs the io_uring copier keeps in flight
+size_t copy_uring_buffer_size = (size_t)1 << 20; // --copy-buffer-size (KiB): size of each registered io_uring copy buffer
+enum update_mode { UPDATE_NONE, UPDATE_FAST, UPDATE_STRICT };
+int update_mode = UPDATE_NONE; // --update: "fast" skips destinations with the same size and mtime, "strict" compares the contents block by block
+int copy_resume = 0; // --resume: copy through "<dest>.part" with a progress journal so an interrupted copy continues where it stopped
+int copy_checksum = 0; // --checksum: compute the CRC32C of the data while copying it and print it
+int copy_verify = 0; // --verify: re-read the copy (bypassing the page cache) and compare its CRC32C (implies --checksum)
+uint32_t copy_crc = 0; // CRC32C of the data of the last copy (with --checksum)
+int direct_hugepages = 0; // --direct-hugepages: back the O_DIRECT buffers with huge pages when the system has them reserved
+int sparse_mode = SPARSE_AUTO; // --sparse: "auto" (keep the holes of sparse sources), "always" (also turn zero blocks into holes) or "never"
+
+// Archive options
+enum archive_codec { CODEC_GZIP, CODEC_ZSTD, CODEC_LZ4, CODEC_NONE };
+const char *archive_codec_names[] = { "gzip", "zstd", "lz4", "none" }; // Indexed by enum archive_codec
+int archive_codec = -1; // --codec: compression of the tar archive, -1 picks it from the suffix of the archive name
+int archive_level = -1; // --archive-level: compression level, -1 means the codec's default
+const char *archive_name = "a1.tar"; // --archive-name: file name of the archive in storageDir
+int codec_bench = 0; // --codec-bench: compare the codecs on the archive's data instead of keeping the archive
+enum archive_format { FORMAT_STREAM, FORMAT_BGZF };
+int archive_format = FORMAT_STREAM; // --archive-format: "stream" (one compressed stream) or "bgzf" (seekable gzip blocks with a member index)
+const char *extract_archive = NULL; // --extract ARCHIVE: unpack ARCHIVE (or the members of one name) into a directory
+int archive_threads = 0; // --archive-threads: threads compressing (or unpacking) tar archives, 0 means one per online CPU
+size_t archive_block_size = (size_t)128 << 10; // --archive-block-size (KiB): uncompressed bytes per separately compressed block
+
+// Daemon options
+const char *daemon_socket = NULL; // --daemon SOCKET: keep a live index of rootDir and answer lookups on SOCKET
+const char *watch_backend = "auto"; // --watch: "fanotify", "inotify" or "auto" (fanotify when permitted, else inotify)
+
+// Query server options
+const char *serve_socket = NULL; // --serve SOCKET: run requests sent over SOCKET in this resident process
+const char *client_socket = NULL; // --client SOCKET: send standard input to a server or daemon and print the replies
+long search_cache_size = 4096; // --cache-size: searches remembered by the server, 0 disables the cache
+long search_cache_ttl = 60; // --cache-ttl: seconds a cached search stays valid
+int search_cache_recording = 0; // Set while a search's matches are being recorded for the cache
+
+// Callback type shared by nftw() and the parallel walker, e.g. search_and_process or search_and_create_tar
+typedef int (*walk_callback)(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf);
 
 // Function prototypes
 // Function to check if a directory exists
@@ -40,20 +152,172 @@ int search_and_process(const char *fpath, const struct stat *sb, int typeflag, s
 // const struct stat *sb: This argument represents a pointer to a structure containing information about the file specified by fpath. It includes details such as file type, size, permissions, etc. (const struct stat *).
 // int typeflag: This argument indicates the type of the file specified by fpath. It can have different values to represent regular files, directories, symbolic links, etc.
 // struct FTW *ftwbuf: This argument is a pointer to a structure containing information about the current file tree walk status. It includes details such as the depth of the traversal, base name, etc.
+int process_found_file(const char *fpath);
+// Function to handle one file whose name matched enteredFileName: copies/moves it when an operation was given, prints it otherwise
+// const char *fpath: The path of the matching file.
+// Returns 0 to keep searching, WALK_STOP once max_results matches were handled, or 1 on failure.
+
 int search_and_create_tar(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf); // Callback function for searching and creating tar
 // Also used with nftw function.
 // Searches for files with a specific extension and creates a tar file containing those files.
 
-void add_file_to_tar(const char *dir_path, const char *filename, gzFile tarfile); 
-// Function to add a file to a tar archive
-// const char *dir_path: This argument represents the path of the directory containing the file to be added to the tar archive. It's a pointer to a null-terminated string (const char *).
-// const char *filename: This argument represents the name of the file to be added to the tar archive. It's a pointer to a null-terminated string (const char *).
-// gzFile tarfile: This argument represents a handle to the gzip file (tar archive) where the file will be added. It's of type gzFile, which is a pointer to a gzFile_s structure representing a gzip file.
+int archive_found_file(const char *fpath, int base, const struct stat *sb);
+// Function to handle one file whose name contains the extension: prints its path and adds it to the open archive
+// const char *fpath: The path of the matching file. int base: Offset of the file name within fpath.
+// const struct stat *sb: The file's metadata from the walker, or NULL to have it read when the file is opened.
+// Returns 0 to keep searching, or 1 if writing the archive failed.
+
+int tar_name_matches(const char *name);
+// Function to check whether a file name contains the extension (same test as search_and_create_tar)
+// Used as walk_stat_filter so that the walker only fetches metadata for files that will be archived.
+
+int add_file_to_tar(const char *fpath, const char *name, const struct stat *sb, struct archive_writer *tarfile);
+// Function to add a file to a tar archive as a ustar member (with a PAX header for fields ustar cannot hold)
+// const char *fpath: The path of the file to read. const char *name: The name stored in the archive.
+// const struct stat *sb: Mode, owner, size and mtime for the header; NULL (or an empty stat) to use fstat().
+// struct archive_writer *tarfile: The open archive. Returns 0 (also when an unreadable file is skipped), or -1 if writing failed.
+
+struct archive_writer *tar_open_archive(const char *path, int codec);
+// Function to open a tar archive compressed with codec (enum archive_codec) for writing once for the whole tar mode.
+// gzip and lz4 data is compressed in blocks by --archive-threads threads. Returns NULL on failure (a message has been printed).
+
+int archive_codec_for_name(const char *name);
+// Function to pick the codec from the archive name: ".gz"/".tgz" gzip, ".zst"/".tzst" zstd, ".lz4" lz4, otherwise gzip
+
+int archive_extract(const char *archive_path, const char *dest_dir, const char *name);
+// Function to unpack the archive into dest_dir, or only the members whose archive path or file name is name (NULL:
+// all of them). Members of bgzf archives are found through the member index, reading only the blocks that hold
+// them. Data is decompressed and written by --archive-threads threads. Prints the path of every file written.
+// Returns 0 on success, -1 if nothing matched or on failure (a message has been printed).
+
+int archive_benchmark(const char *tar_path);
+// Function to compress the uncompressed tar archive tar_path with every available codec and print the size, ratio
+// and throughput of each (--codec-bench). Returns 0 on success, -1 after printing an error.
+
+int tar_close_archive(struct archive_writer *tarfile);
+// Function to write the end-of-archive marker and close the archive. Returns 0 on success, -1 on a write error.
 void copy_or_move_file(const char *src_path, const char *dest_path); 
 // Function to copy or move a file
 // const char *src_path: This argument represents the path of the source file to be copied or moved. It's a pointer to a null-terminated string (const char *).
 // const char *dest_path: This argument represents the path of the destination where the source file will be copied or moved. It's a pointer to a null-terminated string (const char *).
 
+int parse_options(int argc, char *argv[]);
+// Function to strip "--option" flags out of argv before the positional arguments are interpreted
+// int argc, char *argv[]: The arguments passed to main(). Options are removed in place and the remaining positional arguments are moved to the front.
+// Returns the new argument count (including argv[0]), or -1 if an option is unknown or is missing its value.
+
+int walk_tree(const char *root, walk_callback fn);
+// Function to walk the directory tree below root and call fn for every entry, using the backend selected by --walker
+// const char *root: The directory (or file) at which the walk starts.
+// walk_callback fn: The callback invoked for each entry with the same arguments nftw() would pass. A nonzero return stops the walk.
+// Returns -1 on error (errno set), the callback's nonzero return value if it stopped the walk, or 0 otherwise.
+
+int parallel_walk(const char *root, walk_callback fn, int nthreads);
+// Function to walk the tree with nthreads worker threads that each own a deque of directories and steal from each other when idle
+// Callbacks are serialized with a mutex, so callbacks written for nftw() (which use global state) can be reused unchanged.
+// With --ordered every entry is recorded and the callbacks only run after the walk, so a callback returning WALK_STOP
+// (--first / --max-results) ends the replay, not the walk: the first matches in path order are only known once the
+// whole tree has been read.
+
+struct file_index; // Defined with the index code below main's helpers
+struct index_dir_entry; // Directory record collected while building an index
+
+int index_build(const char *root, const char *index_file);
+// Function to walk root once and write a sorted, mmap-able index of every regular file below it to index_file
+// Returns 0 on success, -1 on failure (a message has been printed).
+
+int index_search(const char *index_file, const char *root, const char *name);
+// Function to look name up in index_file by binary search and pass every match below root to process_found_file()
+// Returns -1 on failure (a message has been printed), otherwise 0 or the value process_found_file() stopped with.
+
+int index_open(struct file_index *idx, const char *index_file);
+void index_close(struct file_index *idx);
+int index_path_at(const struct file_index *idx, uint64_t id, char *buf);
+int index_write(const char *index_file, const char *canonical_root, char **paths, size_t count, struct index_dir_entry *dirs, size_t dir_count);
+// Helpers shared by the index modes: open/validate and mmap an index, release it, decode the path with a given id,
+// and write a new index from a sorted list of paths and the directory records below canonical_root.
+
+int index_search_substring(const char *index_file, const char *root, const char *query);
+// Function to find every indexed file below root whose basename contains query (the tar mode's strstr test) using
+// the trigram posting lists, and pass each one to archive_found_file(). Returns -1 on failure, otherwise 0 or the
+// value archive_found_file() stopped with.
+
+int search_names(const char *names_file, const char *root);
+// Function to resolve every name listed in names_file below root in a single traversal, printing "name<TAB>path"
+// for each match as it is found and the names that were not found at the end. Returns 0 on success, -1 on failure.
+
+int copy_range(int src_fd, int dst_fd, off_t offset, off_t len, int *method, int concurrent, uint32_t *crc);
+// Function to copy len bytes starting at offset from src_fd to the same offset of dst_fd (the file positions are not
+// used, except by the sendfile method which moves dst_fd's; concurrent callers sharing dst_fd set concurrent so that
+// method is skipped). *method is the method to start with; it is advanced past methods the kernel refuses for this
+// pair of files and holds the method that did the copy on return. Unless crc is NULL, *crc is extended with the
+// CRC32C of the range: the data then goes through read/write (a cloned range is read back instead).
+// Returns 0 on success (also if the source ends before len bytes), -1 on failure with errno set.
+
+int copy_file_data(const char *src_path, const char *dest_path, const char **method_used);
+// Function to copy the contents of src_path to dest_path (created or truncated) with the copy engine; with
+// --reflink always the clone goes to a temporary file that is renamed over dest_path, which a failure leaves alone
+// Sets *method_used to the name of the method that copied the data. Returns 0 on success, -1 after printing an error.
+
+int move_file_across(const char *src_path, const char *dest_path, const char **method_used);
+// Function to move a file where rename() fails with EXDEV: copy it with the copy engine into a temporary file next
+// to dest_path, give it the source's owner, mode, timestamps and extended attributes, fsync it, rename it over
+// dest_path, fsync the directory and only then unlink the source. Returns 0 on success, -1 after printing an error
+// (the source is left in place and no partial destination remains).
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+// Function to extend a CRC32C checksum (start with 0) with len bytes, using SSE4.2 when the CPU has it
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+// Function to compute the CRC32C of two pieces of data from their CRCs, for pieces copied out of order
+
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len);
+// Function to extend a CRC32C checksum with len zero bytes, for the holes of sparse copies
+
+int verify_copy(const char *path, uint32_t expected);
+// Function to re-read a copied file bypassing the page cache and compare its CRC32C with expected
+// Returns 0 if it matches, -1 after printing an error.
+
+int update_file(const char *src_path, const char *dest_path, long *rewritten, long *blocks);
+// Function to compare an existing destination with its source for --update. Returns 1 if it is already identical
+// (nothing written), 2 if it has to be copied in full, 0 after rewriting the differing blocks (--update strict;
+// *rewritten of *blocks blocks were written), or -1 after printing an error. Unless it returns 2, copy_crc holds the
+// source's digest (with --checksum) and the destination has been verified against it (with --verify).
+
+int copy_resumable(const char *src_path, const char *dest_path, off_t *resumed_from);
+// Function to copy src_path to dest_path through "<dest>.part" and a "<dest>.journal" progress journal, resuming an
+// interrupted copy of the same source from its last verified commit. Sets *resumed_from to the offset the copy
+// continued from (0 for a fresh copy). Returns 0 on success, -1 after printing an error (the part file and journal
+// are kept for the next attempt).
+
+int run_command(int argc, char *argv[]);
+// Function to run one search, copy/move or archive request given its positional arguments (argv[0] is ignored)
+// Returns the exit status. Used by main() and, per request line, by the query server.
+
+int search_file(void);
+// Function to find enteredFileName below rootDir (from the server's cache, the --index index or a walk) and hand
+// every match to process_found_file(). Returns -1 on failure (a message has been printed), otherwise 0 or WALK_STOP.
+
+void search_cache_record(const char *fpath);
+// Function to remember a match of the running search for the query server's result cache
+
+int run_server(const char *socket_path);
+// Function to serve search, copy/move and archive requests on a Unix socket with warm caches until SIGINT/SIGTERM
+
+int run_client(const char *socket_path);
+// Function to send standard input (request lines) to a server or daemon socket and print the replies
+
+int run_line_server(const char *socket_path, int event_fd, int (*on_event)(void), int (*on_line)(int client, char *line));
+// Function to accept clients on a Unix socket and hand every request line to on_line; shared by daemon and server
+
+int run_daemon(const char *socket_path, const char *root);
+// Function to index root in memory, keep the index current from fanotify/inotify events and answer file name
+// lookups on a Unix socket until SIGINT/SIGTERM. Returns 0 after a clean shutdown, -1 if it could not start.
+
+int index_update(const char *root, const char *index_file);
+// Function to refresh index_file for root, re-reading only the directories whose mtime/ctime/inode changed
+// Falls back to index_build() when there is no usable index yet. Returns 0 on success, -1 on failure.
+
 //-----------------------------------------------------------------------------
 
 // Function to check if a directory exists
@@ -82,28 +346,46 @@ int search_and_process(const char *fpath, const struct stat *sb, int typeflag, s
         // fpath is a pointer to a null-terminated string representing the full path of the current file being processed
         // ftwbuf->base is an offset representing the start position of the filename within the full path. In the expression ftwbuf->base, base is  a member of the struct FTW structure referenced by the pointer ftwbuf.
         // fpath + ftwbuf->base advances the pointer fpath by ftwbuf->base positions, effectively pointing it to the start of the filename portion within the full path. This expression ensures that we are comparing only the filename part of the path.
-        found_file = strdup(fpath); //If the conditions are met, it duplicates the path of the fpath using the strdup function and stores it in the found_file variable.
-        
-        if (operation) {
-            // Checks if an operation is specified (operation is not NULL or 0). If an operation is specified, it means the user wants to perform a copy or move operation on the found file.
-            char dest_path[PATH_MAX]; // Buffer to store the destination path 
-            snprintf(dest_path, sizeof(dest_path), "%s/%s", storageDir, enteredFileName); 
-            // snprintf formats the destination path by combining the storageDir and enteredFileName into a single string, separated by a forward slash (/), and writes the formatted path to the dest_path buffer
-            // dest_path: destination buffer where the formatted string will be written. It's a character array representing the path to the destination.
-            // Check if the storage directory exists using "directory_exists" function.
-            // sizeof(dest_path): This specifies the size of the buffer dest_path. It ensures that snprintf does not write more characters than the size of the buffer, preventing buffer overflow.
-            // storageDir: This is the first additional argument corresponding to the first %s format specifier in the format string. It's a pointer to a null-terminated string (const char *) containing the path of the storage directory.
-            //enteredFileName: This is the second additional argument corresponding to the second %s format specifier in the format string. It's a pointer to a null-terminated string (const char *) containing the name of the file entered by the user.
-            if (!directory_exists(storageDir)) { // Checks if the storage directory exists using the directory_exists function. 
-                printf("Search Successful: Invalid storageDir\n");
-                return 1; // returns 1 to indicate failure
-            }
-
-            copy_or_move_file(found_file, dest_path); // Copy or move the file
-        } else {
-            printf("%s\n", found_file); // Print the absolute path of the found file
+        return process_found_file(fpath); // Copy/move or print it, and decide whether the walk should go on
+    }
+    return 0; // Return 0 to continue searching
+}
+
+// Function to handle one matching file: copy/move it to storageDir or print its path
+int process_found_file(const char *fpath) {
+    free(found_file); // Release the previous match, if any, so repeated matches do not leak
+    found_file = strdup(fpath); // Duplicate the path of the fpath using the strdup function and store it in the found_file variable.
+    if (!found_file) {
+        perror("strdup");
+        return 1; // Return 1 to stop the walk with a failure
+    }
+    match_count++; // One more match found
+    if (search_cache_recording) {
+        search_cache_record(fpath); // The query server caches the matches of this search
+    }
+
+    if (operation) {
+        // Checks if an operation is specified (operation is not NULL or 0). If an operation is specified, it means the user wants to perform a copy or move operation on the found file.
+        char dest_path[PATH_MAX]; // Buffer to store the destination path 
+        snprintf(dest_path, sizeof(dest_path), "%s/%s", storageDir, enteredFileName); 
+        // snprintf formats the destination path by combining the storageDir and enteredFileName into a single string, separated by a forward slash (/), and writes the formatted path to the dest_path buffer
+        // dest_path: destination buffer where the formatted string will be written. It's a character array representing the path to the destination.
+        // Check if the storage directory exists using "directory_exists" function.
+        // sizeof(dest_path): This specifies the size of the buffer dest_path. It ensures that snprintf does not write more characters than the size of the buffer, preventing buffer overflow.
+        // storageDir: This is the first additional argument corresponding to the first %s format specifier in the format string. It's a pointer to a null-terminated string (const char *) containing the path of the storage directory.
+        //enteredFileName: This is the second additional argument corresponding to the second %s format specifier in the format string. It's a pointer to a null-terminated string (const char *) containing the name of the file entered by the user.
+        if (!directory_exists(storageDir)) { // Checks if the storage directory exists using the directory_exists function. 
+            printf("Search Successful: Invalid storageDir\n");
+            return 1; // returns 1 to indicate failure
         }
-        return 0; // Return 0 to continue searching
+
+        copy_or_move_file(found_file, dest_path); // Copy or move the file
+    } else {
+        printf("%s\n", found_file); // Print the absolute path of the found file
+    }
+
+    if (max_results > 0 && match_count >= max_results) {
+        return WALK_STOP; // Enough matches (--first / --max-results): stop the walk and cancel queued directories
     }
     return 0; // Return 0 to continue searching
 }
@@ -122,221 +404,8119 @@ int search_and_create_tar(const char *fpath, const struct stat *sb, int typeflag
         // extension is a pointer to a string containing the file extension to search for.
         // != NULL: condition checks if the strstr() function successfully found the specified extension in the file path.
         
-        printf("%s\n", fpath); // Print the path of the found file
-
-        // Create tar file
-        // This block of code prepares to create and open a gzip-compressed tar archive file (tarfile). It constructs the filename for the tar archive, attempts to open the file, and handles errors if the file opening operation fails.
-        char tarfilename[PATH_MAX]; // Buffer to store the tar file name
-        snprintf(tarfilename, sizeof(tarfilename), "%s/a1.tar", storageDir); // Create the tar file name
-        // snprintf function combines the storageDir path with /a1.tar to create the filename for the tar archive, 
-        //and stores the resulting string in the tarfilename buffer. 
-        // tarfilename: It is a buffer.
-        // sizeof(tarfilename): returns the size of the tarfilename buffer in bytes.
-        // "%s/a1.tar": It specifies the format in which the output string will be constructed.
-        // storageDir:  is a pointer to a string containing the directory where the tar archive will be stored.
-        gzFile tarfile = gzopen(tarfilename, "wb"); // Open the tar file for writing in gzip format
-        // gzopen is a function provided by the zlib library for opening gzip files.
-        // tarfilename: This is a string representing the filename of the gzip file to be opened. It is the filename that was constructed earlier using snprintf.
-        // "wb": This is a string specifying the mode in which the file will be opened.
-        // gzFile : It is a type representing a gzip file pointer.
-        // tarfile : This variable will hold the pointer to the opened gzip file.
-
-        if (!tarfile) { // If the gzopen function fails to open the file, it returns NULL.
-            perror("gzopen"); // Print an error message if opening the tar file fails
-            return 1; // Return 1 to indicate failure
-        }
-
-        add_file_to_tar(fpath, fpath + ftwbuf->base, tarfile); // Add file to the tar file
-
-        // Close the tar file
-        gzclose(tarfile);
+        return archive_found_file(fpath, ftwbuf->base, sb); // Add it to the archive with the metadata the walker read
     }
     return 0; // Return 0 to continue searching
 }
 
-// Function to add a file to the tar file
-void add_file_to_tar(const char *dir_path, const char *filename, gzFile tarfile) {
-// this block of code adds a file to a tar archive. It constructs the full path of the file, opens the file for reading,
-// reads its contents into a buffer, and then writes the contents of the buffer to the tar archive
+// Function to print a file that matched the extension and add it to the archive in storageDir
+int archive_found_file(const char *fpath, int base, const struct stat *sb) {
+    printf("%s\n", fpath); // Print the path of the found file
+    (void)base;
 
-    // const char *dir_path: This argument represents the path of the directory where the file to be added to the tar archive is located.
-    // const char *filename:This argument represents the name of the file to be added to the tar archive.
-    // gzFile tarfile: This argument represents the gzip file pointer to the tar archive.
-    char filepath[PATH_MAX]; // This buffer will store the full path of the file to be added to the tar archive.
-    snprintf(filepath, sizeof(filepath), "%s/%s", dir_path, filename); 
-    // Create the file path to be added to the tar archive
-    // the snprintf function combines the dir_path (directory path) and filename to create the full path of the 
-    //file to be added to the tar archive, and stores the resulting string in the filepath buffer.
-    // It combines the directory path (dir_path) and the filename (filename) with a forward slash ("/").
-    //filepath: The resulting above formatted string is stored in the filepath buffer. It is an array of characters (char[]) intended to hold the full path of the file.
-    FILE *file = fopen(filepath, "rb"); // Open the file for reading in binary mode
-    // This line opens the file specified by the filepath for reading in binary mode ("rb").
-    if (!file) { // If opening the file fails, it returns NULL, indicating an error.
-        // Skip directories
-        if (errno == EISDIR) {
-            // the code checks if the error is due to the entry being a directory (indicated by errno == EISDIR), and if so, it skips the directory entry and returns without processing.
-            return; // Return if the entry is a directory
-        }
-        return; // Return if opening the file fails
+    // Store the file under its path relative to rootDir, as "tar -C rootDir" would
+    const char *name = fpath;
+    size_t root_len = strlen(rootDir);
+    while (root_len > 1 && rootDir[root_len - 1] == '/') {
+        root_len--; // Ignore trailing slashes of the root
+    }
+    if (strncmp(fpath, rootDir, root_len) == 0 && fpath[root_len] == '/') {
+        name = fpath + root_len + 1;
+    }
+    while (*name == '/') {
+        name++; // Never store absolute names
     }
 
-    char buffer[1024]; // Buffer to store data read from the file
-    size_t bytes_read; // Variable to store the number of bytes read
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) { // Read data from the file
-        if (gzwrite(tarfile, buffer, bytes_read) != bytes_read) { // Write data to the tar file
-        // The gzwrite function writes the data from the buffer to the tar archive (tarfile).
-            fprintf(stderr, "Error writing to tar file\n"); // Print an error message if writing to the tar file fails
-            fclose(file); // Close the file
-            return; // Return to indicate failure
-        }
+    if (add_file_to_tar(fpath, name, sb, tar_archive) != 0) {
+        return 1; // Writing the archive failed: stop the walk
     }
+    return 0; // Return 0 to continue searching
+}
 
-    fclose(file); // Close the file
+// Function to check whether a file name contains the extension given for the tar mode
+int tar_name_matches(const char *name) {
+    return strstr(name, extension) != NULL; // Same test search_and_create_tar applies
 }
 
+static int copy_times(const char *path, const struct stat *st);
+
 // Function to copy or move a file
 void copy_or_move_file(const char *src_path, const char *dest_path) {
     if (strcmp(operation, "-cp") == 0) { // Check if the operation is copy
-        FILE *src_file = fopen(src_path, "rb"); 
-        //This assigns the pointer returned by fopen() to the variable src_file.
-        //This declares a pointer variable named src_file of type FILE *
-        // Open the source file for reading in binary mode
-        if (!src_file) { // Check if opening the source file fails
-            perror("fopen source file"); // Print an error message
-            return; // Return to indicate failure
-        }
-
-        FILE *dest_file = fopen(dest_path, "wb"); // Open the destination file for writing in binary mode
-        if (!dest_file) { // Check if opening the destination file fails
-            perror("fopen destination file"); // Print an error message
-            fclose(src_file); // Close the source file
-            return; // Return to indicate failure
-        }
-
-        char buffer[1024]; // Buffer to store data read from the source file
-        size_t bytes_read; // Variable to store the number of bytes read
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), src_file)) > 0) {
-        // This block of code continuously reads data from the source file (src_file) in chunks and writes it to the destination file (dest_file) until the end of the source file is reached.
-        // bytes_read variable will hold the number of bytes read by the fread() function
-        // buffer: This is a pointer to the memory location where the data read from the file will be stored. It should be large enough to hold the data being read. In this case, buffer is typically an array of bytes.
-        // 1: This argument specifies the size of each element to be read from the file. Since we're reading bytes, it's set to 1.
-
-            if (fwrite(buffer, 1, bytes_read, dest_file) != bytes_read) { // Write data to the destination file
-            // fwrite writes data from the buffer to the file represented by dest_file.
-            // buffer: Pointer to the memory location containing the data to be written to the file
-            // 1: Specifies the size of each element to be written. In this case, it's set to 1 because fwrite() writes one byte at a time.
-            // bytes_read: Specifies the number of elements to be written. It represents the number of bytes read from the source file in the current iteration of the loop.
-            // dest_file: Pointer to the FILE structure representing the destination file.
-            // If fwrite() successfully writes all the elements, it returns the same value as bytes_read. However, if it fails to write all the elements (due to disk full or other reasons), it will return a value less than bytes_read.
-                perror("fwrite"); // Print an error message
-                fclose(src_file); // Close the source file
-                fclose(dest_file); // Close the destination file
-                return; // Return to indicate failure
+        if (update_mode != UPDATE_NONE) { // Leave an identical destination alone (--update)
+            long rewritten, blocks;
+            int state = update_file(src_path, dest_path, &rewritten, &blocks);
+            if (state == -1) {
+                return; // Return to indicate failure (update_file already printed the reason)
+            }
+            if (state != 2) {
+                printf("Search Successful\n"); // Print a success message
+                if (state == 1) {
+                    printf("File already up to date in the storageDir\n");
+                } else {
+                    printf("File updated in the storageDir (%ld of %ld blocks rewritten)\n", rewritten, blocks);
+                }
+                if (copy_checksum) {
+                    printf("Checksum (crc32c): %08x%s\n", copy_crc, copy_verify ? " verified" : ""); // Digest of the source's data
+                }
+                return;
             }
         }
 
-        fclose(src_file); // Close the source file
-        fclose(dest_file); // Close the destination file
+        const char *method_used; // Name of the copy method that moved the data
+        if (copy_resume) {
+            off_t resumed_from; // Offset an interrupted earlier attempt had reached
+            if (copy_resumable(src_path, dest_path, &resumed_from) != 0) {
+                return; // Return to indicate failure (copy_resumable already printed the reason)
+            }
+            if (resumed_from > 0) {
+                printf("Resumed copy at byte %lld\n", (long long)resumed_from);
+            }
+            method_used = "journaled";
+        } else if (copy_file_data(src_path, dest_path, &method_used) != 0) { // Copy with the fastest method these files allow
+            return; // Return to indicate failure (copy_file_data already printed the reason)
+        }
+        struct stat src_st;
+        if (update_mode != UPDATE_NONE && (stat(src_path, &src_st) != 0 || copy_times(dest_path, &src_st) != 0)) {
+            perror("utimensat"); // Without the source's mtime the next --update fast run would copy again
+            return;
+        }
 
         printf("Search Successful\n"); // Print a success message
         printf("File copied to the storageDir\n"); // Print a message indicating the destination directory
+        printf("Copy method: %s\n", method_used); // Report which copy path the engine used
+        if (copy_checksum) {
+            printf("Checksum (crc32c): %08x%s\n", copy_crc, copy_verify ? " verified" : ""); // Digest of the copied data
+        }
     } else if (strcmp(operation, "-mv") == 0) { // Check if the operation is move
+        const char *method_used = NULL; // Copy method, when the move had to copy the data
         if (rename(src_path, dest_path) != 0) { // Rename function changes the file path from the source file to dest path.
-            perror("rename"); // Print an error message if renaming fails
-            return; // Return to indicate failure
+            if (errno != EXDEV) {
+                perror("rename"); // Print an error message if renaming fails
+                return; // Return to indicate failure
+            }
+            // storageDir is on another filesystem: copy, sync, then remove the source
+            if (move_file_across(src_path, dest_path, &method_used) != 0) {
+                return; // Return to indicate failure (move_file_across already printed the reason)
+            }
         }
         printf("Search Successful\n"); // Print a success message
         printf("File moved to the storageDir\n"); // Print a message indicating the destination directory
+        if (method_used) {
+            printf("Copy method: %s\n", method_used); // Report which copy path the cross-filesystem move used
+            if (copy_checksum) {
+                printf("Checksum (crc32c): %08x%s\n", copy_crc, copy_verify ? " verified" : ""); // Digest of the moved data
+            }
+        }
+    }
+}
+
+// Compare an option name (not null-terminated, it may be followed by "=value") with the expected name
+static int option_is(const char *name, size_t name_len, const char *option) {
+    return strlen(option) == name_len && strncmp(name, option, name_len) == 0;
+}
+
+// Function to strip "--option" flags out of argv
+int parse_options(int argc, char *argv[]) {
+    int positional = 1; // Next slot for a positional argument (argv[0] stays in place)
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) { // Not an option: keep it as a positional argument
+            argv[positional++] = argv[i];
+            continue;
+        }
+
+        // Options either take their value after '=' ("--threads=8") or from the next argument ("--threads 8")
+        const char *name = arg + 2; // Option name without the leading dashes
+        const char *value = strchr(name, '='); // Inline value, if any
+        size_t name_len = value ? (size_t)(value - name) : strlen(name); // Length of the option name
+        if (value) {
+            value++; // Skip the '='
+        }
+
+        if (option_is(name, name_len, "ordered")) {
+            walk_ordered = 1; // Flag without a value
+            continue;
+        }
+        if (option_is(name, name_len, "first")) {
+            max_results = 1; // Stop at the first match
+            continue;
+        }
+        if (option_is(name, name_len, "resume")) {
+            copy_resume = 1; // Journaled, resumable copies
+            continue;
+        }
+        if (option_is(name, name_len, "checksum")) {
+            copy_checksum = 1; // CRC32C of copied data
+            continue;
+        }
+        if (option_is(name, name_len, "verify")) {
+            copy_checksum = 1; // Verification compares checksums
+            copy_verify = 1;
+            continue;
+        }
+        if (option_is(name, name_len, "codec-bench")) {
+            codec_bench = 1; // Compare the archive codecs instead of writing the archive
+            continue;
+        }
+        if (option_is(name, name_len, "direct-hugepages")) {
+            direct_hugepages = 1; // Huge pages for the O_DIRECT buffer pool
+            continue;
+        }
+
+        if (!value) { // Every remaining option needs a value
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing value for option %s\n", arg);
+                return -1;
+            }
+            value = argv[++i];
+        }
+
+        if (option_is(name, name_len, "index")) {
+            index_path = value; // Search this index instead of walking
+        } else if (option_is(name, name_len, "index-build")) {
+            index_build_path = value; // Build mode
+        } else if (option_is(name, name_len, "daemon")) {
+            daemon_socket = value; // Live index daemon mode
+        } else if (option_is(name, name_len, "watch")) {
+            if (strcmp(value, "auto") != 0 && strcmp(value, "fanotify") != 0 && strcmp(value, "inotify") != 0) {
+                fprintf(stderr, "Invalid watch backend: %s\n", value);
+                return -1;
+            }
+            watch_backend = value; // Event source of the daemon
+        } else if (option_is(name, name_len, "names")) {
+            names_path = value; // Batch search
+        } else if (option_is(name, name_len, "names-match")) {
+            if (strcmp(value, "exact") != 0 && strcmp(value, "substring") != 0) {
+                fprintf(stderr, "Invalid names match: %s\n", value);
+                return -1;
+            }
+            names_match = value;
+        } else if (option_is(name, name_len, "copy-method")) {
+            copy_method = -1;
+            for (int m = 0; m <= COPY_METHOD_URING; m++) {
+                if (strcmp(value, copy_method_names[m]) == 0) {
+                    copy_method = m; // Start the copy engine at this method
+                }
+            }
+            if (copy_method < 0) {
+                fprintf(stderr, "Invalid copy method: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "copy-uring-depth")) {
+            copy_uring_depth = atoi(value); // Copy requests in flight
+            if (copy_uring_depth < 1 || copy_uring_depth > 1024) {
+                fprintf(stderr, "Invalid io_uring queue depth: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "copy-buffer-size")) {
+            long kib = atol(value); // Size of each io_uring copy buffer in KiB
+            if (kib < 4 || kib > 65536) {
+                fprintf(stderr, "Invalid copy buffer size: %s\n", value);
+                return -1;
+            }
+            copy_uring_buffer_size = (size_t)kib << 10;
+        } else if (option_is(name, name_len, "codec")) {
+            archive_codec = -1;
+            for (int i = 0; i <= CODEC_NONE; i++) {
+                if (strcmp(value, archive_codec_names[i]) == 0) {
+                    archive_codec = i;
+                }
+            }
+            if (archive_codec == -1) {
+                fprintf(stderr, "Unknown codec: %s (expected gzip, zstd, lz4 or none)\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "archive-level")) {
+            archive_level = atoi(value); // Compression level, checked against the codec when the archive is opened
+            if (archive_level < -1 || archive_level > 22) {
+                fprintf(stderr, "Invalid compression level: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "archive-name")) {
+            archive_name = value; // File name of the archive in storageDir
+            if (!*archive_name || strchr(archive_name, '/')) {
+                fprintf(stderr, "Invalid archive name: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "archive-format")) {
+            if (strcmp(value, "stream") == 0) {
+                archive_format = FORMAT_STREAM;
+            } else if (strcmp(value, "bgzf") == 0) {
+                archive_format = FORMAT_BGZF;
+            } else {
+                fprintf(stderr, "Unknown archive format: %s (expected stream or bgzf)\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "extract")) {
+            extract_archive = value; // Extraction mode
+        } else if (option_is(name, name_len, "archive-threads")) {
+            archive_threads = atoi(value); // Threads compressing or unpacking the archive
+            if (archive_threads < 0 || archive_threads > 1024) {
+                fprintf(stderr, "Invalid thread count: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "archive-block-size")) {
+            long kib = atol(value); // Uncompressed size of each compressed block in KiB
+            if (kib < 32 || kib > 65536) {
+                fprintf(stderr, "Invalid archive block size: %s\n", value);
+                return -1;
+            }
+            archive_block_size = (size_t)kib << 10;
+        } else if (option_is(name, name_len, "copy-threads")) {
+            copy_threads = atoi(value); // Threads copying one large file
+            if (copy_threads < 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "copy-parallel-threshold")) {
+            long mib = atol(value); // Size in MiB from which files are copied in parallel chunks
+            if (mib < 0) {
+                fprintf(stderr, "Invalid copy threshold: %s\n", value);
+                return -1;
+            }
+            copy_parallel_threshold = (off_t)mib << 20;
+        } else if (option_is(name, name_len, "sparse")) {
+            if (strcmp(value, "auto") == 0) {
+                sparse_mode = SPARSE_AUTO; // Keep the holes of sources that have some
+            } else if (strcmp(value, "always") == 0) {
+                sparse_mode = SPARSE_ALWAYS;
+            } else if (strcmp(value, "never") == 0) {
+                sparse_mode = SPARSE_NEVER;
+            } else {
+                fprintf(stderr, "Invalid sparse mode: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "update")) {
+            if (strcmp(value, "fast") == 0) {
+                update_mode = UPDATE_FAST; // Size and modification time decide
+            } else if (strcmp(value, "strict") == 0) {
+                update_mode = UPDATE_STRICT; // Contents decide, only differing blocks are written
+            } else {
+                fprintf(stderr, "Invalid update mode: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "reflink")) {
+            if (strcmp(value, "auto") == 0) {
+                reflink_mode = REFLINK_AUTO; // Clone when the filesystem allows it, copy otherwise
+            } else if (strcmp(value, "always") == 0) {
+                reflink_mode = REFLINK_ALWAYS;
+            } else if (strcmp(value, "never") == 0) {
+                reflink_mode = REFLINK_NEVER;
+            } else {
+                fprintf(stderr, "Invalid reflink mode: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "serve")) {
+            serve_socket = value; // Query server mode
+        } else if (option_is(name, name_len, "client")) {
+            client_socket = value; // Client of a server or daemon
+        } else if (option_is(name, name_len, "cache-size")) {
+            search_cache_size = atol(value); // Cached searches
+            if (search_cache_size < 0) {
+                fprintf(stderr, "Invalid cache size: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "cache-ttl")) {
+            search_cache_ttl = atol(value); // Cache lifetime in seconds
+            if (search_cache_ttl < 0) {
+                fprintf(stderr, "Invalid cache ttl: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "index-update")) {
+            index_update_path = value; // Incremental refresh mode
+        } else if (option_is(name, name_len, "threads")) {
+            walk_threads = atoi(value); // Number of walker threads
+            if (walk_threads < 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "reader")) {
+            if (strcmp(value, "getdents") != 0 && strcmp(value, "readdir") != 0) {
+                fprintf(stderr, "Invalid reader: %s\n", value);
+                return -1;
+            }
+            walk_reader = value; // Directory reader of the parallel walker
+        } else if (option_is(name, name_len, "getdents-buffer")) {
+            long size = atol(value); // Buffer size in KiB
+            if (size < 4) {
+                fprintf(stderr, "Invalid getdents buffer size: %s\n", value);
+                return -1;
+            }
+            walk_dirent_buffer_size = (size_t)size * 1024;
+        } else if (option_is(name, name_len, "max-results")) {
+            max_results = atol(value); // Stop after this many matches
+            if (max_results < 1) {
+                fprintf(stderr, "Invalid result limit: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "stat-engine")) {
+            if (strcmp(value, "uring") != 0 && strcmp(value, "sync") != 0) {
+                fprintf(stderr, "Invalid stat engine: %s\n", value);
+                return -1;
+            }
+            stat_engine = value; // Batched io_uring stats or synchronous fstatat()
+        } else if (option_is(name, name_len, "uring-depth")) {
+            walk_uring_depth = atoi(value); // Queue depth of each worker's ring
+            if (walk_uring_depth < 1 || walk_uring_depth > 4096) {
+                fprintf(stderr, "Invalid io_uring queue depth: %s\n", value);
+                return -1;
+            }
+        } else if (option_is(name, name_len, "walker")) {
+            if (strcmp(value, "parallel") != 0 && strcmp(value, "nftw") != 0) {
+                fprintf(stderr, "Invalid walker: %s\n", value);
+                return -1;
+            }
+            walker = value; // Traversal backend
+        } else {
+            fprintf(stderr, "Invalid option: %s\n", arg);
+            return -1;
+        }
+    }
+    argv[positional] = NULL; // Keep argv NULL-terminated like the original
+    return positional;
+}
+
+// Function to walk the tree with the backend selected on the command line
+int walk_tree(const char *root, walk_callback fn) {
+    if (strcmp(walker, "nftw") == 0) {
+        return nftw(root, fn, 20, FTW_PHYS); // Original single-threaded walk; FTW_PHYS does not follow symbolic links
+    }
+
+    int nthreads = walk_threads; // Thread count from --threads
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN); // Default to one thread per online CPU
+        nthreads = cpus > 0 ? (int)cpus : 1;
     }
+    return parallel_walk(root, fn, nthreads);
 }
 
 // ---------------------------------------------------------------------------------------
+// Minimal io_uring wrapper
+//
+// The program talks to io_uring through the raw system calls so it does not need liburing. Every user owns its
+// ring (rings are not shared between threads). uring_init() fails cleanly on kernels or sandboxes without io_uring,
+// and every caller keeps its synchronous code path for that case.
 
-int main(int argc, char *argv[]) {
-    // Main function accepts command-line arguments (argc and argv)
-    // argc is the number of arguments passed to the program, and argv is an array of strings containing the arguments.
+// One io_uring instance with its mapped submission and completion queues
+struct uring {
+    int fd; // Ring file descriptor, -1 when the ring is not set up
+    unsigned entries; // Number of submission queue entries
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; // Submission queue ring fields (shared with the kernel)
+    struct io_uring_sqe *sqes; // Submission queue entries
+    unsigned *cq_head, *cq_tail, *cq_mask; // Completion queue ring fields (shared with the kernel)
+    struct io_uring_cqe *cqes; // Completion queue entries
+    void *sq_ring; // Mapping of the submission queue ring
+    size_t sq_ring_size; // Size of that mapping
+    void *cq_ring; // Mapping of the completion queue ring (NULL when it shares the submission mapping)
+    size_t cq_ring_size; // Size of that mapping
+    size_t sqes_size; // Size of the sqes mapping
+    unsigned sq_local_tail; // Tail including entries prepared but not submitted yet
+};
 
-    // Check the number of arguments passed
-    // Depending on the number of arguments, different parts of the program logic will be executed.
+// Set up a ring with the given number of entries. Returns 0 on success, -1 (errno set) if io_uring is unavailable.
+int uring_init(struct uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
 
-    if (argc == 3) {
-        // Part 1: Search for a file in the specified directory subtree
-        // If the number of arguments is 3, the program searches for a file in the specified directory subtree.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params); // ENOSYS on old kernels, EPERM when blocked by seccomp
+    if (fd < 0) {
+        return -1;
+    }
 
-        // It retrieves the root directory path (rootDir) and the entered file name (enteredFileName) from the command-line arguments.
-        rootDir = argv[1]; // Store the root directory path
-        enteredFileName = argv[2]; // Store the entered file name
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0; // Both rings live in one mapping on 5.4+
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
 
-        // Check if the root directory exists
-        if (!directory_exists(rootDir)) {
-            fprintf(stderr, "Invalid rootDir\n"); // Print an error message
-            return 1; // Return to indicate failure
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    void *cq_ring = ring->sq_ring;
+    if (!single_mmap) {
+        cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(fd);
+            return -1;
+        }
+        ring->cq_ring = cq_ring;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
         }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(fd);
+        return -1;
+    }
 
-        // Search for the file using nftw() function
-        // It searches for the file using the nftw function with the search_and_process callback.
-        if (nftw(rootDir, search_and_process, 20, FTW_PHYS) == -1) {
-            perror("nftw"); // Print an error message
-            return 1; // Return to indicate failure
+    char *sq = ring->sq_ring; // Byte pointers for the offsets the kernel reported
+    char *cq = cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->fd = fd;
+    return 0;
+}
+
+// Tear down a ring set up by uring_init()
+void uring_exit(struct uring *ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// Get a cleared submission entry, or NULL when the submission queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE); // The kernel advances the head as it consumes entries
+    if (ring->sq_local_tail - head >= ring->entries) {
+        return NULL;
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index; // Identity mapping between array slots and sqes
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Submit every prepared entry and wait until at least wait_nr completions are available. Returns 0 or -errno.
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE); // Publish the new entries to the kernel
+    for (;;) {
+        // Entries the kernel has not consumed yet: a partial submission (or an interrupted call) leaves some behind
+        unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        long rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
         }
+        if ((unsigned long)rc >= to_submit) {
+            return 0; // Everything is in flight, and the kernel only waits once it has submitted everything
+        }
+        if (rc == 0) {
+            return -EAGAIN; // No progress (out of resources): let the caller fall back
+        }
+    }
+}
 
-        // Print a message if the file is not found
-        if (found_file == NULL) {
-            printf("Search Unsuccessful\n"); // Print a message indicating that the search was unsuccessful
+// Take back the prepared entries the kernel has not consumed yet (after a failed uring_submit_and_wait()), so that
+// they are never issued. Returns how many were taken back.
+unsigned uring_unsubmit(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned count = ring->sq_local_tail - head;
+    ring->sq_local_tail = head;
+    __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+// Return the next completion without waiting, or NULL if none is ready. Call uring_cqe_seen() when done with it.
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+// Wait for the next completion (submitting nothing new). Returns NULL only if io_uring_enter() fails.
+struct io_uring_cqe *uring_wait_cqe(struct uring *ring) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(ring)) == NULL) {
+        if (uring_submit_and_wait(ring, 1) != 0) {
+            return NULL;
         }
-    } else if (argc == 5) {
-        // If the number of arguments is 5, the program searches for a file and performs a copy or move operation based on options.
+    }
+    return cqe;
+}
 
-        // Part 2: Search for a file and copy/move it to another directory based on options
-        rootDir = argv[1]; // Store the root directory path
-        storageDir = argv[2]; // Store the storage directory path
-        operation = argv[3]; // Store the operation
-        enteredFileName = argv[4]; // Store the entered file name
+// Hand a completion entry back to the kernel
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
 
-        // Check if the root directory exists
-        if (!directory_exists(rootDir)) {
-            fprintf(stderr, "Invalid rootDir\n"); // Print an error message
-            return 1; // Return to indicate failure
+// Convert the result of an IORING_OP_STATX request into a struct stat
+static void statx_to_stat(const struct statx *sx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = (off_t)sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = (blkcnt_t)sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+// ---------------------------------------------------------------------------------------
+// Parallel work-stealing directory walker
+//
+// Every worker owns a deque of directories still to be read. A worker pushes the subdirectories it finds onto the
+// bottom of its own deque and pops from the bottom too, so it walks depth-first and keeps the directories it just
+// touched hot in the dentry cache. An idle worker steals from the top of another worker's deque, which holds the
+// oldest (and usually largest) subtrees, so a single steal tends to hand over a lot of work.
+
+// One directory waiting to be read
+struct walk_dir {
+    char *path; // Full path of the directory (malloc'd)
+    struct stat st; // lstat() result, passed to the callback when the directory is visited
+    int level; // Depth below the root, reported in struct FTW
+};
+
+// Per-worker deque of directories; items[head..tail) are queued
+struct walk_deque {
+    pthread_mutex_t lock; // Protects the fields below; held only for a push, pop or steal
+    struct walk_dir *items; // Array of queued directories
+    size_t head; // Index of the oldest entry (steal end)
+    size_t tail; // One past the newest entry (owner end)
+    size_t cap; // Allocated number of items
+};
+
+// One deferred callback invocation, used when --ordered is given
+struct walk_record {
+    char *path; // Full path of the entry
+    struct stat st; // lstat() result
+    int typeflag; // FTW_F, FTW_D, FTW_SL, ...
+    int base; // Offset of the basename within path
+    int level; // Depth below the root
+};
+
+// State shared by all workers of one parallel_walk() call
+struct walk_shared {
+    walk_callback fn; // Callback to invoke for every entry
+    int nthreads; // Number of workers
+    struct walk_deque *deques; // One deque per worker
+    atomic_long pending; // Directories queued or being read; the walk is finished when this drops to zero
+    atomic_int stop; // Set when a callback returned nonzero or an allocation failed
+    int result; // First nonzero callback return value
+    pthread_mutex_t callback_lock; // Serializes callbacks, which use global state and print to stdout
+    struct walk_record **records; // Per-worker deferred callbacks (--ordered only)
+    size_t *record_count; // Number of records per worker
+    size_t *record_cap; // Allocated records per worker
+};
+
+// Layout of the records returned by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino; // Inode number
+    int64_t d_off; // Offset of the next record
+    unsigned short d_reclen; // Length of this record
+    unsigned char d_type; // File type (DT_REG, DT_DIR, ... or DT_UNKNOWN)
+    char d_name[]; // Null-terminated file name
+};
+
+// Arguments of one worker thread
+struct walk_worker {
+    struct walk_shared *shared; // Shared walk state
+    int id; // Index of the worker's own deque
+    char *dirent_buf; // getdents64 buffer of walk_dirent_buffer_size bytes, NULL when the readdir reader is used
+    struct uring ring; // Worker's own io_uring for statx batches, fd -1 when stats are synchronous
+    struct linux_dirent64 **batch; // Entries of the current batch (walk_uring_depth slots, like the arrays below)
+    int *batch_need; // Whether each entry needs a stat
+    int *batch_done; // Whether the ring completed the stat
+    int *batch_ok; // Whether the stat succeeded
+    struct stat *batch_st; // Stat results
+    struct statx *statx_buf; // Raw IORING_OP_STATX results
+};
+
+// Push a directory onto the owner end of a deque. Returns 0 on success, -1 if memory runs out.
+static int walk_deque_push(struct walk_deque *dq, const struct walk_dir *dir) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) { // No room left at the end
+        if (dq->head > 0) { // Reclaim the slots freed by thieves first
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(*dq->items));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else { // Otherwise grow the array
+            size_t cap = dq->cap ? dq->cap * 2 : 64;
+            struct walk_dir *items = realloc(dq->items, cap * sizeof(*items));
+            if (!items) {
+                pthread_mutex_unlock(&dq->lock);
+                return -1;
+            }
+            dq->items = items;
+            dq->cap = cap;
         }
+    }
+    dq->items[dq->tail++] = *dir;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
 
-        // Check if the operation is valid
-        if (strcmp(operation, "-cp") != 0 && strcmp(operation, "-mv") != 0) {
-            fprintf(stderr, "Invalid operation\n"); // Print an error message
-            return 1; // Return to indicate failure
+// Take a directory from a deque: the owner pops the newest entry, a thief steals the oldest. Returns 1 if one was taken.
+static int walk_deque_take(struct walk_deque *dq, struct walk_dir *out, int steal) {
+    int taken = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail) {
+        *out = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+        if (dq->head == dq->tail) { // Empty again: restart at the beginning of the array
+            dq->head = dq->tail = 0;
         }
+        taken = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return taken;
+}
 
-        // Search for the file using nftw() function
-        if (nftw(rootDir, search_and_process, 20, FTW_PHYS) == -1) {
-            perror("nftw"); // Print an error message
-            return 1; // Return to indicate failure
+// Report one entry to the callback, or record it for later when the output has to be ordered
+static void walk_report(struct walk_shared *shared, int id, const char *path, const struct stat *st, int typeflag, int base, int level) {
+    if (atomic_load(&shared->stop)) {
+        return; // Another callback already asked to stop
+    }
+
+    if (walk_ordered) {
+        if (shared->record_count[id] == shared->record_cap[id]) { // Grow this worker's record array
+            size_t cap = shared->record_cap[id] ? shared->record_cap[id] * 2 : 256;
+            struct walk_record *records = realloc(shared->records[id], cap * sizeof(*records));
+            if (!records) {
+                atomic_store(&shared->stop, 1);
+                return;
+            }
+            shared->records[id] = records;
+            shared->record_cap[id] = cap;
+        }
+        struct walk_record *rec = &shared->records[id][shared->record_count[id]];
+        rec->path = strdup(path);
+        if (!rec->path) {
+            atomic_store(&shared->stop, 1);
+            return;
         }
+        rec->st = *st;
+        rec->typeflag = typeflag;
+        rec->base = base;
+        rec->level = level;
+        shared->record_count[id]++;
+        return;
+    }
 
-        // Print a message if the file is not found
-        if (found_file == NULL) {
-            printf("Search Unsuccessful\n"); // Print a message indicating that the search was unsuccessful
+    struct FTW ftwbuf; // Same information nftw() passes to its callback
+    ftwbuf.base = base;
+    ftwbuf.level = level;
+    pthread_mutex_lock(&shared->callback_lock);
+    if (!atomic_load(&shared->stop)) {
+        int rc = shared->fn(path, st, typeflag, &ftwbuf);
+        if (rc != 0) { // Nonzero return stops the walk, as with nftw()
+            shared->result = rc;
+            atomic_store(&shared->stop, 1);
         }
-    } else if (argc == 4) {
-        // If the number of arguments is 4, the program searches for files with a specific extension and creates a tar file.
-        // It retrieves the root directory path, storage directory path, and file extension from the command-line arguments.
-        // Part 3: Search for files with a specific extension and create a tar file
-        rootDir = argv[1]; // Store the root directory path
-        storageDir = argv[2]; // Store the storage directory path
-        extension = argv[3]; // Store the file extension
+    }
+    pthread_mutex_unlock(&shared->callback_lock);
+}
 
-        // Check if the root directory and storage directory exist
-        if (!directory_exists(rootDir) || !directory_exists(storageDir)) {
-            if (!directory_exists(rootDir)) {
-                fprintf(stderr, "Invalid rootDir\n"); // Print an error message
-            }
-            if (!directory_exists(storageDir)) {
-                printf("Search Successful: Invalid storageDir\n"); // Print a message indicating that the storage directory is invalid
-            }
-            return 1; // Return to indicate failure
+// Offset of the basename within a path, as reported in struct FTW
+static int walk_base_offset(const char *path) {
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') { // Ignore trailing slashes of the root
+        len--;
+    }
+    while (len > 0 && path[len - 1] != '/') {
+        len--;
+    }
+    return (int)len;
+}
+
+// Report one directory entry, or queue it if it is a subdirectory. st is NULL when the entry could not be stat'ed.
+// Returns 0 to keep reading, -1 if memory ran out and the walk has been stopped.
+static int walk_emit_entry(struct walk_shared *shared, int id, const struct walk_dir *dir, const char *name, size_t name_len, const struct stat *st) {
+    size_t dir_len = strlen(dir->path);
+    int need_slash = dir_len > 0 && dir->path[dir_len - 1] != '/'; // Avoid "//" when the root ends with a slash
+    char *path = malloc(dir_len + need_slash + name_len + 1); // Full path of the entry
+    if (!path) {
+        atomic_store(&shared->stop, 1);
+        return -1;
+    }
+    memcpy(path, dir->path, dir_len);
+    if (need_slash) {
+        path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + need_slash, name, name_len + 1);
+    int base = (int)(dir_len + need_slash); // Basename starts right after the directory part
+
+    if (!st) { // FTW_NS: the entry exists but its status could not be read
+        struct stat empty;
+        memset(&empty, 0, sizeof(empty));
+        walk_report(shared, id, path, &empty, FTW_NS, base, dir->level + 1);
+        free(path);
+    } else if (S_ISDIR(st->st_mode)) { // Subdirectory: queue it, it is reported when it is read
+        struct walk_dir sub = { path, *st, dir->level + 1 };
+        atomic_fetch_add(&shared->pending, 1);
+        if (walk_deque_push(&shared->deques[id], &sub) != 0) {
+            atomic_fetch_sub(&shared->pending, 1);
+            atomic_store(&shared->stop, 1);
+            free(path);
+            return -1;
+        }
+    } else if (!walk_name_filter || !S_ISREG(st->st_mode) || walk_name_filter(name)) {
+        walk_report(shared, id, path, st, S_ISLNK(st->st_mode) ? FTW_SL : FTW_F, base, dir->level + 1);
+        free(path);
+    } else {
+        free(path); // A file the callback would ignore: skip taking the callback lock for it
+    }
+    return 0;
+}
+
+// Read one directory with opendir()/readdir() and lstat() every entry
+static void walk_read_dir_readdir(struct walk_shared *shared, int id, struct walk_dir *dir) {
+    DIR *dp = opendir(dir->path); // Open the directory for reading
+    walk_report(shared, id, dir->path, &dir->st, dp ? FTW_D : FTW_DNR, walk_base_offset(dir->path), dir->level);
+    if (!dp) {
+        return; // Unreadable directories are reported as FTW_DNR and skipped, like nftw() does
+    }
+
+    int dir_fd = dirfd(dp); // Stat entries relative to the open directory instead of resolving the full path again
+    struct dirent *entry;
+    while (!atomic_load(&shared->stop) && (entry = readdir(dp)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue; // Skip the self and parent links
         }
+        struct stat st;
+        int ok = fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0; // FTW_PHYS semantics: never follow symbolic links
+        if (walk_emit_entry(shared, id, dir, name, strlen(name), ok ? &st : NULL) != 0) {
+            break;
+        }
+    }
+    closedir(dp);
+}
+
 
-        // Search for files with the specified extension using nftw() function
-        if (nftw(rootDir, search_and_create_tar, 20, FTW_PHYS) == -1) {
-            perror("nftw"); // Print an error message
+// Decide whether a directory entry needs a real stat, or whether the type reported by getdents64 is enough
+static int walk_entry_needs_stat(const struct linux_dirent64 *entry) {
+    if (entry->d_type == DT_UNKNOWN) {
+        return 1; // The file system did not report a type
+    }
+    if (!walk_need_stat || entry->d_type == DT_DIR) {
+        return 0; // Directories are reported with their type only; callbacks ask for metadata of files
+    }
+    return !walk_stat_filter || walk_stat_filter(entry->d_name); // Only entries the callback can match need metadata
+}
+
+// Stat the flagged entries of a batch, through the worker's io_uring when it has one and with fstatat() otherwise
+static void walk_stat_batch(struct walk_worker *self, int dir_fd, int count) {
+    int submitted = 0; // Number of statx requests handed to the ring
+    if (self->ring.fd >= 0) {
+        for (int i = 0; i < count; i++) {
+            self->batch_done[i] = 0;
+            if (!self->batch_need[i]) {
+                continue;
+            }
+            struct io_uring_sqe *sqe = uring_get_sqe(&self->ring); // The ring has at least walk_uring_depth entries
+            if (!sqe) {
+                break;
+            }
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dir_fd; // Names are resolved relative to the open directory
+            sqe->addr = (uint64_t)(uintptr_t)self->batch[i]->d_name;
+            sqe->len = STATX_BASIC_STATS; // Type, mode, owner, size, blocks and times
+            sqe->off = (uint64_t)(uintptr_t)&self->statx_buf[i];
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW; // FTW_PHYS semantics: never follow symbolic links
+            sqe->user_data = (uint64_t)i;
+            submitted++;
+        }
+
+        int unsupported = 0; // Set when the kernel has io_uring but no IORING_OP_STATX (before 5.6)
+        int owed = submitted; // Completions still due; the kernel writes into statx_buf until each has arrived
+        if (submitted > 0 && uring_submit_and_wait(&self->ring, (unsigned)submitted) != 0) {
+            unsupported = 1;
+            owed -= (int)uring_unsubmit(&self->ring); // Entries the kernel never consumed will not complete
+        }
+        while (owed > 0) { // Reap the requests the kernel did take, even after a failed submit
+            struct io_uring_cqe *cqe = uring_wait_cqe(&self->ring);
+            if (!cqe) {
+                unsupported = 1;
+                break;
+            }
+            owed--;
+            int i = (int)cqe->user_data;
+            int res = cqe->res;
+            uring_cqe_seen(&self->ring);
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                unsupported = 1; // Leave batch_done[i] clear so the synchronous path below handles it
+                continue;
+            }
+            self->batch_done[i] = 1;
+            self->batch_ok[i] = res == 0;
+            if (res == 0) {
+                statx_to_stat(&self->statx_buf[i], &self->batch_st[i]);
+            }
+        }
+        if (owed > 0) {
+            self->statx_buf = NULL; // Requests still in flight may write into it: leave it to them rather than free it
+        }
+        if (unsupported) {
+            uring_exit(&self->ring); // Use the synchronous path for the rest of the walk
+        }
+    } else {
+        memset(self->batch_done, 0, (size_t)count * sizeof(*self->batch_done));
+    }
+
+    for (int i = 0; i < count; i++) { // Synchronous path: no ring, or requests the ring could not handle
+        if (self->batch_need[i] && !self->batch_done[i]) {
+            self->batch_ok[i] = fstatat(dir_fd, self->batch[i]->d_name, &self->batch_st[i], AT_SYMLINK_NOFOLLOW) == 0;
+        }
+    }
+}
+
+// Read one directory with large getdents64 batches and trust d_type, so that entries are only stat'ed when the
+// file system does not report a type (DT_UNKNOWN) or when the current mode needs metadata (walk_need_stat).
+// Stats are issued in batches of walk_uring_depth entries so that an io_uring can overlap them.
+static void walk_read_dir_getdents(struct walk_shared *shared, struct walk_worker *self, struct walk_dir *dir) {
+    int id = self->id;
+    int dir_fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW); // Open the directory for reading
+    walk_report(shared, id, dir->path, &dir->st, dir_fd >= 0 ? FTW_D : FTW_DNR, walk_base_offset(dir->path), dir->level);
+    if (dir_fd < 0) {
+        return; // Unreadable directories are reported as FTW_DNR and skipped, like nftw() does
+    }
+
+    while (!atomic_load(&shared->stop)) {
+        long nread = syscall(SYS_getdents64, dir_fd, self->dirent_buf, walk_dirent_buffer_size); // Fill the buffer with as many entries as fit
+        if (nread <= 0) {
+            break; // 0 is the end of the directory, -1 an error (treated like the end, as readdir() would)
+        }
+
+        long pos = 0; // Read position within the buffer
+        while (pos < nread && !atomic_load(&shared->stop)) {
+            // Collect up to walk_uring_depth entries, stat the ones that need it as one batch, then report them in order
+            int count = 0; // Entries in this batch
+            int need_any = 0; // Whether any entry of the batch needs a stat
+            while (pos < nread && count < walk_uring_depth) {
+                struct linux_dirent64 *entry = (struct linux_dirent64 *)(self->dirent_buf + pos);
+                pos += entry->d_reclen;
+                const char *name = entry->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue; // Skip the self and parent links
+                }
+                self->batch[count] = entry;
+                self->batch_need[count] = walk_entry_needs_stat(entry);
+                need_any |= self->batch_need[count];
+                count++;
+            }
+            if (need_any) {
+                walk_stat_batch(self, dir_fd, count);
+            }
+
+            for (int i = 0; i < count; i++) {
+                struct linux_dirent64 *entry = self->batch[i];
+                struct stat *st = &self->batch_st[i];
+                if (!self->batch_need[i]) {
+                    // Only the file type (and inode) is known; modes that need sizes or times set walk_need_stat
+                    memset(st, 0, sizeof(*st));
+                    st->st_mode = DTTOIF(entry->d_type);
+                    st->st_ino = (ino_t)entry->d_ino;
+                }
+                int ok = !self->batch_need[i] || self->batch_ok[i];
+                if (walk_emit_entry(shared, id, dir, entry->d_name, strlen(entry->d_name), ok ? st : NULL) != 0) {
+                    break;
+                }
+            }
+        }
+    }
+    close(dir_fd);
+}
+
+// Read one directory with the reader selected by --reader
+static void walk_read_dir(struct walk_shared *shared, struct walk_worker *self, struct walk_dir *dir) {
+    if (self->dirent_buf) {
+        walk_read_dir_getdents(shared, self, dir);
+    } else {
+        walk_read_dir_readdir(shared, self->id, dir);
+    }
+}
+
+// Allocate the getdents64 buffer and batch arrays of a worker, and set up its io_uring when stats are needed.
+// Returns 0 on success, -1 if memory runs out. A ring that cannot be set up just leaves the worker on fstatat().
+static int walk_worker_init_getdents(struct walk_worker *self) {
+    size_t depth = (size_t)walk_uring_depth;
+    self->dirent_buf = malloc(walk_dirent_buffer_size);
+    self->batch = malloc(depth * sizeof(*self->batch));
+    self->batch_need = malloc(depth * sizeof(*self->batch_need));
+    self->batch_done = malloc(depth * sizeof(*self->batch_done));
+    self->batch_ok = malloc(depth * sizeof(*self->batch_ok));
+    self->batch_st = malloc(depth * sizeof(*self->batch_st));
+    self->statx_buf = malloc(depth * sizeof(*self->statx_buf));
+    if (!self->dirent_buf || !self->batch || !self->batch_need || !self->batch_done || !self->batch_ok || !self->batch_st || !self->statx_buf) {
+        return -1;
+    }
+    if (walk_need_stat && strcmp(stat_engine, "uring") == 0) {
+        uring_init(&self->ring, (unsigned)walk_uring_depth); // On failure fd stays -1: kernel without io_uring
+    }
+    return 0;
+}
+
+// Release everything walk_worker_init_getdents() set up
+static void walk_worker_free(struct walk_worker *self) {
+    uring_exit(&self->ring);
+    free(self->dirent_buf);
+    free(self->batch);
+    free(self->batch_need);
+    free(self->batch_done);
+    free(self->batch_ok);
+    free(self->batch_st);
+    free(self->statx_buf);
+    self->dirent_buf = NULL;
+    self->batch = NULL;
+    self->batch_need = NULL;
+    self->batch_done = NULL;
+    self->batch_ok = NULL;
+    self->batch_st = NULL;
+    self->statx_buf = NULL;
+}
+
+// Worker thread: drain the own deque, then steal, until no directory is queued or being read anywhere
+static void *walk_worker_main(void *arg) {
+    struct walk_worker *self = arg;
+    struct walk_shared *shared = self->shared;
+    int idle_rounds = 0; // Consecutive rounds without finding work, used for backoff
+
+    while (!atomic_load(&shared->stop)) {
+        struct walk_dir dir;
+        int found = walk_deque_take(&shared->deques[self->id], &dir, 0); // Own work first
+        for (int i = 1; !found && i < shared->nthreads; i++) { // Then try every other worker once
+            found = walk_deque_take(&shared->deques[(self->id + i) % shared->nthreads], &dir, 1);
+        }
+
+        if (found) {
+            idle_rounds = 0;
+            walk_read_dir(shared, self, &dir);
+            free(dir.path);
+            atomic_fetch_sub(&shared->pending, 1); // Done with this directory
+            continue;
+        }
+
+        if (atomic_load(&shared->pending) == 0) {
+            break; // Nothing queued and nobody reading: the walk is complete
+        }
+        // Other workers are still reading directories that may produce more work; back off briefly
+        struct timespec pause = { 0, idle_rounds < 16 ? 10000L : 200000L };
+        nanosleep(&pause, NULL);
+        idle_rounds++;
+    }
+    return NULL;
+}
+
+// Sort deferred callbacks by path
+static int walk_record_compare(const void *a, const void *b) {
+    return strcmp(((const struct walk_record *)a)->path, ((const struct walk_record *)b)->path);
+}
+
+// Function to walk the tree with nthreads work-stealing worker threads
+int parallel_walk(const char *root, walk_callback fn, int nthreads) {
+    struct stat st;
+    if (lstat(root, &st) != 0) {
+        return -1; // Same as nftw(): the root itself must exist
+    }
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    struct walk_shared shared;
+    memset(&shared, 0, sizeof(shared));
+    shared.fn = fn;
+    shared.nthreads = nthreads;
+    pthread_mutex_init(&shared.callback_lock, NULL);
+    shared.deques = calloc(nthreads, sizeof(*shared.deques));
+    struct walk_worker *workers = calloc(nthreads, sizeof(*workers));
+    pthread_t *threads = calloc(nthreads, sizeof(*threads));
+    if (walk_ordered) {
+        shared.records = calloc(nthreads, sizeof(*shared.records));
+        shared.record_count = calloc(nthreads, sizeof(*shared.record_count));
+        shared.record_cap = calloc(nthreads, sizeof(*shared.record_cap));
+    }
+    if (!shared.deques || !workers || !threads || (walk_ordered && (!shared.records || !shared.record_count || !shared.record_cap))) {
+        free(shared.deques);
+        free(workers);
+        free(threads);
+        free(shared.records);
+        free(shared.record_count);
+        free(shared.record_cap);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&shared.deques[i].lock, NULL);
+    }
+
+    if (!S_ISDIR(st.st_mode)) { // A non-directory root is reported on its own, like nftw() does
+        walk_report(&shared, 0, root, &st, S_ISLNK(st.st_mode) ? FTW_SL : FTW_F, walk_base_offset(root), 0);
+    } else {
+        struct walk_dir first = { strdup(root), st, 0 };
+        if (!first.path || walk_deque_push(&shared.deques[0], &first) != 0) {
+            free(first.path);
+            atomic_store(&shared.stop, 1);
+        } else {
+            atomic_store(&shared.pending, 1);
+        }
+
+        for (int i = 0; i < nthreads; i++) {
+            workers[i].shared = &shared;
+            workers[i].id = i;
+            workers[i].ring.fd = -1;
+            if (strcmp(walk_reader, "getdents") == 0 && walk_worker_init_getdents(&workers[i]) != 0) {
+                walk_worker_free(&workers[i]); // Allocation failure: this worker falls back to readdir()
+            }
+        }
+
+        int started = 0; // Number of threads created successfully
+        for (int i = 0; i < nthreads; i++) {
+            if (pthread_create(&threads[i], NULL, walk_worker_main, &workers[i]) != 0) {
+                break; // Fewer workers still finish the walk, since they steal from every deque
+            }
+            started++;
+        }
+        if (started == 0) {
+            walk_worker_main(&workers[0]); // Could not create any thread: walk on the calling thread
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            walk_worker_free(&workers[i]);
+        }
+    }
+
+    int out_of_memory = atomic_load(&shared.stop) && shared.result == 0; // Stopped without a callback asking for it
+
+    if (walk_ordered) { // Merge the per-worker records, sort them and replay the callbacks in path order until one returns nonzero
+        size_t total = 0;
+        for (int i = 0; i < nthreads; i++) {
+            total += shared.record_count[i];
+        }
+        struct walk_record *all = malloc((total ? total : 1) * sizeof(*all));
+        if (!all) {
+            out_of_memory = 1;
+        }
+        size_t n = 0;
+        for (int i = 0; i < nthreads; i++) {
+            if (all) {
+                memcpy(all + n, shared.records[i], shared.record_count[i] * sizeof(*all));
+                n += shared.record_count[i];
+            } else {
+                for (size_t j = 0; j < shared.record_count[i]; j++) {
+                    free(shared.records[i][j].path);
+                }
+            }
+            free(shared.records[i]);
+        }
+        if (all) {
+            qsort(all, n, sizeof(*all), walk_record_compare);
+            for (size_t j = 0; j < n; j++) {
+                if (shared.result == 0 && !out_of_memory) {
+                    struct FTW ftwbuf;
+                    ftwbuf.base = all[j].base;
+                    ftwbuf.level = all[j].level;
+                    shared.result = fn(all[j].path, &all[j].st, all[j].typeflag, &ftwbuf);
+                }
+                free(all[j].path);
+            }
+            free(all);
+        }
+        free(shared.records);
+        free(shared.record_count);
+        free(shared.record_cap);
+    }
+
+    for (int i = 0; i < nthreads; i++) { // Free directories left behind when the walk was stopped early
+        struct walk_dir dir;
+        while (walk_deque_take(&shared.deques[i], &dir, 0)) {
+            free(dir.path);
+        }
+        free(shared.deques[i].items);
+        pthread_mutex_destroy(&shared.deques[i].lock);
+    }
+    pthread_mutex_destroy(&shared.callback_lock);
+    free(shared.deques);
+    free(workers);
+    free(threads);
+
+    if (out_of_memory) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return shared.result;
+}
+
+// ---------------------------------------------------------------------------------------
+// Persistent filename index
+//
+// "--index-build INDEX rootDir" walks rootDir once and writes every regular file into INDEX. Searches given
+// "--index INDEX" then binary-search the index through mmap() instead of walking the tree again.
+//
+// File layout (host byte order; the index is a cache for this machine, not an exchange format):
+//   struct index_header                  magic, version, counts and a table of sections
+//   INDEX_SEC_ROOT        root directory (canonical path) the index was built for
+//   INDEX_SEC_PATHS       paths relative to the root, sorted, front-coded: varint shared-prefix length,
+//                         varint suffix length, suffix bytes. Every INDEX_RESTART_INTERVAL-th path is stored whole.
+//   INDEX_SEC_RESTARTS    uint64_t offset into INDEX_SEC_PATHS of every whole (restart) path
+//   INDEX_SEC_NAMES       struct index_name per file, sorted by basename and then by path id
+//   INDEX_SEC_NAME_BLOB   the basenames, each followed by '\0', in the order of INDEX_SEC_NAMES (duplicates share bytes)
+//   INDEX_SEC_DIRS        struct index_dir per directory (relative path, mtime, ctime, inode, device), sorted by path
+//   INDEX_SEC_DIR_BLOB    the relative directory paths, each followed by '\0' ("" is the root)
+//   INDEX_SEC_TRIGRAMS    struct index_trigram per distinct trigram of the basenames, sorted by trigram
+//   INDEX_SEC_POSTINGS    per trigram, the ascending INDEX_SEC_NAMES positions of the first entry of every distinct
+//                         name containing it, delta- and varint-coded
+
+#define INDEX_MAGIC "FUINDEX" // First bytes of every index file (with the terminating '\0', 8 bytes)
+#define INDEX_VERSION 3 // Bumped whenever the layout changes; older indexes must be rebuilt
+#define INDEX_RESTART_INTERVAL 16 // Paths per front-coding block
+#define INDEX_MAX_SECTIONS 16 // Slots in the section table
+
+enum index_section_id {
+    INDEX_SEC_ROOT = 1,
+    INDEX_SEC_PATHS,
+    INDEX_SEC_RESTARTS,
+    INDEX_SEC_NAMES,
+    INDEX_SEC_NAME_BLOB,
+    INDEX_SEC_DIRS,
+    INDEX_SEC_DIR_BLOB,
+    INDEX_SEC_TRIGRAMS,
+    INDEX_SEC_POSTINGS,
+};
+
+#define INDEX_SEC_LAST INDEX_SEC_POSTINGS // Highest section id written by index_write()
+#define INDEX_DIR_RESCAN 1 // index_dir flag: the directory changed too recently for its mtime to be trusted
+
+// Location of one section within the index file
+struct index_section {
+    uint32_t id; // enum index_section_id, 0 for an unused slot
+    uint32_t reserved; // Keeps offset 8-byte aligned
+    uint64_t offset; // Byte offset from the start of the file
+    uint64_t length; // Length in bytes
+};
+
+// Fixed-size header at the start of the index file
+struct index_header {
+    char magic[8]; // INDEX_MAGIC
+    uint32_t version; // INDEX_VERSION
+    uint32_t max_path_len; // Longest relative path, so readers can size their decode buffer
+    uint64_t file_count; // Number of indexed files
+    struct index_section sections[INDEX_MAX_SECTIONS]; // Section table
+};
+
+// One entry of the sorted basename table
+struct index_name {
+    uint64_t name_offset; // Offset of the basename in INDEX_SEC_NAME_BLOB
+    uint32_t name_len; // Length of the basename
+    uint32_t path_id; // Position of the file's path in INDEX_SEC_PATHS
+};
+
+// One directory record, used by --index-update to skip directories that did not change
+struct index_dir {
+    uint64_t path_offset; // Offset of the relative path in INDEX_SEC_DIR_BLOB
+    uint32_t path_len; // Length of the relative path
+    uint32_t flags; // INDEX_DIR_RESCAN
+    int64_t mtime_sec, mtime_nsec; // Modification time: changes when entries are added, removed or renamed
+    int64_t ctime_sec, ctime_nsec; // Status change time
+    uint64_t ino; // Inode number, so a directory replaced by another one is noticed
+    uint64_t dev; // Device number
+};
+
+// One entry of the trigram table
+struct index_trigram {
+    uint32_t trigram; // Three name bytes packed as b0 << 16 | b1 << 8 | b2
+    uint32_t count; // Number of postings
+    uint64_t offset; // Offset of the posting list in INDEX_SEC_POSTINGS
+};
+
+// An index opened with index_open()
+struct file_index {
+    int fd; // Open index file
+    const uint8_t *map; // Read-only mapping of the whole file
+    size_t size; // Size of the mapping
+    const struct index_header *header; // Header at the start of the mapping
+    const char *root; // Canonical root directory (not null-terminated)
+    size_t root_len; // Its length
+    const uint8_t *paths; // Front-coded paths
+    size_t paths_len; // Their length in bytes
+    const uint64_t *restarts; // Offsets of the restart paths
+    uint64_t restart_count; // Number of restart offsets
+    const struct index_name *names; // Sorted basename table
+    uint64_t name_count; // Number of basename entries
+    const char *name_blob; // Basename bytes
+    size_t name_blob_len; // Their length
+    const struct index_dir *dirs; // Directory records
+    size_t dir_count; // Number of directory records
+    const char *dir_blob; // Directory path bytes
+    size_t dir_blob_len; // Their length
+    const struct index_trigram *trigrams; // Sorted trigram table
+    size_t trigram_count; // Number of trigrams
+    const uint8_t *postings; // Encoded posting lists
+    size_t postings_len; // Their length in bytes
+};
+
+// Growable byte buffer used to assemble index sections in memory
+struct byte_buffer {
+    uint8_t *data; // Buffer contents
+    size_t len; // Bytes used
+    size_t cap; // Bytes allocated
+};
+
+// Append bytes to a buffer. Returns 0 on success, -1 if memory runs out.
+static int byte_buffer_append(struct byte_buffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        while (cap < buf->len + len) {
+            cap *= 2;
+        }
+        uint8_t *grown = realloc(buf->data, cap);
+        if (!grown) {
+            return -1;
+        }
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+// Append an unsigned LEB128 varint (7 bits per byte, high bit set on all but the last byte)
+static int byte_buffer_put_varint(struct byte_buffer *buf, uint64_t value) {
+    uint8_t bytes[10];
+    size_t n = 0;
+    do {
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            bytes[n] |= 0x80;
+        }
+        n++;
+    } while (value);
+    return byte_buffer_append(buf, bytes, n);
+}
+
+// Decode a varint, advancing *pos. Returns 0 on success, -1 if the data ends early or is corrupt.
+static int read_varint(const uint8_t **pos, const uint8_t *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+        uint8_t byte = *(*pos)++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Growable list of malloc'd strings
+struct string_list {
+    char **items; // The strings
+    size_t count; // Number of strings
+    size_t cap; // Allocated slots
+};
+
+// Append a copy of a string. Returns 0 on success, -1 if memory runs out.
+static int string_list_add(struct string_list *list, const char *str) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 1024;
+        char **items = realloc(list->items, cap * sizeof(*items));
+        if (!items) {
+            return -1;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    char *copy = strdup(str);
+    if (!copy) {
+        return -1;
+    }
+    list->items[list->count++] = copy;
+    return 0;
+}
+
+// Free the strings and the list itself
+static void string_list_free(struct string_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// qsort() comparator for string pointers
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Directory path and status recorded while building an index
+struct index_dir_entry {
+    char *path; // Path relative to the root ("" for the root)
+    struct stat st; // lstat() taken before the directory was read
+};
+
+// Growable list of directory records
+struct index_dir_list {
+    struct index_dir_entry *items; // The records
+    size_t count; // Number of records
+    size_t cap; // Allocated records
+};
+
+// Append a directory record (the path is copied). Returns 0 on success, -1 if memory runs out.
+static int index_dir_list_add(struct index_dir_list *list, const char *path, const struct stat *st) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        struct index_dir_entry *items = realloc(list->items, cap * sizeof(*items));
+        if (!items) {
+            return -1;
+        }
+        list->items = items;
+        list->cap = cap;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    list->items[list->count].path = copy;
+    list->items[list->count].st = *st;
+    list->count++;
+    return 0;
+}
+
+// Free the records and the list itself
+static void index_dir_list_free(struct index_dir_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i].path);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// Order directory records by path
+static int compare_index_dirs(const void *a, const void *b) {
+    return strcmp(((const struct index_dir_entry *)a)->path, ((const struct index_dir_entry *)b)->path);
+}
+
+// Files and directories collected by index_collect() during --index-build
+struct string_list index_collected;
+struct index_dir_list index_collected_dirs;
+size_t index_root_prefix; // Length of the walked root plus its '/', stripped from collected paths
+
+// Walker callback for --index-build: remember every regular file relative to the root
+static int index_collect(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)sb;
+    (void)ftwbuf;
+    if (typeflag == FTW_D) {
+        // The walker reports a directory before reading it, so this status is never newer than the entries seen.
+        // The stat buffer it passes may hold only the file type, hence the lstat().
+        struct stat st;
+        const char *rel = strlen(fpath) >= index_root_prefix ? fpath + index_root_prefix : ""; // "" is the root
+        if (lstat(fpath, &st) == 0 && index_dir_list_add(&index_collected_dirs, rel, &st) != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        return 0;
+    }
+    if (typeflag != FTW_F || strlen(fpath) <= index_root_prefix) {
+        return 0; // Only regular files below the root are indexed, like search_and_process only matches FTW_F
+    }
+    if (string_list_add(&index_collected, fpath + index_root_prefix) != 0) {
+        errno = ENOMEM;
+        return -1; // Treated as a failed walk
+    }
+    return 0;
+}
+
+// Basename of a relative path
+static const char *path_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Sort key used while building the basename table
+struct index_name_sort {
+    const char *name; // Basename (points into the collected path)
+    uint32_t path_id; // Index of the path in the sorted path list
+};
+
+// Order basename entries by name, then by path so results come out in path order
+static int compare_index_names(const void *a, const void *b) {
+    const struct index_name_sort *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return x->path_id < y->path_id ? -1 : x->path_id > y->path_id;
+}
+
+// Pack three bytes into a trigram key
+static uint32_t trigram_key(const unsigned char *p) {
+    return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+// qsort() comparator for 64-bit keys
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Build the trigram table and posting lists over the distinct basenames of a sorted basename table.
+// A posting refers to a name group: the position of the first entry in INDEX_SEC_NAMES that has that name.
+static int index_add_trigrams(struct byte_buffer *table, struct byte_buffer *postings, const struct index_name_sort *sorted, size_t count) {
+    size_t total = 0; // Upper bound on (trigram, group) pairs
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || strcmp(sorted[i].name, sorted[i - 1].name) != 0) {
+            size_t len = strlen(sorted[i].name);
+            total += len >= 3 ? len - 2 : 0;
+        }
+    }
+    uint64_t *pairs = malloc((total ? total : 1) * sizeof(*pairs)); // trigram << 32 | group
+    if (!pairs) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && strcmp(sorted[i].name, sorted[i - 1].name) == 0) {
+            continue; // Same name as the previous entry: same group
+        }
+        const unsigned char *name = (const unsigned char *)sorted[i].name;
+        size_t len = strlen(sorted[i].name);
+        for (size_t j = 0; j + 3 <= len; j++) {
+            pairs[n++] = (uint64_t)trigram_key(name + j) << 32 | (uint32_t)i;
+        }
+    }
+    qsort(pairs, n, sizeof(*pairs), compare_u64); // Groups pairs by trigram, groups ascending within each trigram
+
+    int failed = 0;
+    for (size_t i = 0; i < n && !failed;) {
+        struct index_trigram entry;
+        entry.trigram = (uint32_t)(pairs[i] >> 32);
+        entry.count = 0;
+        entry.offset = postings->len;
+        uint32_t prev = 0;
+        for (; i < n && (uint32_t)(pairs[i] >> 32) == entry.trigram && !failed; i++) {
+            uint32_t group = (uint32_t)pairs[i];
+            if (entry.count > 0 && group == prev) {
+                continue; // The trigram occurs more than once in the same name
+            }
+            failed |= byte_buffer_put_varint(postings, entry.count == 0 ? group : group - prev); // Delta coding
+            prev = group;
+            entry.count++;
+        }
+        failed |= byte_buffer_append(table, &entry, sizeof(entry));
+    }
+    free(pairs);
+    return failed ? -1 : 0;
+}
+
+// Function to write an index for the sorted relative paths below canonical_root. Returns 0 or -1 (message printed).
+int index_write(const char *index_file, const char *canonical_root, char **paths, size_t count, struct index_dir_entry *dirs, size_t dir_count) {
+    if (count > UINT32_MAX) {
+        fprintf(stderr, "Too many files for one index\n");
+        return -1;
+    }
+
+    struct byte_buffer sec[INDEX_SEC_LAST + 1]; // Section contents, indexed by enum index_section_id
+    memset(sec, 0, sizeof(sec));
+    struct index_name_sort *sorted = malloc((count ? count : 1) * sizeof(*sorted));
+    int failed = sorted == NULL;
+    uint32_t max_path_len = 0;
+
+    failed |= byte_buffer_append(&sec[INDEX_SEC_ROOT], canonical_root, strlen(canonical_root));
+
+    // Front-coded path table
+    const char *prev = "";
+    for (size_t i = 0; i < count && !failed; i++) {
+        size_t len = strlen(paths[i]);
+        if (len > max_path_len) {
+            max_path_len = (uint32_t)len;
+        }
+        size_t shared = 0; // Bytes in common with the previous path
+        if (i % INDEX_RESTART_INTERVAL == 0) {
+            uint64_t offset = sec[INDEX_SEC_PATHS].len;
+            failed |= byte_buffer_append(&sec[INDEX_SEC_RESTARTS], &offset, sizeof(offset));
+        } else {
+            while (prev[shared] && prev[shared] == paths[i][shared]) {
+                shared++;
+            }
+        }
+        failed |= byte_buffer_put_varint(&sec[INDEX_SEC_PATHS], shared);
+        failed |= byte_buffer_put_varint(&sec[INDEX_SEC_PATHS], len - shared);
+        failed |= byte_buffer_append(&sec[INDEX_SEC_PATHS], paths[i] + shared, len - shared);
+        sorted[i].name = path_basename(paths[i]);
+        sorted[i].path_id = (uint32_t)i;
+        prev = paths[i];
+    }
+
+    // Sorted basename table and its name blob
+    if (!failed) {
+        qsort(sorted, count, sizeof(*sorted), compare_index_names);
+    }
+    if (!failed) {
+        failed |= index_add_trigrams(&sec[INDEX_SEC_TRIGRAMS], &sec[INDEX_SEC_POSTINGS], sorted, count);
+    }
+    uint64_t last_offset = 0; // Blob offset of the previous name, reused when the next name is the same
+    for (size_t i = 0; i < count && !failed; i++) {
+        struct index_name entry;
+        entry.name_len = (uint32_t)strlen(sorted[i].name);
+        entry.path_id = sorted[i].path_id;
+        if (i > 0 && strcmp(sorted[i].name, sorted[i - 1].name) == 0) {
+            entry.name_offset = last_offset;
+        } else {
+            entry.name_offset = sec[INDEX_SEC_NAME_BLOB].len;
+            failed |= byte_buffer_append(&sec[INDEX_SEC_NAME_BLOB], sorted[i].name, entry.name_len + 1);
+        }
+        last_offset = entry.name_offset;
+        failed |= byte_buffer_append(&sec[INDEX_SEC_NAMES], &entry, sizeof(entry));
+    }
+    free(sorted);
+
+    // Directory records, sorted by path so the file layout does not depend on walk order
+    if (!failed) {
+        qsort(dirs, dir_count, sizeof(*dirs), compare_index_dirs);
+    }
+    time_t now = time(NULL);
+    for (size_t i = 0; i < dir_count && !failed; i++) {
+        struct index_dir rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.path_offset = sec[INDEX_SEC_DIR_BLOB].len;
+        rec.path_len = (uint32_t)strlen(dirs[i].path);
+        rec.mtime_sec = dirs[i].st.st_mtim.tv_sec;
+        rec.mtime_nsec = dirs[i].st.st_mtim.tv_nsec;
+        rec.ctime_sec = dirs[i].st.st_ctim.tv_sec;
+        rec.ctime_nsec = dirs[i].st.st_ctim.tv_nsec;
+        rec.ino = dirs[i].st.st_ino;
+        rec.dev = dirs[i].st.st_dev;
+        // A directory modified within the last couple of seconds may change again without its (possibly coarse)
+        // timestamp moving, so make the next refresh read it regardless
+        if (dirs[i].st.st_mtim.tv_sec >= now - 2 || dirs[i].st.st_ctim.tv_sec >= now - 2) {
+            rec.flags |= INDEX_DIR_RESCAN;
+        }
+        failed |= byte_buffer_append(&sec[INDEX_SEC_DIR_BLOB], dirs[i].path, rec.path_len + 1);
+        failed |= byte_buffer_append(&sec[INDEX_SEC_DIRS], &rec, sizeof(rec));
+    }
+
+    // Lay the sections out after the header, each aligned to 8 bytes
+    struct index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.max_path_len = max_path_len;
+    header.file_count = count;
+    uint64_t offset = sizeof(header);
+    int slot = 0;
+    for (int id = INDEX_SEC_ROOT; id <= INDEX_SEC_LAST; id++) {
+        header.sections[slot].id = (uint32_t)id;
+        header.sections[slot].offset = offset;
+        header.sections[slot].length = sec[id].len;
+        offset = (offset + sec[id].len + 7) & ~(uint64_t)7;
+        slot++;
+    }
+
+    // Write to a temporary file and rename it into place, so readers never see a half-written index
+    int rc = -1;
+    if (failed) {
+        fprintf(stderr, "Out of memory while building the index\n");
+    } else {
+        char tmp_path[PATH_MAX];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_file);
+        FILE *out = fopen(tmp_path, "wb");
+        if (!out) {
+            perror("fopen index");
+        } else {
+            static const uint8_t padding[8]; // Zero bytes used for alignment
+            int write_failed = fwrite(&header, sizeof(header), 1, out) != 1;
+            for (int i = 0; i < slot && !write_failed; i++) {
+                struct byte_buffer *b = &sec[header.sections[i].id];
+                write_failed |= b->len && fwrite(b->data, 1, b->len, out) != b->len;
+                size_t pad = (size_t)((8 - b->len % 8) % 8);
+                write_failed |= pad && fwrite(padding, 1, pad, out) != pad;
+            }
+            write_failed |= fflush(out) != 0 || fsync(fileno(out)) != 0;
+            write_failed |= fclose(out) != 0;
+            if (write_failed || rename(tmp_path, index_file) != 0) {
+                perror("write index");
+                unlink(tmp_path);
+            } else {
+                rc = 0;
+            }
+        }
+    }
+
+    for (int i = 0; i <= INDEX_SEC_LAST; i++) {
+        free(sec[i].data);
+    }
+    return rc;
+}
+
+// Function to build an index of every regular file below root
+int index_build(const char *root, const char *index_file) {
+    char canonical_root[PATH_MAX]; // Absolute path without symbolic links, so later lookups can use any spelling of it
+    if (!realpath(root, canonical_root)) {
+        perror("realpath");
+        return -1;
+    }
+
+    index_root_prefix = strlen(canonical_root) + (strcmp(canonical_root, "/") != 0); // Strip "root/" from walked paths
+    if (walk_tree(canonical_root, index_collect) == -1) {
+        perror("walk_tree");
+        string_list_free(&index_collected);
+        index_dir_list_free(&index_collected_dirs);
+        return -1;
+    }
+
+    qsort(index_collected.items, index_collected.count, sizeof(char *), compare_strings);
+    int rc = index_write(index_file, canonical_root, index_collected.items, index_collected.count,
+                         index_collected_dirs.items, index_collected_dirs.count);
+    if (rc == 0) {
+        printf("Indexed %zu files\n", index_collected.count);
+    }
+    string_list_free(&index_collected);
+    index_dir_list_free(&index_collected_dirs);
+    return rc;
+}
+
+// Find a section in the header. Returns 0 and sets *data/*len, or -1 if it is missing or out of bounds.
+static int index_section(const struct file_index *idx, uint32_t id, const uint8_t **data, size_t *len) {
+    for (int i = 0; i < INDEX_MAX_SECTIONS; i++) {
+        const struct index_section *s = &idx->header->sections[i];
+        if (s->id == id) {
+            if (s->offset > idx->size || s->length > idx->size - s->offset) {
+                return -1;
+            }
+            *data = idx->map + s->offset;
+            *len = (size_t)s->length;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Function to open and validate an index. Returns 0, or -1 with a message printed.
+int index_open(struct file_index *idx, const char *index_file) {
+    memset(idx, 0, sizeof(*idx));
+    idx->fd = open(index_file, O_RDONLY | O_CLOEXEC);
+    if (idx->fd < 0) {
+        perror("open index");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(idx->fd, &st) != 0 || (size_t)st.st_size < sizeof(struct index_header)) {
+        fprintf(stderr, "Invalid index file: %s\n", index_file);
+        close(idx->fd);
+        return -1;
+    }
+    idx->size = (size_t)st.st_size;
+    void *map = mmap(NULL, idx->size, PROT_READ, MAP_SHARED, idx->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap index");
+        close(idx->fd);
+        return -1;
+    }
+    idx->map = map;
+    idx->header = map;
+
+    const uint8_t *data;
+    size_t len;
+    int bad = memcmp(idx->header->magic, INDEX_MAGIC, sizeof(idx->header->magic)) != 0 || idx->header->version != INDEX_VERSION;
+    if (!bad && index_section(idx, INDEX_SEC_ROOT, &data, &len) == 0) {
+        idx->root = (const char *)data;
+        idx->root_len = len;
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_PATHS, &data, &len) == 0) {
+        idx->paths = data;
+        idx->paths_len = len;
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_RESTARTS, &data, &len) == 0) {
+        idx->restarts = (const uint64_t *)data;
+        idx->restart_count = len / sizeof(uint64_t);
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_NAMES, &data, &len) == 0) {
+        idx->names = (const struct index_name *)data;
+        idx->name_count = len / sizeof(struct index_name);
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_NAME_BLOB, &data, &len) == 0) {
+        idx->name_blob = (const char *)data;
+        idx->name_blob_len = len;
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_DIRS, &data, &len) == 0) {
+        idx->dirs = (const struct index_dir *)data;
+        idx->dir_count = len / sizeof(struct index_dir);
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_DIR_BLOB, &data, &len) == 0) {
+        idx->dir_blob = (const char *)data;
+        idx->dir_blob_len = len;
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_TRIGRAMS, &data, &len) == 0) {
+        idx->trigrams = (const struct index_trigram *)data;
+        idx->trigram_count = len / sizeof(struct index_trigram);
+    } else {
+        bad = 1;
+    }
+    if (!bad && index_section(idx, INDEX_SEC_POSTINGS, &data, &len) == 0) {
+        idx->postings = data;
+        idx->postings_len = len;
+    } else {
+        bad = 1;
+    }
+    if (bad || idx->name_count != idx->header->file_count) {
+        fprintf(stderr, "Invalid or outdated index file (rebuild it with --index-build): %s\n", index_file);
+        index_close(idx);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to unmap and close an index
+void index_close(struct file_index *idx) {
+    if (idx->map) {
+        munmap((void *)idx->map, idx->size);
+    }
+    if (idx->fd >= 0) {
+        close(idx->fd);
+    }
+    idx->map = NULL;
+    idx->fd = -1;
+}
+
+// Function to decode the relative path with the given id into buf (at least max_path_len + 1 bytes). Returns 0 or -1.
+int index_path_at(const struct file_index *idx, uint64_t id, char *buf) {
+    uint64_t block = id / INDEX_RESTART_INTERVAL;
+    if (block >= idx->restart_count || idx->restarts[block] > idx->paths_len) {
+        return -1;
+    }
+    const uint8_t *pos = idx->paths + idx->restarts[block]; // Start at the last whole path before id
+    const uint8_t *end = idx->paths + idx->paths_len;
+    size_t len = 0; // Length of the path currently in buf
+    for (uint64_t i = block * INDEX_RESTART_INTERVAL; i <= id; i++) {
+        uint64_t shared, suffix;
+        if (read_varint(&pos, end, &shared) != 0 || read_varint(&pos, end, &suffix) != 0 ||
+            shared > len || suffix > (uint64_t)(end - pos) || shared + suffix > idx->header->max_path_len) {
+            return -1;
+        }
+        memcpy(buf + shared, pos, suffix);
+        pos += suffix;
+        len = shared + suffix;
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+// Compare the basename of a table entry with a null-terminated name
+static int index_name_compare(const struct file_index *idx, const struct index_name *entry, const char *name, size_t name_len) {
+    if (entry->name_offset > idx->name_blob_len || entry->name_len > idx->name_blob_len - entry->name_offset) {
+        return 1; // Corrupt entry: sorts after everything, so it is never matched
+    }
+    size_t n = entry->name_len < name_len ? entry->name_len : name_len;
+    int cmp = memcmp(idx->name_blob + entry->name_offset, name, n);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return entry->name_len < name_len ? -1 : entry->name_len > name_len;
+}
+
+// Function to turn a relative index path into the path a walk of rootDir would have reported, or return NULL if it
+// is outside the searched directory. sub_prefix is rootDir relative to the index root ("" for the index root itself).
+static const char *index_visible_path(const char *rel, const char *sub_prefix, size_t sub_len, const char *root, char *out, size_t out_size) {
+    if (sub_len > 0) {
+        if (strncmp(rel, sub_prefix, sub_len) != 0 || rel[sub_len] != '/') {
+            return NULL; // Not below rootDir
+        }
+        rel += sub_len + 1;
+    }
+    size_t root_len = strlen(root);
+    int need_slash = root_len > 0 && root[root_len - 1] != '/';
+    snprintf(out, out_size, "%s%s%s", root, need_slash ? "/" : "", rel);
+    return out;
+}
+
+// Locate rootDir within an index. Returns 0 and sets *sub_prefix (malloc'd, relative to the index root), or -1.
+static int index_locate_root(const struct file_index *idx, const char *root, char **sub_prefix) {
+    char canonical[PATH_MAX];
+    if (!realpath(root, canonical)) {
+        perror("realpath");
+        return -1;
+    }
+    size_t len = strlen(canonical);
+    size_t root_len = idx->root_len;
+    int index_is_slash = root_len == 1 && idx->root[0] == '/';
+    if (len < root_len || memcmp(canonical, idx->root, root_len) != 0 ||
+        (len > root_len && canonical[root_len] != '/' && !index_is_slash)) {
+        fprintf(stderr, "rootDir is not covered by the index (built for %.*s)\n", (int)root_len, idx->root);
+        return -1;
+    }
+    const char *rest = canonical + root_len; // Part of rootDir below the index root
+    while (*rest == '/') {
+        rest++;
+    }
+    *sub_prefix = strdup(rest);
+    return *sub_prefix ? 0 : -1;
+}
+
+// Function to search an index for files named name below root and hand every hit to process_found_file()
+int index_search(const char *index_file, const char *root, const char *name) {
+    struct file_index idx;
+    if (index_open(&idx, index_file) != 0) {
+        return -1;
+    }
+    char *sub_prefix;
+    if (index_locate_root(&idx, root, &sub_prefix) != 0) {
+        index_close(&idx);
+        return -1;
+    }
+    size_t sub_len = strlen(sub_prefix);
+    char *rel = malloc((size_t)idx.header->max_path_len + 1); // Decoded relative path
+    char *visible = malloc((size_t)idx.header->max_path_len + strlen(root) + 2); // Path as a walk would report it
+    if (!rel || !visible) {
+        free(rel);
+        free(visible);
+        free(sub_prefix);
+        index_close(&idx);
+        errno = ENOMEM;
+        perror("index_search");
+        return -1;
+    }
+
+    // Binary search for the first entry whose basename is not less than name
+    size_t name_len = strlen(name);
+    uint64_t lo = 0, hi = idx.name_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (index_name_compare(&idx, &idx.names[mid], name, name_len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int rc = 0;
+    for (uint64_t i = lo; i < idx.name_count && rc == 0 && index_name_compare(&idx, &idx.names[i], name, name_len) == 0; i++) {
+        if (index_path_at(&idx, idx.names[i].path_id, rel) != 0) {
+            fprintf(stderr, "Corrupt index file: %s\n", index_file);
+            rc = -1;
+            break;
+        }
+        const char *path = index_visible_path(rel, sub_prefix, sub_len, root, visible, (size_t)idx.header->max_path_len + strlen(root) + 2);
+        if (path) {
+            rc = process_found_file(path); // Same handling as a match found by walking the tree
+        }
+    }
+
+    free(rel);
+    free(visible);
+    free(sub_prefix);
+    index_close(&idx);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Incremental index refresh
+//
+// "--index-update INDEX rootDir" re-stats every directory recorded in the index. A directory whose mtime, ctime,
+// inode and device are unchanged still has the same entries, so its files and subdirectories are taken from the
+// old index without reading it; only changed (or new) directories are read again. A mostly static tree therefore
+// costs one stat per directory instead of a full walk.
+
+// Open-addressing hash map from borrowed null-terminated strings to size_t values
+struct hash_map_entry {
+    const char *key; // NULL for an empty slot; the string must outlive the map
+    size_t value; // Value stored for the key
+};
+
+struct hash_map {
+    struct hash_map_entry *slots; // Table of cap slots (cap is a power of two)
+    size_t cap; // Number of slots
+    size_t count; // Number of keys
+};
+
+// FNV-1a hash of a string
+static uint64_t hash_string(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Insert or replace a key. Returns 0 on success, -1 if memory runs out.
+static int hash_map_put(struct hash_map *map, const char *key, size_t value) {
+    if ((map->count + 1) * 2 > map->cap) { // Keep the load factor at or below one half
+        size_t cap = map->cap ? map->cap * 2 : 64;
+        struct hash_map_entry *slots = calloc(cap, sizeof(*slots));
+        if (!slots) {
+            return -1;
+        }
+        for (size_t i = 0; i < map->cap; i++) { // Rehash the existing keys
+            if (map->slots[i].key) {
+                size_t j = hash_string(map->slots[i].key) & (cap - 1);
+                while (slots[j].key) {
+                    j = (j + 1) & (cap - 1);
+                }
+                slots[j] = map->slots[i];
+            }
+        }
+        free(map->slots);
+        map->slots = slots;
+        map->cap = cap;
+    }
+    size_t i = hash_string(key) & (map->cap - 1);
+    while (map->slots[i].key && strcmp(map->slots[i].key, key) != 0) {
+        i = (i + 1) & (map->cap - 1);
+    }
+    if (!map->slots[i].key) {
+        map->count++;
+    }
+    map->slots[i].key = key;
+    map->slots[i].value = value;
+    return 0;
+}
+
+// Look a key up. Returns 1 and sets *value if it is present, 0 otherwise.
+static int hash_map_get(const struct hash_map *map, const char *key, size_t *value) {
+    if (map->cap == 0) {
+        return 0;
+    }
+    size_t i = hash_string(key) & (map->cap - 1);
+    while (map->slots[i].key) {
+        if (strcmp(map->slots[i].key, key) == 0) {
+            *value = map->slots[i].value;
+            return 1;
+        }
+        i = (i + 1) & (map->cap - 1);
+    }
+    return 0;
+}
+
+// Give a key that is already present a new value and key string (equal to the old one), in place: unlike
+// hash_map_put() this never allocates. Returns 1 if the key was present, 0 otherwise.
+static int hash_map_replace(struct hash_map *map, const char *key, size_t value) {
+    if (map->cap == 0) {
+        return 0;
+    }
+    size_t i = hash_string(key) & (map->cap - 1);
+    while (map->slots[i].key) {
+        if (strcmp(map->slots[i].key, key) == 0) {
+            map->slots[i].key = key;
+            map->slots[i].value = value;
+            return 1;
+        }
+        i = (i + 1) & (map->cap - 1);
+    }
+    return 0;
+}
+
+// Remove a key (backward-shift deletion keeps probe chains intact without tombstones). Returns 1 if it was present.
+static int hash_map_remove(struct hash_map *map, const char *key) {
+    if (map->cap == 0) {
+        return 0;
+    }
+    size_t mask = map->cap - 1;
+    size_t i = hash_string(key) & mask;
+    while (map->slots[i].key && strcmp(map->slots[i].key, key) != 0) {
+        i = (i + 1) & mask;
+    }
+    if (!map->slots[i].key) {
+        return 0;
+    }
+    for (size_t j = (i + 1) & mask; map->slots[j].key; j = (j + 1) & mask) {
+        size_t home = hash_string(map->slots[j].key) & mask; // Where the entry in slot j wants to be
+        // Move it into the hole at i unless its home lies cyclically in (i, j]
+        int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            map->slots[i] = map->slots[j];
+            i = j;
+        }
+    }
+    map->slots[i].key = NULL;
+    map->count--;
+    return 1;
+}
+
+// Free the table (not the keys)
+static void hash_map_free(struct hash_map *map) {
+    free(map->slots);
+    memset(map, 0, sizeof(map[0]));
+}
+
+// Directory part of a relative path ("" for entries directly in the root), written into out
+static void path_dirname(const char *path, char *out) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    memcpy(out, path, len);
+    out[len] = '\0';
+}
+
+// Join a relative directory and a name into out ("name" when the directory is the root)
+static void path_join_relative(const char *dir, const char *name, char *out, size_t out_size) {
+    snprintf(out, out_size, "%s%s%s", dir, dir[0] ? "/" : "", name);
+}
+
+// Function to decode every path of an index in id order into list. Returns 0 or -1.
+int index_decode_all(const struct file_index *idx, struct string_list *list) {
+    char *buf = malloc((size_t)idx->header->max_path_len + 1);
+    if (!buf) {
+        return -1;
+    }
+    const uint8_t *pos = idx->paths;
+    const uint8_t *end = idx->paths + idx->paths_len;
+    size_t len = 0;
+    for (uint64_t i = 0; i < idx->header->file_count; i++) { // One sequential pass instead of a restart per path
+        uint64_t shared, suffix;
+        if (read_varint(&pos, end, &shared) != 0 || read_varint(&pos, end, &suffix) != 0 ||
+            shared > len || suffix > (uint64_t)(end - pos) || shared + suffix > idx->header->max_path_len) {
+            free(buf);
+            return -1;
+        }
+        memcpy(buf + shared, pos, suffix);
+        pos += suffix;
+        len = shared + suffix;
+        buf[len] = '\0';
+        if (string_list_add(list, buf) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// Whether a recorded directory still matches its current status
+static int index_dir_unchanged(const struct index_dir *rec, const struct stat *st) {
+    return !(rec->flags & INDEX_DIR_RESCAN) &&
+           rec->mtime_sec == (int64_t)st->st_mtim.tv_sec && rec->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+           rec->ctime_sec == (int64_t)st->st_ctim.tv_sec && rec->ctime_nsec == (int64_t)st->st_ctim.tv_nsec &&
+           rec->ino == (uint64_t)st->st_ino && rec->dev == (uint64_t)st->st_dev;
+}
+
+// Read a changed directory: add its regular files to files and queue its subdirectories on pending
+static int index_reread_dir(const char *full, const char *rel, struct string_list *files, struct string_list *pending) {
+    DIR *dp = opendir(full);
+    if (!dp) {
+        return 0; // Unreadable directories contribute nothing, as in a full build
+    }
+    char child[PATH_MAX];
+    int rc = 0;
+    struct dirent *entry;
+    while (rc == 0 && (entry = readdir(dp)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) { // The file system did not report a type
+            struct stat st;
+            if (fstatat(dirfd(dp), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+        }
+        path_join_relative(rel, name, child, sizeof(child));
+        if (type == DT_REG) {
+            rc = string_list_add(files, child);
+        } else if (type == DT_DIR) {
+            rc = string_list_add(pending, child);
+        }
+    }
+    closedir(dp);
+    return rc;
+}
+
+// Function to refresh an index in place, re-reading only directories that changed since it was written
+int index_update(const char *root, const char *index_file) {
+    char canonical_root[PATH_MAX];
+    if (!realpath(root, canonical_root)) {
+        perror("realpath");
+        return -1;
+    }
+
+    struct file_index idx;
+    if (access(index_file, F_OK) != 0 || index_open(&idx, index_file) != 0) {
+        printf("No usable index, building a new one\n");
+        return index_build(root, index_file);
+    }
+    if (idx.root_len != strlen(canonical_root) || memcmp(idx.root, canonical_root, idx.root_len) != 0) {
+        fprintf(stderr, "The index was built for %.*s, not for rootDir\n", (int)idx.root_len, idx.root);
+        index_close(&idx);
+        return -1;
+    }
+
+    // Load the old index: paths, directory records and, per directory, its files and child directories
+    struct string_list old_paths = { 0 }, old_dirs = { 0 };
+    struct hash_map dir_ids = { 0 }; // Relative directory path -> position in old_dirs / idx.dirs
+    size_t dir_count = idx.dir_count;
+    size_t *file_start = calloc(dir_count + 1, sizeof(size_t)); // Per-directory ranges into file_ids (CSR layout)
+    size_t *child_start = calloc(dir_count + 1, sizeof(size_t)); // Per-directory ranges into child_ids
+    size_t *file_ids = malloc((idx.header->file_count + 1) * sizeof(size_t));
+    size_t *child_ids = malloc((dir_count + 1) * sizeof(size_t));
+    size_t *path_dir = malloc((idx.header->file_count + 1) * sizeof(size_t)); // Directory of each old path
+    size_t *dir_parent = malloc((dir_count + 1) * sizeof(size_t)); // Parent of each old directory (SIZE_MAX for the root)
+    char *scratch = malloc((size_t)idx.header->max_path_len + idx.dir_blob_len + 2); // Dirname buffer
+    int failed = !file_start || !child_start || !file_ids || !child_ids || !path_dir || !dir_parent || !scratch;
+    failed = failed || index_decode_all(&idx, &old_paths) != 0;
+    for (size_t i = 0; i < dir_count && !failed; i++) {
+        const struct index_dir *rec = &idx.dirs[i];
+        if (rec->path_offset > idx.dir_blob_len || rec->path_len > idx.dir_blob_len - rec->path_offset) {
+            failed = 1;
+            break;
+        }
+        memcpy(scratch, idx.dir_blob + rec->path_offset, rec->path_len);
+        scratch[rec->path_len] = '\0';
+        failed = string_list_add(&old_dirs, scratch) != 0 || hash_map_put(&dir_ids, old_dirs.items[i], i) != 0;
+    }
+    for (size_t i = 0; i < old_paths.count && !failed; i++) { // Count files per directory
+        path_dirname(old_paths.items[i], scratch);
+        path_dir[i] = SIZE_MAX;
+        if (hash_map_get(&dir_ids, scratch, &path_dir[i])) {
+            file_start[path_dir[i] + 1]++;
+        }
+    }
+    for (size_t i = 0; i < dir_count && !failed; i++) { // Count child directories per directory
+        dir_parent[i] = SIZE_MAX;
+        if (old_dirs.items[i][0] != '\0') {
+            path_dirname(old_dirs.items[i], scratch);
+            if (hash_map_get(&dir_ids, scratch, &dir_parent[i])) {
+                child_start[dir_parent[i] + 1]++;
+            }
+        }
+    }
+    if (!failed) {
+        for (size_t i = 0; i < dir_count; i++) { // Prefix sums turn the counts into start offsets
+            file_start[i + 1] += file_start[i];
+            child_start[i + 1] += child_start[i];
+        }
+        size_t *file_fill = calloc(dir_count + 1, sizeof(size_t));
+        size_t *child_fill = calloc(dir_count + 1, sizeof(size_t));
+        failed = !file_fill || !child_fill;
+        for (size_t i = 0; i < old_paths.count && !failed; i++) {
+            if (path_dir[i] != SIZE_MAX) {
+                file_ids[file_start[path_dir[i]] + file_fill[path_dir[i]]++] = i;
+            }
+        }
+        for (size_t i = 0; i < dir_count && !failed; i++) {
+            if (dir_parent[i] != SIZE_MAX) {
+                child_ids[child_start[dir_parent[i]] + child_fill[dir_parent[i]]++] = i;
+            }
+        }
+        free(file_fill);
+        free(child_fill);
+    }
+
+    // Walk the tree top-down, reusing unchanged directories
+    struct string_list new_paths = { 0 }, pending = { 0 };
+    struct index_dir_list new_dirs = { 0 };
+    size_t reused = 0, reread = 0; // Statistics printed at the end
+    char full[PATH_MAX];
+    failed = failed || string_list_add(&pending, "") != 0;
+    while (!failed && pending.count > 0) {
+        char *rel = pending.items[--pending.count]; // Pop the next directory (relative path)
+        if (snprintf(full, sizeof(full), "%s%s%s", canonical_root, rel[0] ? "/" : "", rel) >= (int)sizeof(full)) { // Absolute path of the directory
+            fprintf(stderr, "%s/%s: path too long, skipped\n", canonical_root, rel);
+            free(rel); // Cannot be looked up: left out of the index
+            continue;
+        }
+        struct stat st;
+        if (lstat(full, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            free(rel); // Removed since the last run (or replaced by a non-directory)
+            continue;
+        }
+        failed = index_dir_list_add(&new_dirs, rel, &st) != 0;
+
+        size_t old_id;
+        if (!failed && hash_map_get(&dir_ids, rel, &old_id) && index_dir_unchanged(&idx.dirs[old_id], &st)) {
+            for (size_t k = file_start[old_id]; k < file_start[old_id + 1] && !failed; k++) {
+                failed = string_list_add(&new_paths, old_paths.items[file_ids[k]]) != 0;
+            }
+            for (size_t k = child_start[old_id]; k < child_start[old_id + 1] && !failed; k++) {
+                failed = string_list_add(&pending, old_dirs.items[child_ids[k]]) != 0;
+            }
+            reused++;
+        } else if (!failed) {
+            failed = index_reread_dir(full, rel, &new_paths, &pending) != 0;
+            reread++;
+        }
+        free(rel);
+    }
+
+    int rc = -1;
+    if (failed) {
+        fprintf(stderr, "Failed to refresh the index (out of memory or corrupt index)\n");
+    } else {
+        qsort(new_paths.items, new_paths.count, sizeof(char *), compare_strings);
+        index_close(&idx); // Done with the old mapping before the file is replaced
+        rc = index_write(index_file, canonical_root, new_paths.items, new_paths.count, new_dirs.items, new_dirs.count);
+        if (rc == 0) {
+            printf("Indexed %zu files (%zu directories reused, %zu re-read)\n", new_paths.count, reused, reread);
+        }
+    }
+
+    index_close(&idx);
+    string_list_free(&old_paths);
+    string_list_free(&old_dirs);
+    string_list_free(&new_paths);
+    string_list_free(&pending);
+    index_dir_list_free(&new_dirs);
+    hash_map_free(&dir_ids);
+    free(file_start);
+    free(child_start);
+    free(file_ids);
+    free(child_ids);
+    free(path_dir);
+    free(dir_parent);
+    free(scratch);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Substring search over the index
+//
+// The tar mode matches with strstr(basename, extension). With --index the same test runs against the index:
+// queries of three or more bytes intersect the posting lists of their trigrams and verify the few candidates,
+// shorter queries scan the packed name blob with SSE2 compares.
+
+// Find a trigram's posting list by binary search. Returns NULL if no name contains the trigram.
+static const struct index_trigram *index_find_trigram(const struct file_index *idx, uint32_t key) {
+    size_t lo = 0, hi = idx->trigram_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (idx->trigrams[mid].trigram < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < idx->trigram_count && idx->trigrams[lo].trigram == key ? &idx->trigrams[lo] : NULL;
+}
+
+// Decode one posting list into out (room for list->count values). Returns 0 or -1 if it is corrupt.
+static int index_decode_postings(const struct file_index *idx, const struct index_trigram *list, uint32_t *out) {
+    if (list->offset > idx->postings_len) {
+        return -1;
+    }
+    const uint8_t *pos = idx->postings + list->offset;
+    const uint8_t *end = idx->postings + idx->postings_len;
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < list->count; i++) {
+        uint64_t delta;
+        if (read_varint(&pos, end, &delta) != 0) {
+            return -1;
+        }
+        value = i == 0 ? delta : value + delta;
+        out[i] = (uint32_t)value;
+    }
+    return 0;
+}
+
+// Keep only the values of candidates[0..*count) that also occur in a posting list (both are ascending)
+static int index_intersect_postings(const struct file_index *idx, const struct index_trigram *list, uint32_t *candidates, size_t *count) {
+    if (list->offset > idx->postings_len) {
+        return -1;
+    }
+    const uint8_t *pos = idx->postings + list->offset;
+    const uint8_t *end = idx->postings + idx->postings_len;
+    uint64_t value = 0;
+    uint32_t decoded = 0; // Values of the list consumed so far
+    size_t kept = 0;
+    for (size_t i = 0; i < *count; i++) {
+        while (decoded < list->count && (decoded == 0 || value < candidates[i])) { // Advance the list to candidates[i]
+            uint64_t delta;
+            if (read_varint(&pos, end, &delta) != 0) {
+                return -1;
+            }
+            value = decoded == 0 ? delta : value + delta;
+            decoded++;
+        }
+        if (decoded > 0 && value == candidates[i]) {
+            candidates[kept++] = candidates[i];
+        } else if (decoded == list->count && value < candidates[i]) {
+            break; // The list is exhausted
+        }
+    }
+    *count = kept;
+    return 0;
+}
+
+// Find the next position >= from in blob[0..len) where a one- or two-byte query starts, or len if there is none
+static size_t name_blob_find_short(const char *blob, size_t len, size_t from, const char *query, size_t query_len) {
+    size_t i = from;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(query[0]); // First query byte in every lane
+    const __m128i second = _mm_set1_epi8(query_len > 1 ? query[1] : 0); // Second query byte in every lane
+    while (i + 17 <= len) { // 16 lanes plus the byte after them for the second comparison
+        __m128i block = _mm_loadu_si128((const __m128i *)(blob + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, first));
+        if (query_len > 1) {
+            __m128i next = _mm_loadu_si128((const __m128i *)(blob + i + 1));
+            mask &= (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(next, second));
+        }
+        if (mask) {
+            return i + (size_t)__builtin_ctz(mask); // Lowest set bit is the earliest match
+        }
+        i += 16;
+    }
+#endif
+    for (; i + query_len <= len; i++) { // Tail (or whole blob without SSE2)
+        if (blob[i] == query[0] && (query_len == 1 || blob[i + 1] == query[1])) {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Position of the first basename table entry whose name starts at or after a blob offset
+static uint64_t index_entry_at_offset(const struct file_index *idx, uint64_t offset) {
+    uint64_t lo = 0, hi = idx->name_count;
+    while (lo < hi) { // Entries are stored in blob order, so name_offset is ascending
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (idx->names[mid].name_offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Append the path ids of every entry of the name group starting at entry first
+static int index_collect_group(const struct file_index *idx, uint64_t first, uint32_t **ids, size_t *count, size_t *cap) {
+    for (uint64_t i = first; i < idx->name_count && idx->names[i].name_offset == idx->names[first].name_offset; i++) {
+        if (*count == *cap) {
+            size_t grown_cap = *cap ? *cap * 2 : 256;
+            uint32_t *grown = realloc(*ids, grown_cap * sizeof(*grown));
+            if (!grown) {
+                return -1;
+            }
+            *ids = grown;
+            *cap = grown_cap;
+        }
+        (*ids)[(*count)++] = idx->names[i].path_id;
+    }
+    return 0;
+}
+
+// qsort() comparator for path ids
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Collect the path ids of all files whose basename contains query. Returns 0 or -1.
+static int index_find_substring(const struct file_index *idx, const char *query, uint32_t **ids, size_t *count) {
+    size_t query_len = strlen(query);
+    size_t cap = 0;
+    *ids = NULL;
+    *count = 0;
+
+    if (query_len == 0) { // strstr(name, "") matches every name
+        for (uint64_t i = 0; i < idx->name_count; i++) {
+            if ((i == 0 || idx->names[i].name_offset != idx->names[i - 1].name_offset) && index_collect_group(idx, i, ids, count, &cap) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (query_len < 3) { // Too short for trigrams: scan the blob
+        size_t pos = 0;
+        while ((pos = name_blob_find_short(idx->name_blob, idx->name_blob_len, pos, query, query_len)) < idx->name_blob_len) {
+            // The match lies inside the name that starts at the last entry offset <= pos
+            uint64_t entry = index_entry_at_offset(idx, pos + 1);
+            if (entry == 0) {
+                return -1;
+            }
+            uint64_t group = index_entry_at_offset(idx, idx->names[entry - 1].name_offset);
+            if (index_collect_group(idx, group, ids, count, &cap) != 0) {
+                return -1;
+            }
+            pos = idx->names[group].name_offset + idx->names[group].name_len + 1; // Continue after this name
+        }
+        return 0;
+    }
+
+    // Look up every trigram of the query; a missing one means no name can match
+    size_t ngrams = query_len - 2;
+    const struct index_trigram **lists = malloc(ngrams * sizeof(*lists));
+    if (!lists) {
+        return -1;
+    }
+    for (size_t i = 0; i < ngrams; i++) {
+        lists[i] = index_find_trigram(idx, trigram_key((const unsigned char *)query + i));
+        if (!lists[i]) {
+            free(lists);
+            return 0;
+        }
+    }
+    size_t smallest = 0; // Start from the shortest list so the candidate set is small from the beginning
+    for (size_t i = 1; i < ngrams; i++) {
+        if (lists[i]->count < lists[smallest]->count) {
+            smallest = i;
+        }
+    }
+    size_t ncand = lists[smallest]->count;
+    uint32_t *candidates = malloc((ncand ? ncand : 1) * sizeof(*candidates));
+    int rc = candidates ? index_decode_postings(idx, lists[smallest], candidates) : -1;
+    for (size_t i = 0; i < ngrams && rc == 0 && ncand > 0; i++) {
+        if (i != smallest && lists[i] != lists[smallest]) {
+            rc = index_intersect_postings(idx, lists[i], candidates, &ncand);
+        }
+    }
+    for (size_t i = 0; i < ncand && rc == 0; i++) { // Trigrams are necessary, not sufficient: verify each name
+        const struct index_name *entry = &idx->names[candidates[i]];
+        if (candidates[i] >= idx->name_count || entry->name_offset >= idx->name_blob_len) {
+            rc = -1;
+        } else if (strstr(idx->name_blob + entry->name_offset, query) != NULL) {
+            rc = index_collect_group(idx, candidates[i], ids, count, &cap);
+        }
+    }
+    free(candidates);
+    free(lists);
+    return rc;
+}
+
+// Function to find every file below root whose basename contains query and hand it to archive_found_file()
+int index_search_substring(const char *index_file, const char *root, const char *query) {
+    struct file_index idx;
+    if (index_open(&idx, index_file) != 0) {
+        return -1;
+    }
+    char *sub_prefix;
+    if (index_locate_root(&idx, root, &sub_prefix) != 0) {
+        index_close(&idx);
+        return -1;
+    }
+
+    uint32_t *ids = NULL;
+    size_t count = 0;
+    size_t visible_size = (size_t)idx.header->max_path_len + strlen(root) + 2;
+    char *rel = malloc((size_t)idx.header->max_path_len + 1);
+    char *visible = malloc(visible_size);
+    int rc = rel && visible ? index_find_substring(&idx, query, &ids, &count) : -1;
+    if (rc != 0) {
+        fprintf(stderr, "Substring search failed (out of memory or corrupt index): %s\n", index_file);
+    } else {
+        qsort(ids, count, sizeof(*ids), compare_u32); // Path order, like a walk with --ordered
+    }
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        if (index_path_at(&idx, ids[i], rel) != 0) {
+            fprintf(stderr, "Corrupt index file: %s\n", index_file);
+            rc = -1;
+            break;
+        }
+        const char *path = index_visible_path(rel, sub_prefix, strlen(sub_prefix), root, visible, visible_size);
+        if (path) {
+            rc = archive_found_file(path, (int)(path_basename(path) - path), NULL); // The writer stats the file itself
+        }
+    }
+
+    free(ids);
+    free(rel);
+    free(visible);
+    free(sub_prefix);
+    index_close(&idx);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Batch search
+//
+// "--names FILE rootDir" reads one target name per line from FILE ("-" for standard input) and resolves all of them
+// in a single traversal, printing "name<TAB>path" for every match as it is found. With --names-match exact (the
+// default) a file matches a target whose name equals its basename, looked up in a hash set. With --names-match
+// substring a file matches every target contained in its basename, found in one pass over the name by an
+// Aho-Corasick automaton. --first/--max-results limit the matches per target, and the walk ends as soon as every
+// target has reached its limit. Targets that were never found are listed at the end.
+
+// Aho-Corasick automaton over the target names. State 0 is the root; every other state has one parent edge.
+struct ac_automaton {
+    uint32_t root_next[256]; // Transitions out of the root, looked up directly (0: none)
+    uint32_t *first_child; // First child of each state (0: none)
+    uint32_t *next_sibling; // Next child of the same parent (0: none)
+    unsigned char *label; // Byte on the edge from the parent
+    uint32_t *fail; // Longest proper suffix of the state's string that is also a state
+    uint32_t *dict; // Nearest state along the fail chain that completes a target (0: none)
+    int32_t *target; // Target completed by this state, or -1
+    size_t count; // Number of states
+    size_t cap; // Allocated states
+};
+
+// Targets of a batch search and how often each has been found
+struct name_batch {
+    struct string_list names; // Distinct targets in input order
+    long *found; // Matches printed per target
+    size_t unresolved; // Targets that still need matches
+    struct hash_map exact; // Target name -> index (exact mode)
+    struct ac_automaton ac; // Automaton over all targets (substring mode)
+    int substring; // Match mode
+    unsigned *seen; // Generation in which a target last matched, so a name reports each target once
+    unsigned generation; // Bumped for every reported file
+};
+
+struct name_batch batch; // Targets of the running batch search
+
+// Transition from a state on a byte (0: none)
+static uint32_t ac_goto(const struct ac_automaton *ac, uint32_t state, unsigned char c) {
+    if (state == 0) {
+        return ac->root_next[c];
+    }
+    for (uint32_t child = ac->first_child[state]; child; child = ac->next_sibling[child]) {
+        if (ac->label[child] == c) {
+            return child;
+        }
+    }
+    return 0;
+}
+
+// Append a state. Returns its number, or 0 if memory runs out.
+static uint32_t ac_new_state(struct ac_automaton *ac, uint32_t parent, unsigned char c) {
+    if (ac->count == ac->cap) {
+        size_t cap = ac->cap ? ac->cap * 2 : 1024;
+        uint32_t *first_child = realloc(ac->first_child, cap * sizeof(*first_child));
+        if (!first_child) {
+            return 0;
+        }
+        ac->first_child = first_child; // Each array is stored as soon as it has grown, so ac_free() releases it
+        uint32_t *next_sibling = realloc(ac->next_sibling, cap * sizeof(*next_sibling));
+        if (!next_sibling) {
+            return 0;
+        }
+        ac->next_sibling = next_sibling;
+        unsigned char *label = realloc(ac->label, cap * sizeof(*label));
+        if (!label) {
+            return 0;
+        }
+        ac->label = label;
+        uint32_t *fail = realloc(ac->fail, cap * sizeof(*fail));
+        if (!fail) {
+            return 0;
+        }
+        ac->fail = fail;
+        uint32_t *dict = realloc(ac->dict, cap * sizeof(*dict));
+        if (!dict) {
+            return 0;
+        }
+        ac->dict = dict;
+        int32_t *target = realloc(ac->target, cap * sizeof(*target));
+        if (!target) {
+            return 0;
+        }
+        ac->target = target;
+        ac->cap = cap;
+    }
+    uint32_t state = (uint32_t)ac->count++;
+    ac->first_child[state] = 0;
+    ac->label[state] = c;
+    ac->fail[state] = 0;
+    ac->dict[state] = 0;
+    ac->target[state] = -1;
+    if (state != 0) { // Link the new state under its parent
+        if (parent == 0) {
+            ac->root_next[c] = state;
+            ac->next_sibling[state] = 0;
+        } else {
+            ac->next_sibling[state] = ac->first_child[parent];
+            ac->first_child[parent] = state;
+        }
+    }
+    return state;
+}
+
+// Build the automaton for a list of distinct targets. Returns 0 on success, -1 if memory runs out.
+static int ac_build(struct ac_automaton *ac, const struct string_list *targets) {
+    memset(ac, 0, sizeof(*ac));
+    if (ac_new_state(ac, 0, 0) != 0 || ac->count != 1) { // The root
+        return -1;
+    }
+    for (size_t i = 0; i < targets->count; i++) { // Trie of all targets
+        uint32_t state = 0;
+        for (const unsigned char *p = (const unsigned char *)targets->items[i]; *p; p++) {
+            uint32_t next = ac_goto(ac, state, *p);
+            if (!next && !(next = ac_new_state(ac, state, *p))) {
+                return -1;
+            }
+            state = next;
+        }
+        ac->target[state] = (int32_t)i;
+    }
+
+    // Fail and dictionary links, breadth first so that every shorter state is finished before it is used
+    uint32_t *queue = malloc(ac->count * sizeof(*queue));
+    if (!queue) {
+        return -1;
+    }
+    size_t head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        if (ac->root_next[c]) {
+            queue[tail++] = ac->root_next[c]; // Depth one: fail to the root
+        }
+    }
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        uint32_t child = state ? ac->first_child[state] : 0;
+        for (; child; child = ac->next_sibling[child]) {
+            unsigned char c = ac->label[child];
+            uint32_t f = ac->fail[state];
+            uint32_t next;
+            while ((next = ac_goto(ac, f, c)) == 0 && f != 0) {
+                f = ac->fail[f];
+            }
+            ac->fail[child] = next;
+            ac->dict[child] = ac->target[next] >= 0 ? next : ac->dict[next];
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+    return 0;
+}
+
+// Free the automaton
+static void ac_free(struct ac_automaton *ac) {
+    free(ac->first_child);
+    free(ac->next_sibling);
+    free(ac->label);
+    free(ac->fail);
+    free(ac->dict);
+    free(ac->target);
+    memset(ac, 0, sizeof(*ac));
+}
+
+// Run the automaton over a name. With report NULL, returns 1 at the first target found (0 if none); otherwise calls
+// report for every target occurrence and returns 0, or the first nonzero value report returned.
+static int ac_scan(const struct ac_automaton *ac, const char *name, int (*report)(size_t target, void *arg), void *arg) {
+    uint32_t state = 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        uint32_t next;
+        while ((next = ac_goto(ac, state, *p)) == 0 && state != 0) {
+            state = ac->fail[state];
+        }
+        state = next;
+        for (uint32_t out = ac->target[state] >= 0 ? state : ac->dict[state]; out; out = ac->dict[out]) {
+            if (!report) {
+                return 1;
+            }
+            int rc = report((size_t)ac->target[out], arg);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+// Walker prefilter: whether a basename can match any target (runs in the walker threads, outside the callback lock)
+static int batch_name_filter(const char *name) {
+    size_t index;
+    if (batch.substring) {
+        return ac_scan(&batch.ac, name, NULL, NULL);
+    }
+    return hash_map_get(&batch.exact, name, &index);
+}
+
+// Print one match of a target unless the target already has enough
+static int batch_report(size_t target, void *arg) {
+    const char *fpath = arg;
+    if (batch.seen[target] == batch.generation) {
+        return 0; // The target occurs more than once in this name
+    }
+    batch.seen[target] = batch.generation;
+    if (max_results > 0 && batch.found[target] >= max_results) {
+        return 0;
+    }
+    printf("%s\t%s\n", batch.names.items[target], fpath);
+    batch.found[target]++;
+    match_count++;
+    if (max_results > 0 ? batch.found[target] == max_results : batch.found[target] == 1) {
+        batch.unresolved--; // With a limit, a target is done once it has reached it; without one, once it is found
+    }
+    return max_results > 0 && batch.unresolved == 0 ? WALK_STOP : 0; // Every target is done: stop the walk
+}
+
+// Callback function to match each file against all batch targets
+int search_batch_names(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)sb;
+    if (typeflag != FTW_F) {
+        return 0; // Only regular files are matched, as in the single-name search
+    }
+    const char *name = fpath + ftwbuf->base;
+    batch.generation++;
+    if (batch.substring) {
+        return ac_scan(&batch.ac, name, batch_report, (void *)fpath);
+    }
+    size_t index;
+    if (hash_map_get(&batch.exact, name, &index)) {
+        return batch_report(index, (void *)fpath);
+    }
+    return 0;
+}
+
+// Read the distinct non-empty lines of a names file. Returns 0 on success, -1 on failure (a message has been printed).
+static int batch_read_names(const char *names_file, struct string_list *names, struct hash_map *seen) {
+    FILE *fp = strcmp(names_file, "-") == 0 ? stdin : fopen(names_file, "r");
+    if (!fp) {
+        perror("fopen");
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    int rc = 0;
+    while (rc == 0 && (len = getline(&line, &line_cap, fp)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        size_t index;
+        if (len == 0 || hash_map_get(seen, line, &index)) {
+            continue; // Blank line or repeated target
+        }
+        if (string_list_add(names, line) != 0 ||
+            hash_map_put(seen, names->items[names->count - 1], names->count - 1) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            rc = -1;
+        }
+    }
+    if (rc == 0 && ferror(fp)) {
+        perror("getline");
+        rc = -1;
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return rc;
+}
+
+// Function to resolve every name listed in names_file below root in one traversal
+int search_names(const char *names_file, const char *root) {
+    memset(&batch, 0, sizeof(batch));
+    batch.substring = strcmp(names_match, "substring") == 0;
+    int rc = batch_read_names(names_file, &batch.names, &batch.exact);
+    if (rc == 0 && batch.names.count == 0) {
+        fprintf(stderr, "No names to search for\n");
+        rc = -1;
+    }
+    if (rc == 0) {
+        batch.found = calloc(batch.names.count, sizeof(*batch.found));
+        batch.seen = calloc(batch.names.count, sizeof(*batch.seen));
+        if (!batch.found || !batch.seen || (batch.substring && ac_build(&batch.ac, &batch.names) != 0)) {
+            fprintf(stderr, "Out of memory\n");
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        batch.unresolved = batch.names.count;
+        walk_name_filter = batch_name_filter; // Let the walker threads drop non-matching files before the callback lock
+        rc = walk_tree(root, search_batch_names);
+        walk_name_filter = NULL;
+        if (rc == -1) {
+            perror("walk_tree"); // Print an error message
+        } else {
+            for (size_t i = 0; i < batch.names.count; i++) {
+                if (batch.found[i] == 0) {
+                    printf("Search Unsuccessful: %s\n", batch.names.items[i]);
+                }
+            }
+        }
+    }
+
+    ac_free(&batch.ac);
+    hash_map_free(&batch.exact);
+    string_list_free(&batch.names);
+    free(batch.found);
+    free(batch.seen);
+    return rc == -1 ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------------------------
+// Unix socket helpers for the resident modes
+
+#define DAEMON_MAX_CLIENTS 64 // Connections served at the same time
+#define LINE_CLIENT_BUFFER (PATH_MAX * 4) // Longest request line a client may send
+
+volatile sig_atomic_t server_stop = 0; // Set by SIGINT/SIGTERM to end run_line_server()
+
+// A connected client that sends newline-terminated requests
+struct line_client {
+    int fd; // Connected socket
+    size_t start; // Start of the unprocessed input in buf
+    size_t len; // Bytes in buf
+    char buf[LINE_CLIENT_BUFFER]; // Input received so far
+};
+
+// Create a listening Unix stream socket at path, replacing a stale socket left by an earlier run
+int listen_unix_socket(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path); // Only ever remove a socket, never a regular file given by mistake
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        perror("socket");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Send a whole buffer to a socket. Returns 0 on success, -1 on failure.
+int send_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Start tracking a newly accepted client
+static void line_client_init(struct line_client *client, int fd) {
+    struct timeval timeout = { 1, 0 }; // A client that stops reading cannot stall the server for long
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    client->fd = fd;
+    client->start = 0;
+    client->len = 0;
+}
+
+// Read what the client sent. Returns the number of bytes read, 0 at end of input, -1 on error or overlong line.
+static ssize_t line_client_read(struct line_client *client) {
+    if (client->start > 0) { // Drop processed lines
+        memmove(client->buf, client->buf + client->start, client->len - client->start);
+        client->len -= client->start;
+        client->start = 0;
+    }
+    if (client->len >= sizeof(client->buf) - 1) {
+        return -1; // No newline in a full buffer
+    }
+    ssize_t n = read(client->fd, client->buf + client->len, sizeof(client->buf) - 1 - client->len);
+    if (n > 0) {
+        client->len += (size_t)n;
+    }
+    return n;
+}
+
+// Return the next complete request line (without its newline), or NULL if none is buffered
+static char *line_client_next(struct line_client *client) {
+    char *begin = client->buf + client->start;
+    char *newline = memchr(begin, '\n', client->len - client->start);
+    if (!newline) {
+        return NULL;
+    }
+    *newline = '\0';
+    if (newline > begin && newline[-1] == '\r') {
+        newline[-1] = '\0'; // Tolerate CRLF clients
+    }
+    client->start = (size_t)(newline + 1 - client->buf);
+    return begin;
+}
+
+// Close a client connection
+static void line_client_close(struct line_client *client) {
+    close(client->fd);
+    client->fd = -1;
+}
+
+// Stop the server loop on SIGINT/SIGTERM
+static void server_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+// Function to serve newline-terminated requests on a Unix socket until SIGINT/SIGTERM.
+// event_fd (or -1) is polled alongside the clients and drained with on_event before requests are answered;
+// on_line answers one request and returns nonzero to drop the client.
+int run_line_server(const char *socket_path, int event_fd, int (*on_event)(void), int (*on_line)(int client, char *line)) {
+    int listen_fd = listen_unix_socket(socket_path);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_signal; // No SA_RESTART: poll() must return so the loop can exit
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN); // A client hanging up must not kill the server
+    fflush(stdout);
+
+    static struct line_client clients[DAEMON_MAX_CLIENTS]; // Large buffers: keep them off the stack
+    size_t nclients = 0;
+    while (!server_stop) {
+        struct pollfd fds[DAEMON_MAX_CLIENTS + 2];
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = event_fd; // Negative descriptors are ignored by poll()
+        fds[1].events = POLLIN;
+        for (size_t i = 0; i < nclients; i++) {
+            fds[i + 2].fd = clients[i].fd;
+            fds[i + 2].events = POLLIN;
+        }
+        if (poll(fds, nclients + 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (event_fd >= 0 && (fds[1].revents & POLLIN) && on_event() != 0) { // Apply changes before answering
+            fprintf(stderr, "server: failed to apply events\n");
+        }
+        for (size_t i = nclients; i-- > 0;) { // Backwards, so removing a client does not skip one
+            if (!(fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            char *line;
+            int rc = 0;
+            ssize_t status = line_client_read(&clients[i]);
+            while (status >= 0 && rc == 0 && (line = line_client_next(&clients[i])) != NULL) {
+                rc = on_line(clients[i].fd, line);
+            }
+            if (status <= 0 || rc != 0) { // Closed, failed or misbehaving client
+                line_client_close(&clients[i]);
+                clients[i] = clients[--nclients];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0 && nclients < DAEMON_MAX_CLIENTS) {
+                line_client_init(&clients[nclients++], fd);
+            } else if (fd >= 0) {
+                close(fd); // Too many clients
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nclients; i++) {
+        line_client_close(&clients[i]);
+    }
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+// Function to send standard input to a server or daemon socket and copy its replies to standard output
+int run_client(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char buffer[65536];
+    ssize_t n;
+    int rc = 0;
+    while ((n = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) { // Requests are batched: send them all first
+        if (send_all(fd, buffer, (size_t)n) != 0) {
+            perror("send");
+            rc = -1;
+            break;
+        }
+    }
+    shutdown(fd, SHUT_WR); // End of requests; the server answers what it has and closes
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (fwrite(buffer, 1, (size_t)n, stdout) != (size_t)n) {
+            rc = -1;
+            break;
+        }
+    }
+    fflush(stdout);
+    close(fd);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Live index daemon
+//
+// "--daemon SOCKET rootDir" builds an in-memory index of rootDir once, keeps it current from fanotify events
+// (a filesystem-wide mark, which needs CAP_SYS_ADMIN) or, as a fallback, from one inotify watch per directory,
+// and answers lookups on a Unix domain socket. Each request is one line holding a file name; the reply holds one
+// line per matching regular file (reported as a walk of rootDir would report it) followed by an empty line.
+//
+// The index is a tree of directories so that renaming or deleting a directory only touches that subtree, plus a
+// basename map whose entries chain every file with the same name.
+
+// A regular file in the live index
+struct live_file {
+    char *name; // Basename (also the key in its directory's files map)
+    struct live_dir *dir; // Directory holding the file
+    struct live_file *prev_same; // Previous file with the same basename
+    struct live_file *next_same; // Next file with the same basename
+};
+
+// A directory in the live index
+struct live_dir {
+    char *name; // Name within the parent ("" for the root)
+    struct live_dir *parent; // Parent directory, NULL for the root
+    struct hash_map subdirs; // Name -> struct live_dir *
+    struct hash_map files; // Name -> struct live_file *
+    int wd; // inotify watch descriptor, -1 when not watched
+};
+
+// State of the daemon
+struct live_index {
+    struct live_dir *root; // Root of the tree
+    struct hash_map by_name; // Basename -> first struct live_file * with that name
+    struct live_dir **by_wd; // inotify watch descriptor -> directory
+    size_t wd_cap; // Slots in by_wd
+    int inotify_fd; // inotify instance, -1 when fanotify (or nothing) is used
+    int fanotify_fd; // fanotify group, -1 when inotify is used
+    int mount_fd; // Directory fd on the watched file system, for open_by_handle_at()
+    char root_path[PATH_MAX]; // Canonical root directory
+    size_t file_count; // Number of files in the index
+    size_t build_prefix; // Length of the walked root plus its '/', while (re)building
+};
+
+struct live_index live = { .inotify_fd = -1, .fanotify_fd = -1, .mount_fd = -1 }; // The daemon's index
+
+// Create a directory node below parent (NULL for the root). Returns NULL if memory runs out.
+static struct live_dir *live_dir_new(struct live_dir *parent, const char *name) {
+    struct live_dir *dir = calloc(1, sizeof(*dir));
+    if (!dir || !(dir->name = strdup(name))) {
+        free(dir);
+        return NULL;
+    }
+    dir->parent = parent;
+    dir->wd = -1;
+    if (parent && hash_map_put(&parent->subdirs, dir->name, (size_t)(uintptr_t)dir) != 0) {
+        free(dir->name);
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+// Find (or with create, make) the directory node for a path relative to the root
+static struct live_dir *live_dir_lookup(const char *rel, int create) {
+    struct live_dir *dir = live.root;
+    char component[NAME_MAX + 1];
+    while (dir && *rel) {
+        const char *slash = strchr(rel, '/');
+        size_t len = slash ? (size_t)(slash - rel) : strlen(rel);
+        if (len > NAME_MAX) {
+            return NULL;
+        }
+        memcpy(component, rel, len);
+        component[len] = '\0';
+        rel += len + (slash != NULL);
+        if (len == 0) {
+            continue; // Repeated slash
+        }
+        size_t value;
+        if (hash_map_get(&dir->subdirs, component, &value)) {
+            dir = (struct live_dir *)(uintptr_t)value;
+        } else {
+            dir = create ? live_dir_new(dir, component) : NULL;
+        }
+    }
+    return dir;
+}
+
+// Path of a directory relative to the root, written into out ("" for the root)
+static void live_dir_path(const struct live_dir *dir, char *out, size_t out_size) {
+    const char *parts[PATH_MAX / 2]; // Components from the directory up to the root
+    size_t n = 0;
+    for (; dir && dir->parent && n < sizeof(parts) / sizeof(parts[0]); dir = dir->parent) {
+        parts[n++] = dir->name;
+    }
+    size_t len = 0;
+    out[0] = '\0';
+    while (n > 0 && len < out_size) {
+        n--;
+        len += (size_t)snprintf(out + len, out_size - len, "%s%s", len ? "/" : "", parts[n]);
+    }
+}
+
+// Add a regular file to a directory (no-op if it is already there)
+static int live_add_file(struct live_dir *dir, const char *name) {
+    size_t value;
+    if (hash_map_get(&dir->files, name, &value)) {
+        return 0;
+    }
+    struct live_file *file = calloc(1, sizeof(*file));
+    if (!file || !(file->name = strdup(name))) {
+        free(file);
+        return -1;
+    }
+    file->dir = dir;
+    if (hash_map_put(&dir->files, file->name, (size_t)(uintptr_t)file) != 0) {
+        free(file->name);
+        free(file);
+        return -1;
+    }
+    if (hash_map_get(&live.by_name, name, &value)) { // Put it at the head of the same-name chain
+        file->next_same = (struct live_file *)(uintptr_t)value;
+        file->next_same->prev_same = file;
+    }
+    if (hash_map_put(&live.by_name, file->name, (size_t)(uintptr_t)file) != 0) {
+        if (file->next_same) {
+            file->next_same->prev_same = NULL;
+        }
+        hash_map_remove(&dir->files, file->name);
+        free(file->name);
+        free(file);
+        return -1;
+    }
+    live.file_count++;
+    return 0;
+}
+
+// Remove a file from the index and free it
+static void live_free_file(struct live_file *file) {
+    if (file->prev_same) {
+        file->prev_same->next_same = file->next_same;
+    } else if (file->next_same) {
+        // New chain head, keyed by its own copy of the name since this one is freed below; the entry exists (it is
+        // this file), so it is updated in place and nothing can fail
+        hash_map_replace(&live.by_name, file->next_same->name, (size_t)(uintptr_t)file->next_same);
+    } else {
+        hash_map_remove(&live.by_name, file->name);
+    }
+    if (file->next_same) {
+        file->next_same->prev_same = file->prev_same;
+    }
+    hash_map_remove(&file->dir->files, file->name);
+    live.file_count--;
+    free(file->name);
+    free(file);
+}
+
+// Remove a file by name, if it is indexed
+static void live_remove_file(struct live_dir *dir, const char *name) {
+    size_t value;
+    if (hash_map_get(&dir->files, name, &value)) {
+        live_free_file((struct live_file *)(uintptr_t)value);
+    }
+}
+
+// Remove a directory with everything below it (and its inotify watches) and free it
+static void live_free_dir(struct live_dir *dir) {
+    for (size_t i = 0; i < dir->subdirs.cap; i++) {
+        while (dir->subdirs.slots[i].key) { // Freeing a child shifts later entries into this slot
+            live_free_dir((struct live_dir *)(uintptr_t)dir->subdirs.slots[i].value);
+        }
+    }
+    for (size_t i = 0; i < dir->files.cap; i++) {
+        while (dir->files.slots[i].key) {
+            live_free_file((struct live_file *)(uintptr_t)dir->files.slots[i].value);
+        }
+    }
+    if (dir->wd >= 0) {
+        inotify_rm_watch(live.inotify_fd, dir->wd);
+        if ((size_t)dir->wd < live.wd_cap) {
+            live.by_wd[dir->wd] = NULL;
+        }
+    }
+    if (dir->parent) {
+        hash_map_remove(&dir->parent->subdirs, dir->name);
+    }
+    hash_map_free(&dir->subdirs);
+    hash_map_free(&dir->files);
+    free(dir->name);
+    free(dir);
+}
+
+// Start watching a directory with inotify (when inotify is the event source)
+static int live_watch_dir(struct live_dir *dir, const char *full) {
+    if (live.inotify_fd < 0) {
+        return 0;
+    }
+    int wd = inotify_add_watch(live.inotify_fd, full, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        return errno == ENOENT || errno == EACCES || errno == ENOTDIR ? 0 : -1; // Vanished or unreadable: skip it
+    }
+    if ((size_t)wd >= live.wd_cap) { // Watch descriptors are small integers: index them directly
+        size_t cap = live.wd_cap ? live.wd_cap : 1024;
+        while (cap <= (size_t)wd) {
+            cap *= 2;
+        }
+        struct live_dir **by_wd = realloc(live.by_wd, cap * sizeof(*by_wd));
+        if (!by_wd) {
+            return -1;
+        }
+        memset(by_wd + live.wd_cap, 0, (cap - live.wd_cap) * sizeof(*by_wd));
+        live.by_wd = by_wd;
+        live.wd_cap = cap;
+    }
+    live.by_wd[wd] = dir;
+    dir->wd = wd;
+    return 0;
+}
+
+// Walker callback that fills the live index. Directories are reported before they are read, so a watch added
+// here cannot miss an entry created while the directory is being scanned (duplicates are ignored).
+static int live_collect(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)sb;
+    const char *rel = strlen(fpath) >= live.build_prefix ? fpath + live.build_prefix : "";
+    if (typeflag == FTW_D) {
+        struct live_dir *dir = live_dir_lookup(rel, 1);
+        return dir && live_watch_dir(dir, fpath) == 0 ? 0 : -1;
+    }
+    if (typeflag != FTW_F || ftwbuf->level == 0) {
+        return 0; // Only regular files are searchable, as with search_and_process
+    }
+    char dir_rel[PATH_MAX];
+    path_dirname(rel, dir_rel);
+    struct live_dir *dir = live_dir_lookup(dir_rel, 1);
+    return dir && live_add_file(dir, fpath + ftwbuf->base) == 0 ? 0 : -1;
+}
+
+// Index (and watch) a directory subtree, given its absolute path
+static int live_scan(const char *full) {
+    live.build_prefix = strlen(live.root_path) + (strcmp(live.root_path, "/") != 0);
+    return walk_tree(full, live_collect) == -1 ? -1 : 0;
+}
+
+// Throw the whole index away and build it again (after an event queue overflow)
+static int live_rebuild(void) {
+    if (live.root) {
+        live_free_dir(live.root);
+    }
+    live.root = live_dir_new(NULL, "");
+    if (!live.root) {
+        return -1;
+    }
+    return live_scan(live.root_path);
+}
+
+// Apply one create/delete/move event for name inside dir
+static void live_apply_event(struct live_dir *dir, const char *name, int added, int is_dir) {
+    char rel[PATH_MAX], full[PATH_MAX * 2 + NAME_MAX + 2];
+    live_dir_path(dir, rel, sizeof(rel));
+    snprintf(full, sizeof(full), "%s%s%s%s%s", live.root_path, strcmp(live.root_path, "/") != 0 ? "/" : "", rel, rel[0] ? "/" : "", name);
+
+    size_t value;
+    if (is_dir) {
+        if (hash_map_get(&dir->subdirs, name, &value)) { // A move replaces any previous subtree of that name
+            live_free_dir((struct live_dir *)(uintptr_t)value);
+        }
+        if (added && live_dir_new(dir, name) && live_scan(full) != 0) {
+            fprintf(stderr, "daemon: failed to index %s\n", full);
+        }
+        return;
+    }
+    if (!added) {
+        live_remove_file(dir, name);
+        return;
+    }
+    struct stat st;
+    if (lstat(full, &st) == 0 && S_ISREG(st.st_mode) && live_add_file(dir, name) != 0) {
+        fprintf(stderr, "daemon: out of memory adding %s\n", full);
+    }
+}
+
+// Drain pending inotify events
+static int live_read_inotify(void) {
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(live.inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) { // Events were lost: start over
+                return live_rebuild();
+            }
+            struct live_dir *dir = ev->wd >= 0 && (size_t)ev->wd < live.wd_cap ? live.by_wd[ev->wd] : NULL;
+            if (ev->mask & IN_IGNORED) { // The watch is gone (directory removed)
+                if (dir) {
+                    dir->wd = -1;
+                    live.by_wd[ev->wd] = NULL;
+                }
+                continue;
+            }
+            if (!dir || ev->len == 0) {
+                continue;
+            }
+            live_apply_event(dir, ev->name, (ev->mask & (IN_CREATE | IN_MOVED_TO)) != 0, (ev->mask & IN_ISDIR) != 0);
+        }
+    }
+    return 0;
+}
+
+// Resolve the directory file handle of a fanotify event to a directory node below the root
+static struct live_dir *live_fanotify_dir(struct file_handle *handle) {
+    int fd = open_by_handle_at(live.mount_fd, handle, O_RDONLY | O_PATH | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL; // Already deleted
+    }
+    char link[64], path[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, path, sizeof(path) - 1);
+    close(fd);
+    if (len <= 0) {
+        return NULL;
+    }
+    path[len] = '\0';
+    size_t root_len = strlen(live.root_path);
+    int is_slash = strcmp(live.root_path, "/") == 0;
+    if (strncmp(path, live.root_path, root_len) != 0 || (path[root_len] != '\0' && path[root_len] != '/' && !is_slash)) {
+        return NULL; // Outside rootDir: the mark covers the whole file system
+    }
+    const char *rel = path + root_len;
+    while (*rel == '/') {
+        rel++;
+    }
+    return live_dir_lookup(rel, 0);
+}
+
+// Drain pending fanotify events
+static int live_read_fanotify(void) {
+    char buf[65536] __attribute__((aligned(8)));
+    ssize_t len;
+    while ((len = read(live.fanotify_fd, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata *meta = (struct fanotify_event_metadata *)buf;
+        for (; FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+            if (meta->mask & FAN_Q_OVERFLOW) {
+                return live_rebuild();
+            }
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(meta + 1);
+            if ((char *)fid >= (char *)meta + meta->event_len || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+            struct file_handle *handle = (struct file_handle *)fid->handle;
+            const char *name = (const char *)(handle->f_handle + handle->handle_bytes); // Name follows the handle
+            if (strcmp(name, ".") == 0 || name[0] == '\0') {
+                continue; // Event about the directory itself
+            }
+            struct live_dir *dir = live_fanotify_dir(handle);
+            if (dir) {
+                live_apply_event(dir, name, (meta->mask & (FAN_CREATE | FAN_MOVED_TO)) != 0, (meta->mask & FAN_ONDIR) != 0);
+            }
+        }
+    }
+    return 0;
+}
+
+// Set up the event source: fanotify when --watch allows it and the kernel/privileges do, inotify otherwise
+static int live_setup_events(void) {
+    if (strcmp(watch_backend, "inotify") != 0) {
+        int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR, AT_FDCWD, live.root_path) == 0) {
+            live.mount_fd = open(live.root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            // Resolving handles needs CAP_DAC_READ_SEARCH; check it on the root before relying on fanotify
+            struct {
+                struct file_handle fh;
+                unsigned char data[MAX_HANDLE_SZ];
+            } probe;
+            probe.fh.handle_bytes = MAX_HANDLE_SZ;
+            int mount_id;
+            int probe_fd = -1;
+            if (live.mount_fd >= 0 && name_to_handle_at(AT_FDCWD, live.root_path, &probe.fh, &mount_id, 0) == 0) {
+                probe_fd = open_by_handle_at(live.mount_fd, &probe.fh, O_RDONLY | O_PATH | O_CLOEXEC);
+            }
+            if (probe_fd >= 0) {
+                close(probe_fd);
+                live.fanotify_fd = fd;
+                printf("daemon: watching with fanotify\n");
+                return 0;
+            }
+            if (live.mount_fd >= 0) {
+                close(live.mount_fd);
+                live.mount_fd = -1;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (strcmp(watch_backend, "fanotify") == 0) {
+            perror("fanotify");
+            return -1;
+        }
+    }
+    live.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (live.inotify_fd < 0) {
+        perror("inotify_init1");
+        return -1;
+    }
+    printf("daemon: watching with inotify\n");
+    return 0;
+}
+
+// Answer one lookup: every file named name, then an empty line
+static int live_answer(int client, const char *name, const char *root) {
+    struct byte_buffer out = { 0 };
+    char rel[PATH_MAX], line[PATH_MAX * 2];
+    size_t value;
+    long hits = 0;
+    int failed = 0;
+    if (hash_map_get(&live.by_name, name, &value)) {
+        for (struct live_file *f = (struct live_file *)(uintptr_t)value; f && !failed; f = f->next_same) {
+            live_dir_path(f->dir, rel, sizeof(rel));
+            size_t root_len = strlen(root);
+            int need_slash = root_len > 0 && root[root_len - 1] != '/';
+            int n = snprintf(line, sizeof(line), "%s%s%s%s%s\n", root, need_slash ? "/" : "", rel, rel[0] ? "/" : "", f->name);
+            failed = byte_buffer_append(&out, line, (size_t)n) != 0;
+            if (max_results > 0 && ++hits >= max_results) {
+                break; // --first / --max-results apply per request
+            }
+        }
+    }
+    failed = failed || byte_buffer_append(&out, "\n", 1) != 0;
+    int rc = failed ? -1 : send_all(client, out.data, out.len);
+    free(out.data);
+    return rc;
+}
+
+// Apply pending file system events (run_line_server event handler)
+static int live_read_events(void) {
+    return live.fanotify_fd >= 0 ? live_read_fanotify() : live_read_inotify();
+}
+
+// Answer one request line (run_line_server line handler)
+static int live_handle_line(int client, char *line) {
+    return live_answer(client, line, rootDir);
+}
+
+// Function to run the live index daemon for root on a Unix socket
+int run_daemon(const char *socket_path, const char *root) {
+    if (!realpath(root, live.root_path)) {
+        perror("realpath");
+        return -1;
+    }
+    if (live_setup_events() != 0) {
+        return -1;
+    }
+    if (live_rebuild() != 0) {
+        fprintf(stderr, "daemon: failed to index %s\n", root);
+        return -1;
+    }
+    printf("daemon: indexed %zu files\n", live.file_count);
+
+    int event_fd = live.fanotify_fd >= 0 ? live.fanotify_fd : live.inotify_fd;
+    return run_line_server(socket_path, event_fd, live_read_events, live_handle_line);
+}
+
+// ---------------------------------------------------------------------------------------
+// Query server
+//
+// "--serve SOCKET" keeps the process resident and runs requests sent over a Unix socket. A request line holds the
+// positional arguments of one normal invocation, separated by spaces (or by tabs if the line contains a tab):
+//     rootDir filename                      search
+//     rootDir storageDir -cp|-mv filename   copy or move
+//     rootDir storageDir extension          archive
+// The reply is whatever that invocation would print, followed by a line "exit N" with its exit status.
+// Options given on the server's own command line apply to every request.
+//
+// Searches are answered from a result cache keyed on (canonical rootDir, filename) when possible. Cached paths are
+// re-checked with fstatat() relative to a directory fd the server keeps open for each root, so a hit costs one
+// stat per path instead of a walk. Entries expire after --cache-ttl seconds; moves drop the entry they used.
+// A complete result (every match, not just the first --max-results) also claims that no other file has the name, which
+// no stat of the cached paths can confirm: it is only trusted while rootDir's mtime is unchanged, so files created
+// directly below the root show up at once and files created deeper down within --cache-ttl. Misses are never cached.
+
+#define SERVER_MAX_ARGS 8 // Positional arguments accepted in one request
+
+// One cached search result
+struct search_cache_entry {
+    char *key; // Canonical root, '/', file name (names cannot contain '/', so keys are unambiguous); NULL if unused
+    int root_fd; // Open directory fd of the root (owned by search_cache_roots)
+    time_t created; // When the result was recorded
+    int complete; // The search ran to the end rather than stopping at a result limit
+    struct timespec root_mtime; // Modification time of the root when the search started
+    struct string_list rel_paths; // Matching files relative to the root
+};
+
+struct search_cache_entry *search_cache = NULL; // Ring of search_cache_size entries, allocated by run_server()
+size_t search_cache_next = 0; // Slot overwritten by the next insertion (oldest entry)
+struct hash_map search_cache_keys; // Key -> slot
+struct hash_map search_cache_roots; // Canonical root -> open directory fd
+struct string_list search_cache_root_names; // Owns the keys of search_cache_roots
+
+// Open (or reuse) the directory fd kept for a canonical root
+static int search_cache_root_fd(const char *canonical) {
+    size_t value;
+    if (hash_map_get(&search_cache_roots, canonical, &value)) {
+        return (int)value;
+    }
+    int fd = open(canonical, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (string_list_add(&search_cache_root_names, canonical) != 0 ||
+        hash_map_put(&search_cache_roots, search_cache_root_names.items[search_cache_root_names.count - 1], (size_t)fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Build the cache key for a root and file name. Returns a malloc'd key, or NULL.
+static char *search_cache_key(const char *root, const char *name, char *canonical) {
+    if (!realpath(root, canonical) || strchr(name, '/')) {
+        return NULL;
+    }
+    size_t len = strlen(canonical) + strlen(name) + 2;
+    char *key = malloc(len);
+    if (key) {
+        snprintf(key, len, "%s/%s", canonical, name);
+    }
+    return key;
+}
+
+// Drop the entry in a slot
+static void search_cache_clear_slot(size_t slot) {
+    struct search_cache_entry *entry = &search_cache[slot];
+    if (entry->key) {
+        hash_map_remove(&search_cache_keys, entry->key);
+        free(entry->key);
+        entry->key = NULL;
+    }
+    string_list_free(&entry->rel_paths);
+}
+
+// Function to forget the cached result for a root and file name (after a move)
+void search_cache_forget(const char *root, const char *name) {
+    char canonical[PATH_MAX];
+    char *key = search_cache ? search_cache_key(root, name, canonical) : NULL; // Only the query server has a cache
+    size_t slot;
+    if (key && hash_map_get(&search_cache_keys, key, &slot)) {
+        search_cache_clear_slot(slot);
+    }
+    free(key);
+}
+
+// Function to answer a search from the cache. Returns 1 with *rc set if it did, 0 on a miss.
+int search_cache_lookup(const char *root, const char *name, int *rc) {
+    char canonical[PATH_MAX];
+    char *key = search_cache ? search_cache_key(root, name, canonical) : NULL; // Only the query server has a cache
+    size_t slot;
+    if (!key || !hash_map_get(&search_cache_keys, key, &slot)) {
+        free(key);
+        return 0;
+    }
+    free(key);
+    struct search_cache_entry *entry = &search_cache[slot];
+    int usable = entry->rel_paths.count > 0 && time(NULL) - entry->created <= search_cache_ttl;
+    if (usable && !(max_results > 0 && (long)entry->rel_paths.count >= max_results)) {
+        // Every match is wanted: only a complete entry will do, and only while the root is unchanged
+        struct stat root_st;
+        usable = entry->complete && fstat(entry->root_fd, &root_st) == 0 &&
+                 root_st.st_mtim.tv_sec == entry->root_mtime.tv_sec && root_st.st_mtim.tv_nsec == entry->root_mtime.tv_nsec;
+    }
+    for (size_t i = 0; i < entry->rel_paths.count && usable; i++) { // Every cached file must still be there
+        struct stat st;
+        usable = fstatat(entry->root_fd, entry->rel_paths.items[i], &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode);
+    }
+    if (!usable) {
+        search_cache_clear_slot(slot);
+        return 0;
+    }
+
+    size_t root_len = strlen(root);
+    int need_slash = root_len > 0 && root[root_len - 1] != '/';
+    char path[PATH_MAX * 2];
+    *rc = 0;
+    for (size_t i = 0; i < entry->rel_paths.count && *rc == 0; i++) {
+        snprintf(path, sizeof(path), "%s%s%s", root, need_slash ? "/" : "", entry->rel_paths.items[i]);
+        *rc = process_found_file(path); // Same handling as a match found by walking
+    }
+    return 1;
+}
+
+struct string_list search_cache_recorded; // Matches recorded while search_cache_recording is set
+struct timespec search_cache_root_mtime; // Modification time of the root when the recorded search started
+
+// Function to remember a match of the running search
+void search_cache_record(const char *fpath) {
+    if (string_list_add(&search_cache_recorded, fpath) != 0) {
+        search_cache_recording = 0; // Out of memory: this search is simply not cached
+        string_list_free(&search_cache_recorded);
+    }
+}
+
+// Function to start recording the matches of a search below root for the cache
+void search_cache_begin(const char *root) {
+    string_list_free(&search_cache_recorded);
+    struct stat st;
+    search_cache_recording = search_cache != NULL && stat(root, &st) == 0; // Before the walk, so changes during it count
+    search_cache_root_mtime = search_cache_recording ? st.st_mtim : (struct timespec){ 0, 0 };
+}
+
+// Function to store the matches recorded since search_cache_begin() (rc is the search's result)
+void search_cache_end(const char *root, const char *name, int rc) {
+    search_cache_recording = 0;
+    char canonical[PATH_MAX];
+    char *key = NULL;
+    int root_fd = -1;
+    if (search_cache_recorded.count > 0 && (rc == 0 || rc == WALK_STOP)) { // Failed searches and misses are not cached
+        key = search_cache_key(root, name, canonical);
+        root_fd = key ? search_cache_root_fd(canonical) : -1;
+    }
+    if (key && root_fd >= 0) {
+        search_cache_forget(root, name); // Replace an older entry for the same key
+        size_t slot = search_cache_next;
+        search_cache_next = (search_cache_next + 1) % (size_t)search_cache_size;
+        search_cache_clear_slot(slot); // Evict the oldest entry
+        struct search_cache_entry *entry = &search_cache[slot];
+        size_t root_len = strlen(root);
+        int need_slash = root_len > 0 && root[root_len - 1] != '/';
+        int failed = 0;
+        for (size_t i = 0; i < search_cache_recorded.count && !failed; i++) {
+            const char *path = search_cache_recorded.items[i]; // Recorded as rootDir + '/' + relative path
+            failed = strlen(path) <= root_len + need_slash || string_list_add(&entry->rel_paths, path + root_len + need_slash) != 0;
+        }
+        entry->root_fd = root_fd;
+        entry->created = time(NULL);
+        entry->complete = rc == 0;
+        entry->root_mtime = search_cache_root_mtime;
+        if (!failed && hash_map_put(&search_cache_keys, key, slot) == 0) {
+            entry->key = key;
+            key = NULL;
+        } else {
+            string_list_free(&entry->rel_paths);
+        }
+    }
+    free(key);
+    string_list_free(&search_cache_recorded);
+}
+
+// Function to find enteredFileName below rootDir and hand every match to process_found_file()
+int search_file(void) {
+    int rc;
+    if (search_cache_lookup(rootDir, enteredFileName, &rc)) {
+        return rc; // Answered from the server's cache
+    }
+    search_cache_begin(rootDir);
+    if (index_path) {
+        rc = index_search(index_path, rootDir, enteredFileName); // Prints its own errors
+    } else {
+        rc = walk_tree(rootDir, search_and_process);
+        if (rc == -1) {
+            perror("walk_tree"); // Print an error message
+        }
+    }
+    search_cache_end(rootDir, enteredFileName, rc);
+    return rc;
+}
+
+// Run one request line with stdout and stderr sent to the client (run_line_server line handler)
+static int server_handle_line(int client, char *line) {
+    char *args[SERVER_MAX_ARGS + 2]; // argv[0], the positional arguments and the terminating NULL
+    int argc = 0;
+    const char *separators = strchr(line, '\t') ? "\t" : " ";
+    args[argc++] = "fileutil";
+    char *save = NULL;
+    for (char *field = strtok_r(line, separators, &save); field; field = strtok_r(NULL, separators, &save)) {
+        if (argc > SERVER_MAX_ARGS) {
+            argc = -1; // Too many arguments; run_command rejects it below
+            break;
+        }
+        args[argc++] = field;
+    }
+    if (argc == 1) {
+        return 0; // Empty line
+    }
+
+    // Reset the state a previous request left behind
+    free(found_file);
+    found_file = NULL;
+    match_count = 0;
+    storageDir = NULL;
+    operation = NULL;
+    extension = NULL;
+    walk_need_stat = 0;
+    walk_stat_filter = NULL;
+
+    // Send this request's output to the client
+    fflush(stdout);
+    fflush(stderr);
+    int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+    if (saved_out < 0 || saved_err < 0) {
+        if (saved_out >= 0) {
+            close(saved_out);
+        }
+        return -1;
+    }
+    dup2(client, STDOUT_FILENO);
+    dup2(client, STDERR_FILENO);
+
+    int status;
+    if (argc < 0) {
+        fprintf(stderr, "Invalid number of arguments\n");
+        status = 1;
+    } else {
+        args[argc] = NULL;
+        status = run_command(argc, args);
+        if (argc == 5 && strcmp(args[3], "-mv") == 0) {
+            search_cache_forget(args[1], args[4]); // The file is gone from where the cache saw it
+        }
+    }
+    printf("exit %d\n", status);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+    return 0;
+}
+
+// Function to run the query server on a Unix socket until SIGINT/SIGTERM
+int run_server(const char *socket_path) {
+    if (search_cache_size > 0) {
+        search_cache = calloc((size_t)search_cache_size, sizeof(*search_cache));
+        if (!search_cache) {
+            perror("calloc");
+            return -1;
+        }
+    }
+    printf("server: listening on %s\n", socket_path);
+    int rc = run_line_server(socket_path, -1, NULL, server_handle_line);
+
+    for (long i = 0; search_cache && i < search_cache_size; i++) {
+        search_cache_clear_slot((size_t)i);
+    }
+    for (size_t i = 0; i < search_cache_roots.cap; i++) {
+        if (search_cache_roots.slots[i].key) {
+            close((int)search_cache_roots.slots[i].value);
+        }
+    }
+    hash_map_free(&search_cache_keys);
+    hash_map_free(&search_cache_roots);
+    string_list_free(&search_cache_root_names);
+    free(search_cache);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Archive compression
+//
+// The tar writer hands its stream to an archive_writer, which compresses it with the codec chosen by --codec (or by
+// the archive name's suffix):
+//
+//   gzip  The stream is cut into blocks of --archive-block-size bytes that a pool of threads deflates at the same
+//         time, as pigz does. Every block is raw deflate data primed with the last 32 KiB of the block before it as
+//         a preset dictionary, so matches still reach back across block boundaries, and ends with a sync flush that
+//         leaves it on a byte boundary; only the last block ends the deflate stream. The blocks are written in order
+//         behind a single gzip header and their CRC-32s are folded together with crc32_combine() for the trailer,
+//         so the file is one ordinary gzip stream.
+//   zstd  One zstd stream with long-distance matching, split among zstd's own worker threads (needs HAVE_ZSTD).
+//   lz4   Every block becomes a self-contained lz4 frame, compressed by the same thread pool as gzip blocks; lz4
+//         decodes the concatenated frames as one stream (needs HAVE_LZ4).
+//   none  The plain tar stream.
+//
+// --archive-format bgzf writes gzip differently, in the BGZF layout used by bgzip/htslib: every block of at most
+// BGZF_BLOCK_DATA bytes is a complete gzip member of its own (no dictionary) whose "BC" extra field holds its
+// compressed size, so a reader can start decompressing at any block and hop from block to block without inflating
+// anything. After the data come the member index (see bgzf_write_index) and the standard empty end-of-file block.
+// gunzip and tar read the result as usual, since concatenated gzip members form one stream.
+//
+// Block boundaries never depend on the number of threads, the gzip header holds no time stamp and zstd runs with at
+// least one worker (its output is then the same for any worker count), so the same input always compresses to the
+// same bytes.
+
+#define ARCHIVE_WINDOW 32768 // Deflate window: the most of the previous block a gzip block can refer to
+#define ARCHIVE_LZ4_MAX_LEVEL 12 // Highest lz4hc level (LZ4HC_CLEVEL_MAX)
+#define BGZF_BLOCK_DATA 0xff00 // Uncompressed bytes per BGZF block: small enough that the block always fits 64 KiB
+#define BGZF_BLOCK_MAX 65536 // Largest BGZF block (its size field is 16 bits)
+#define BGZF_HEADER 18 // gzip header with the 6-byte BC extra subfield
+#define BGZF_LOCATOR 48 // Empty member that points at the index, just before the end-of-file block
+#define BGZF_INDEX_CHUNK 65000 // Index bytes carried by one empty member
+
+// End-of-file block that closes every BGZF file: an empty member
+static const unsigned char bgzf_eof[28] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0x1b, 0,
+                                            3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+enum archive_block_state { BLOCK_FREE, BLOCK_QUEUED, BLOCK_DONE, BLOCK_FAILED };
+
+// One block of the archive on its way from the tar writer through a compressor to the file
+struct archive_block {
+    unsigned char *in; // Uncompressed data (archive_block_size bytes)
+    size_t in_len; // Bytes of in used
+    unsigned char dict[ARCHIVE_WINDOW]; // Tail of the previous block (gzip)
+    size_t dict_len; // 0 for the first block
+    int last; // Ends the deflate stream (Z_FINISH instead of Z_SYNC_FLUSH)
+    unsigned char *out; // Compressed data
+    size_t out_len; // Bytes of out used
+    uLong crc; // CRC-32 of in (gzip)
+    int state; // enum archive_block_state, guarded by the writer's lock
+};
+
+// Compressor thread and its deflate stream, reused for every block it takes
+struct archive_compressor {
+    struct archive_writer *writer;
+    z_stream strm;
+    pthread_t thread;
+};
+
+// Open compressed archive. Blocks go round a ring of slots in sequence order: the writing thread fills one, queues
+// it and writes out finished blocks in order; a slot is only refilled after its previous block has been written.
+struct archive_writer {
+    int fd; // Archive file
+    int codec; // enum archive_codec
+    int level; // Compression level (the codec's default for -1)
+    size_t block_size; // Uncompressed bytes per block
+    size_t out_cap; // Room for one compressed block (0 for the none codec, which writes in as is)
+    struct archive_block *blocks; // Ring of nblocks slots
+    int nblocks;
+    long long filled; // Sequence number of the block being filled
+    long long queued; // Blocks handed to the compressors
+    long long claimed; // Blocks a compressor has started on
+    long long written; // Blocks written to fd
+    uLong crc; // CRC-32 of the blocks written so far (gzip)
+    uLong total; // Uncompressed bytes written so far, modulo 2^32 (the gzip trailer's ISIZE)
+    int failed; // Set after a compression or write error
+    int bgzf; // --archive-format bgzf: every block is a gzip member of its own
+    uint64_t out_bytes; // bgzf: bytes written to fd so far
+    uint64_t *block_offsets; // bgzf: file offset of every block written, to resolve the member index
+    size_t block_offsets_cap;
+    struct byte_buffer members; // bgzf: uncompressed offset (8 bytes), size (8 bytes) and name (NUL-terminated) of every tar member
+    struct archive_compressor *compressors; // Threads, or NULL when the writing thread compresses the blocks itself
+    int ncompressors;
+    z_stream strm; // Stream of the writing thread when there are no compressor threads (also sizes out_cap)
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd; // zstd compresses on its own worker threads
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_preferences_t lz4; // Frame settings shared by all lz4 blocks
+#endif
+    int shutdown; // Tells the compressors to exit once the queue is empty
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when a block is queued or on shutdown
+    pthread_cond_t done; // Signalled when a compressor has finished a block
+};
+
+// Function to pick the archive codec from the suffix of the archive's name
+int archive_codec_for_name(const char *name) {
+    static const struct { const char *suffix; int codec; } suffixes[] = {
+        { ".gz", CODEC_GZIP }, { ".tgz", CODEC_GZIP }, { ".zst", CODEC_ZSTD }, { ".tzst", CODEC_ZSTD },
+        { ".lz4", CODEC_LZ4 },
+    };
+    size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t suffix_len = strlen(suffixes[i].suffix);
+        if (len > suffix_len && strcmp(name + len - suffix_len, suffixes[i].suffix) == 0) {
+            return suffixes[i].codec;
+        }
+    }
+    return CODEC_GZIP; // a1.tar has always been gzip-compressed
+}
+
+// Little-endian fields of the gzip and BGZF formats
+static void put_le16(unsigned char *p, unsigned v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void put_le64(unsigned char *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+// Write the header of a BGZF member of block_len bytes in all whose extra field holds the BC subfield followed by
+// extra_len more bytes (which the caller fills in after the BGZF_HEADER bytes written here)
+static void bgzf_member_header(unsigned char *p, size_t block_len, size_t extra_len) {
+    static const unsigned char fixed[12] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff }; // FEXTRA set, no time stamp
+    memcpy(p, fixed, 10);
+    put_le16(p + 10, (unsigned)(6 + extra_len)); // XLEN
+    p[12] = 'B';
+    p[13] = 'C';
+    put_le16(p + 14, 2);
+    put_le16(p + 16, (unsigned)(block_len - 1)); // BSIZE: total block size minus one
+}
+
+// Compress one block with strm (gzip) or the writer's lz4 settings. Returns 0 or -1.
+static int archive_compress_block(struct archive_writer *w, z_stream *strm, struct archive_block *block) {
+    if (w->codec == CODEC_NONE) {
+        block->out_len = block->in_len; // Written from in as is
+        return 0;
+    }
+#ifdef HAVE_LZ4
+    if (w->codec == CODEC_LZ4) {
+        if (block->in_len == 0) {
+            block->out_len = 0; // No empty frame at the end
+            return 0;
+        }
+        LZ4F_preferences_t prefs = w->lz4;
+        prefs.frameInfo.contentSize = block->in_len; // Lets a reader size its buffer before decoding the frame
+        size_t n = LZ4F_compressFrame(block->out, w->out_cap, block->in, block->in_len, &prefs);
+        if (LZ4F_isError(n)) {
+            return -1;
+        }
+        block->out_len = n;
+        return 0;
+    }
+#endif
+    if (w->bgzf && block->in_len == 0) {
+        block->out_len = 0; // The end-of-file block follows the index instead
+        return 0;
+    }
+    if (deflateReset(strm) != Z_OK) {
+        return -1;
+    }
+    if (block->dict_len > 0 && deflateSetDictionary(strm, block->dict, (uInt)block->dict_len) != Z_OK) {
+        return -1;
+    }
+    size_t skip = w->bgzf ? BGZF_HEADER : 0; // A BGZF member's own header and trailer surround its data
+    size_t cap = w->bgzf ? w->out_cap - BGZF_HEADER - 8 : w->out_cap;
+    int flush = w->bgzf || block->last ? Z_FINISH : Z_SYNC_FLUSH;
+    strm->next_in = block->in;
+    strm->avail_in = (uInt)block->in_len;
+    strm->next_out = block->out + skip;
+    strm->avail_out = (uInt)cap;
+    int rc = deflate(strm, flush); // cap holds the whole block, so one call does
+    if (rc != (flush == Z_FINISH ? Z_STREAM_END : Z_OK) || strm->avail_in != 0) {
+        return -1;
+    }
+    block->out_len = skip + cap - strm->avail_out;
+    block->crc = crc32(0L, block->in, (uInt)block->in_len);
+    if (w->bgzf) {
+        bgzf_member_header(block->out, block->out_len + 8, 0);
+        put_le32(block->out + block->out_len, (uint32_t)block->crc);
+        put_le32(block->out + block->out_len + 4, (uint32_t)block->in_len);
+        block->out_len += 8;
+    }
+    return 0;
+}
+
+// Thread body: compress queued blocks in sequence order until the writer shuts down
+static void *archive_compressor_thread(void *arg) {
+    struct archive_compressor *compressor = arg;
+    struct archive_writer *w = compressor->writer;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->claimed == w->queued && !w->shutdown) {
+            pthread_cond_wait(&w->work, &w->lock);
+        }
+        if (w->claimed == w->queued) {
+            break; // Shut down and nothing left to do
+        }
+        struct archive_block *block = &w->blocks[w->claimed++ % w->nblocks];
+        pthread_mutex_unlock(&w->lock);
+        int rc = archive_compress_block(w, &compressor->strm, block);
+        pthread_mutex_lock(&w->lock);
+        block->state = rc == 0 ? BLOCK_DONE : BLOCK_FAILED;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Write len bytes to fd, retrying short writes. Returns 0 or -1 with errno set.
+static int archive_write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Write finished blocks to the file in order until the first upto blocks are out; with wait unset, stop at the
+// first block that is still being compressed instead. Returns 0 or -1 after printing an error.
+static int archive_drain(struct archive_writer *w, long long upto, int wait) {
+    while (w->written < upto && !w->failed) {
+        struct archive_block *block = &w->blocks[w->written % w->nblocks];
+        pthread_mutex_lock(&w->lock);
+        while (wait && block->state == BLOCK_QUEUED) {
+            pthread_cond_wait(&w->done, &w->lock);
+        }
+        int state = block->state;
+        pthread_mutex_unlock(&w->lock);
+        if (state == BLOCK_QUEUED) {
+            break; // Not finished yet; it is written on a later call
+        }
+        if (state == BLOCK_FAILED) {
+            fprintf(stderr, "Error compressing the tar file\n");
+            w->failed = 1;
+            break;
+        }
+        if (w->bgzf && block->out_len > 0) {
+            if (w->written == (long long)w->block_offsets_cap) {
+                size_t cap = w->block_offsets_cap ? 2 * w->block_offsets_cap : 1024;
+                uint64_t *offsets = realloc(w->block_offsets, cap * sizeof(*offsets));
+                if (!offsets) {
+                    fprintf(stderr, "Out of memory\n");
+                    w->failed = 1;
+                    break;
+                }
+                w->block_offsets = offsets;
+                w->block_offsets_cap = cap;
+            }
+            w->block_offsets[w->written] = w->out_bytes;
+        }
+        if (archive_write_all(w->fd, w->codec == CODEC_NONE ? block->in : block->out, block->out_len) != 0) {
+            perror("write");
+            w->failed = 1;
+            break;
+        }
+        w->out_bytes += block->out_len;
+        if (w->codec == CODEC_GZIP && !w->bgzf) {
+            w->crc = crc32_combine(w->crc, block->crc, (z_off_t)block->in_len);
+            w->total += (uLong)block->in_len;
+        }
+        block->state = BLOCK_FREE;
+        w->written++;
+    }
+    return w->failed ? -1 : 0;
+}
+
+#ifdef HAVE_ZSTD
+// Feed one block to the zstd stream and write whatever it has ready (everything when last is set)
+static int archive_zstd_block(struct archive_writer *w, struct archive_block *block, int last) {
+    ZSTD_inBuffer in = { block->in, block->in_len, 0 };
+    for (;;) {
+        ZSTD_outBuffer out = { block->out, w->out_cap, 0 };
+        size_t left = ZSTD_compressStream2(w->zstd, &out, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(left)) {
+            fprintf(stderr, "Error compressing the tar file: %s\n", ZSTD_getErrorName(left));
+            w->failed = 1;
+            return -1;
+        }
+        if (out.pos > 0 && archive_write_all(w->fd, block->out, out.pos) != 0) {
+            perror("write");
+            w->failed = 1;
+            return -1;
+        }
+        if (last ? left == 0 : in.pos == in.size) {
+            break; // With ZSTD_e_end, 0 means the frame is complete
+        }
+    }
+    block->in_len = 0;
+    return 0;
+}
+#endif
+
+// Hand the block being filled to the compressors (or compress it here) and start the next one in the following
+// slot, primed with the end of this one. Returns 0 or -1 after printing an error.
+static int archive_queue_block(struct archive_writer *w, int last) {
+    struct archive_block *block = &w->blocks[w->filled % w->nblocks];
+#ifdef HAVE_ZSTD
+    if (w->codec == CODEC_ZSTD) {
+        return archive_zstd_block(w, block, last); // zstd splits the stream among its own threads
+    }
+#endif
+    block->last = last;
+    if (w->ncompressors == 0) {
+        block->state = archive_compress_block(w, &w->strm, block) == 0 ? BLOCK_DONE : BLOCK_FAILED;
+        w->queued++;
+    } else {
+        pthread_mutex_lock(&w->lock);
+        block->state = BLOCK_QUEUED;
+        w->queued++;
+        pthread_cond_signal(&w->work);
+        pthread_mutex_unlock(&w->lock);
+    }
+    w->filled++;
+    if (last) {
+        return archive_drain(w, w->queued, 1);
+    }
+
+    // The next slot is free once the block that used it before has been written
+    if (archive_drain(w, w->filled - w->nblocks + 1, 1) != 0 || archive_drain(w, w->queued, 0) != 0) {
+        return -1;
+    }
+    struct archive_block *next = &w->blocks[w->filled % w->nblocks];
+    if (w->codec == CODEC_GZIP && !w->bgzf) {
+        next->dict_len = block->in_len < ARCHIVE_WINDOW ? block->in_len : ARCHIVE_WINDOW; // Still intact in its slot
+        memmove(next->dict, block->in + block->in_len - next->dict_len, next->dict_len);
+    }
+    next->in_len = 0;
+    return 0;
+}
+
+// Append len bytes to the archive. Returns 0 or -1 (after the first error every call fails).
+static int archive_write(struct archive_writer *w, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0 && !w->failed) {
+        struct archive_block *block = &w->blocks[w->filled % w->nblocks];
+        size_t n = w->block_size - block->in_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(block->in + block->in_len, p, n);
+        block->in_len += n;
+        p += n;
+        len -= n;
+        if (block->in_len == w->block_size && archive_queue_block(w, 0) != 0) {
+            return -1;
+        }
+    }
+    return w->failed ? -1 : 0;
+}
+
+// Stop the compressor threads and release everything but the file descriptor
+static void archive_free(struct archive_writer *w) {
+    if (w->ncompressors > 0) {
+        pthread_mutex_lock(&w->lock);
+        w->shutdown = 1;
+        pthread_cond_broadcast(&w->work);
+        pthread_mutex_unlock(&w->lock);
+        for (int i = 0; i < w->ncompressors; i++) {
+            pthread_join(w->compressors[i].thread, NULL);
+        }
+    }
+    for (int i = 0; w->compressors && i < w->ncompressors; i++) {
+        deflateEnd(&w->compressors[i].strm);
+    }
+    free(w->compressors);
+    for (int i = 0; w->blocks && i < w->nblocks; i++) {
+        free(w->blocks[i].in);
+        free(w->blocks[i].out);
+    }
+    free(w->blocks);
+    free(w->block_offsets);
+    free(w->members.data);
+    deflateEnd(&w->strm);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(w->zstd);
+#endif
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->done);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+// Raw deflate stream (the gzip framing is written by the writer itself)
+static int archive_deflate_init(z_stream *strm, int level) {
+    memset(strm, 0, sizeof(*strm));
+    return deflateInit2(strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+// Set up the codec: check the level, create its state and decide how much room a compressed block needs.
+// Returns 0, or -1 after printing an error.
+static int archive_codec_init(struct archive_writer *w, int nthreads) {
+    switch (w->codec) {
+    case CODEC_GZIP:
+        if (w->level < -1 || w->level > 9) {
+            fprintf(stderr, "Invalid gzip level: %d (0-9)\n", w->level);
+            return -1;
+        }
+        if (archive_deflate_init(&w->strm, w->level) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        w->out_cap = deflateBound(&w->strm, (uLong)w->block_size) + 16; // Plus the sync flush marker
+        if (w->bgzf) {
+            w->out_cap += BGZF_HEADER + 8; // Each block is a whole member
+            if (w->out_cap > BGZF_BLOCK_MAX) {
+                w->out_cap = BGZF_BLOCK_MAX; // deflateBound() is generous; stored blocks of BGZF_BLOCK_DATA bytes do fit
+            }
+        }
+        return 0;
+    case CODEC_ZSTD:
+#ifdef HAVE_ZSTD
+        if (w->level > ZSTD_maxCLevel()) {
+            fprintf(stderr, "Invalid zstd level: %d (1-%d)\n", w->level, ZSTD_maxCLevel());
+            return -1;
+        }
+        w->zstd = ZSTD_createCCtx();
+        if (!w->zstd) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_compressionLevel, w->level == -1 ? ZSTD_CLEVEL_DEFAULT : w->level);
+        ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_enableLongDistanceMatching, 1); // Repeats far apart, e.g. similar logs
+        ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_checksumFlag, 1);
+        ZSTD_CCtx_setParameter(w->zstd, ZSTD_c_nbWorkers, nthreads); // Ignored by a library built without threads
+        w->out_cap = ZSTD_CStreamOutSize();
+        return 0;
+#else
+        (void)nthreads;
+        fprintf(stderr, "zstd support was not compiled in (build with -DHAVE_ZSTD -lzstd)\n");
+        return -1;
+#endif
+    case CODEC_LZ4:
+#ifdef HAVE_LZ4
+        if (w->level > ARCHIVE_LZ4_MAX_LEVEL) {
+            fprintf(stderr, "Invalid lz4 level: %d (1-%d)\n", w->level, ARCHIVE_LZ4_MAX_LEVEL);
+            return -1;
+        }
+        memset(&w->lz4, 0, sizeof(w->lz4));
+        w->lz4.compressionLevel = w->level == -1 ? 0 : w->level; // Levels from 3 up use lz4hc
+        w->lz4.frameInfo.blockSizeID = LZ4F_max4MB;
+        w->lz4.frameInfo.blockMode = LZ4F_blockLinked;
+        w->lz4.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+        w->out_cap = LZ4F_compressFrameBound(w->block_size, &w->lz4);
+        return 0;
+#else
+        fprintf(stderr, "lz4 support was not compiled in (build with -DHAVE_LZ4 -llz4)\n");
+        return -1;
+#endif
+    default:
+        w->out_cap = 0; // Blocks are written from their input buffer
+        return 0;
+    }
+}
+
+// Set up a writer for codec with its buffers and threads, before any output file is touched (so a codec or level
+// that cannot be used leaves an existing archive alone). Returns NULL after printing an error.
+static struct archive_writer *archive_start(int codec) {
+    struct archive_writer *w = calloc(1, sizeof(*w));
+    if (!w) {
+        perror("calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    w->fd = -1;
+    w->codec = codec;
+    w->level = archive_level;
+    w->block_size = archive_block_size;
+    if (archive_format == FORMAT_BGZF && codec == CODEC_GZIP) {
+        w->bgzf = 1;
+        w->block_size = BGZF_BLOCK_DATA; // Fixed by the format, so that every block fits BGZF_BLOCK_MAX
+    }
+    int nthreads = archive_threads; // Thread count from --archive-threads
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN); // Default to one thread per online CPU
+        nthreads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (archive_codec_init(w, nthreads) != 0) {
+        archive_free(w);
+        return NULL;
+    }
+
+    // gzip and lz4 blocks are compressed by our own threads; zstd and none need a single slot
+    int pool = (codec == CODEC_GZIP || codec == CODEC_LZ4) && nthreads > 1;
+    w->nblocks = pool ? 2 * nthreads : 1; // Enough slots to keep every thread busy while blocks are written
+    w->blocks = calloc((size_t)w->nblocks, sizeof(*w->blocks));
+    int rc = w->blocks ? 0 : -1;
+    for (int i = 0; rc == 0 && i < w->nblocks; i++) {
+        w->blocks[i].in = malloc(w->block_size);
+        w->blocks[i].out = w->out_cap > 0 ? malloc(w->out_cap) : NULL;
+        rc = w->blocks[i].in && (w->out_cap == 0 || w->blocks[i].out) ? 0 : -1;
+    }
+    if (rc == 0 && pool) {
+        w->compressors = calloc((size_t)nthreads, sizeof(*w->compressors));
+        rc = w->compressors ? 0 : -1;
+        while (rc == 0 && w->ncompressors < nthreads) {
+            struct archive_compressor *compressor = &w->compressors[w->ncompressors];
+            compressor->writer = w;
+            if (codec == CODEC_GZIP && archive_deflate_init(&compressor->strm, w->level) != 0) {
+                rc = -1;
+                break;
+            }
+            if (pthread_create(&compressor->thread, NULL, archive_compressor_thread, compressor) != 0) {
+                deflateEnd(&compressor->strm); // Fewer threads than asked for; the ones running are enough
+                break;
+            }
+            w->ncompressors++;
+        }
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Out of memory\n");
+        archive_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// Direct the writer's output to fd, which it owns from then on (archive_close closes it), and write the gzip
+// header. Returns 0, or -1 after printing an error (fd is left to the caller then).
+static int archive_attach(struct archive_writer *w, int fd, const char *path) {
+    if (w->codec == CODEC_GZIP && !w->bgzf) {
+        // gzip header: deflate, no flags, no time stamp (deterministic output), no extra flags, OS Unix
+        static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+        w->crc = crc32(0L, Z_NULL, 0);
+        if (archive_write_all(fd, header, sizeof(header)) != 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    w->fd = fd;
+    return 0;
+}
+
+// Create path and start compressing into it with codec. Returns NULL after printing an error.
+static struct archive_writer *archive_open(const char *path, int codec) {
+    struct archive_writer *w = archive_start(codec);
+    if (!w) {
+        return NULL;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666); // Open the tar file for writing
+    if (fd < 0 || archive_attach(w, fd, path) != 0) {
+        if (fd < 0) {
+            perror(path); // Print an error message if opening the tar file fails
+        } else {
+            close(fd);
+        }
+        archive_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// Record that a tar member (its first header) starts at the current position of the stream, for the bgzf index.
+// Returns 0 or -1 after printing an error.
+static int archive_note_member(struct archive_writer *w, const char *name, uint64_t size) {
+    if (!w->bgzf) {
+        return 0;
+    }
+    unsigned char record[16];
+    put_le64(record, (uint64_t)w->filled * w->block_size + w->blocks[w->filled % w->nblocks].in_len); // All earlier blocks are full
+    put_le64(record + 8, size);
+    if (byte_buffer_append(&w->members, record, sizeof(record)) != 0 || byte_buffer_append(&w->members, name, strlen(name) + 1) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+// bgzf: write the member index after the last data block, then the end-of-file block. Every tar member is listed as
+// "<block offset> <offset in block> <size> <name>" followed by a NUL, where block offset is the file offset of the
+// BGZF block in which the member's first header starts and offset in block is where it starts within that block's
+// data. The list travels in the extra field ("FI" subfield) of empty gzip members, which gunzip passes over, and
+// the empty member just before the end-of-file block ("FL" subfield) holds the list's file offset and length, so a
+// reader finds it with one read at the end of the file. Returns 0 or -1 after printing an error.
+static int bgzf_write_index(struct archive_writer *w) {
+    static const unsigned char empty[10] = { 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 }; // Empty deflate data, CRC-32 and length 0
+    struct byte_buffer index;
+    memset(&index, 0, sizeof(index));
+    int rc = 0;
+    for (size_t at = 0; rc == 0 && at < w->members.len;) {
+        uint64_t offset = get_le(w->members.data + at, 8);
+        uint64_t size = get_le(w->members.data + at + 8, 8);
+        const char *name = (const char *)w->members.data + at + 16;
+        size_t name_len = strlen(name);
+        char numbers[80];
+        int n = snprintf(numbers, sizeof(numbers), "%llu %llu %llu ", (unsigned long long)w->block_offsets[offset / w->block_size],
+                         (unsigned long long)(offset % w->block_size), (unsigned long long)size);
+        rc = byte_buffer_append(&index, numbers, (size_t)n) != 0 || byte_buffer_append(&index, name, name_len + 1) != 0 ? -1 : 0;
+        at += 16 + name_len + 1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Out of memory\n");
+        free(index.data);
+        return -1;
+    }
+
+    uint64_t start = w->out_bytes; // The first index member follows the data
+    unsigned char member[BGZF_BLOCK_MAX];
+    for (size_t done = 0; rc == 0 && done < index.len;) {
+        size_t chunk = index.len - done < BGZF_INDEX_CHUNK ? index.len - done : BGZF_INDEX_CHUNK;
+        size_t len = BGZF_HEADER + 4 + chunk + sizeof(empty);
+        bgzf_member_header(member, len, 4 + chunk);
+        member[BGZF_HEADER] = 'F';
+        member[BGZF_HEADER + 1] = 'I';
+        put_le16(member + BGZF_HEADER + 2, (unsigned)chunk);
+        memcpy(member + BGZF_HEADER + 4, index.data + done, chunk);
+        memcpy(member + BGZF_HEADER + 4 + chunk, empty, sizeof(empty));
+        rc = archive_write_all(w->fd, member, len);
+        w->out_bytes += len;
+        done += chunk;
+    }
+    unsigned char locator[BGZF_LOCATOR];
+    bgzf_member_header(locator, sizeof(locator), 20);
+    locator[BGZF_HEADER] = 'F';
+    locator[BGZF_HEADER + 1] = 'L';
+    put_le16(locator + BGZF_HEADER + 2, 16);
+    put_le64(locator + BGZF_HEADER + 4, start);
+    put_le64(locator + BGZF_HEADER + 12, index.len);
+    memcpy(locator + BGZF_HEADER + 20, empty, sizeof(empty));
+    free(index.data);
+    if (rc != 0 || archive_write_all(w->fd, locator, sizeof(locator)) != 0 || archive_write_all(w->fd, bgzf_eof, sizeof(bgzf_eof)) != 0) {
+        perror("write");
+        return -1;
+    }
+    return 0;
+}
+
+// Compress the last block, write the gzip trailer (or the bgzf index) and close the file. Returns 0, or -1 if
+// anything failed.
+static int archive_close(struct archive_writer *w) {
+    int rc = w->failed ? -1 : archive_queue_block(w, 1);
+    if (rc == 0 && w->bgzf) {
+        rc = bgzf_write_index(w);
+    } else if (rc == 0 && w->codec == CODEC_GZIP) {
+        unsigned char trailer[8]; // CRC-32 and length, little-endian
+        for (int i = 0; i < 4; i++) {
+            trailer[i] = (unsigned char)(w->crc >> (8 * i));
+            trailer[4 + i] = (unsigned char)(w->total >> (8 * i));
+        }
+        if (archive_write_all(w->fd, trailer, sizeof(trailer)) != 0) {
+            perror("write");
+            rc = -1;
+        }
+    }
+    if (close(w->fd) != 0) {
+        perror("close");
+        rc = -1;
+    }
+    archive_free(w);
+    return rc;
+}
+
+// Function to compress the uncompressed tar archive at tar_path with each available codec at a few levels and print
+// the compression ratio and throughput of each. Every result is written to an unnamed temporary file next to
+// tar_path, so the figures include writing the output. Returns 0, or -1 after printing an error.
+int archive_benchmark(const char *tar_path) {
+    static const struct { int codec; int level; } runs[] = {
+        { CODEC_GZIP, 1 }, { CODEC_GZIP, 6 }, { CODEC_GZIP, 9 }, { CODEC_ZSTD, 1 }, { CODEC_ZSTD, 3 },
+        { CODEC_ZSTD, 9 }, { CODEC_LZ4, 1 }, { CODEC_LZ4, 9 }, { CODEC_NONE, -1 },
+    };
+    int in = open(tar_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0) {
+        perror(tar_path);
+        if (in >= 0) {
+            close(in);
+        }
+        return -1;
+    }
+    char dir[PATH_MAX]; // Directory of tar_path, for the temporary outputs
+    const char *slash = strrchr(tar_path, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", slash == tar_path ? 1 : (int)(slash - tar_path), tar_path);
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    char *buffer = malloc(1 << 20);
+    if (!buffer) {
+        perror("malloc");
+        close(in);
+        return -1;
+    }
+
+    printf("%-6s %5s %14s %8s %10s\n", "codec", "level", "bytes", "ratio", "MB/s");
+    printf("%-6s %5s %14lld %8s %10s\n", "input", "-", (long long)st.st_size, "1.00", "-");
+    int saved_level = archive_level;
+    int saved_format = archive_format;
+    archive_format = FORMAT_STREAM; // Codecs are compared on their plain streams
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < sizeof(runs) / sizeof(runs[0]); i++) {
+#ifndef HAVE_ZSTD
+        if (runs[i].codec == CODEC_ZSTD) {
+            continue; // Not compiled in
+        }
+#endif
+#ifndef HAVE_LZ4
+        if (runs[i].codec == CODEC_LZ4) {
+            continue;
+        }
+#endif
+        int out = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600); // Gone when closed
+        int sized = out >= 0 ? dup(out) : -1; // Kept to read the compressed size after the writer closed out
+        if (out < 0 || sized < 0) {
+            perror(dir);
+            if (out >= 0) {
+                close(out);
+            }
+            rc = -1;
+            break;
+        }
+        archive_level = runs[i].level;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        struct archive_writer *w = archive_start(runs[i].codec);
+        if (w && archive_attach(w, out, dir) != 0) {
+            archive_free(w);
+            w = NULL;
+        }
+        if (!w) {
+            close(out);
+        }
+        rc = w ? 0 : -1;
+        for (off_t offset = 0; rc == 0 && offset < st.st_size;) {
+            ssize_t n = pread(in, buffer, 1 << 20, offset);
+            if (n <= 0) {
+                perror(tar_path);
+                rc = -1;
+            } else {
+                rc = archive_write(w, buffer, (size_t)n);
+                offset += n;
+            }
+        }
+        if (w && archive_close(w) != 0) {
+            rc = -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        struct stat result;
+        if (rc == 0 && fstat(sized, &result) == 0) {
+            double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+            char level[8];
+            snprintf(level, sizeof(level), runs[i].codec == CODEC_NONE ? "-" : "%d", runs[i].level);
+            printf("%-6s %5s %14lld %8.2f %10.1f\n", archive_codec_names[runs[i].codec], level,
+                   (long long)result.st_size, result.st_size > 0 ? (double)st.st_size / (double)result.st_size : 0.0,
+                   seconds > 0 ? (double)st.st_size / 1e6 / seconds : 0.0);
+        }
+        close(sized);
+    }
+    archive_level = saved_level;
+    archive_format = saved_format;
+    free(buffer);
+    close(in);
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Tar archive writer
+//
+// The tar mode opens storageDir/a1.tar once (tar_open_archive), streams every matching file into it as a POSIX
+// ustar member and finishes it with the two zero blocks that mark the end of an archive (tar_close_archive). The
+// archive is compressed by the archive writer above (gzip by default, like the original a1.tar). Fields that do not fit a ustar header (names longer than
+// 255 bytes or without a usable '/' split, sizes of 8 GiB and more, large ids, negative times) are stored in a PAX
+// extended header ('x' member) that precedes the file, so GNU tar, bsdtar and Python's tarfile all read them.
+
+#define TAR_BLOCK 512 // Tar archives are made of 512-byte blocks
+
+// ustar header block
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+// Write value as a NUL-terminated octal field of len bytes. Returns 0, or -1 if it does not fit.
+static int tar_octal(char *field, size_t len, uint64_t value) {
+    char digits[32];
+    int n = snprintf(digits, sizeof(digits), "%0*llo", (int)len - 1, (unsigned long long)value);
+    if (n < 0 || (size_t)n > len - 1) {
+        return -1;
+    }
+    memcpy(field, digits, len); // len - 1 digits and the terminating NUL
+    return 0;
+}
+
+// Append one "length key=value\n" record to a PAX header. The length counts the whole record, itself included.
+static int tar_pax_record(struct byte_buffer *pax, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3; // Space, '=' and newline
+    size_t total = body + 1;
+    while (total != body + (size_t)snprintf(NULL, 0, "%zu", total)) {
+        total = body + (size_t)snprintf(NULL, 0, "%zu", total); // Settles within two rounds
+    }
+    char *record = malloc(total + 1);
+    if (!record) {
+        return -1;
+    }
+    snprintf(record, total + 1, "%zu %s=%s\n", total, key, value);
+    int rc = byte_buffer_append(pax, record, total);
+    free(record);
+    return rc;
+}
+
+// Fill the checksum field: the sum of all header bytes with the checksum field counted as spaces
+static void tar_checksum(struct tar_header *header) {
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    unsigned sum = 0;
+    const unsigned char *bytes = (const unsigned char *)header;
+    for (size_t i = 0; i < sizeof(*header); i++) {
+        sum += bytes[i];
+    }
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum); // Six digits, NUL, then the space left in place
+}
+
+// Write the zeros that fill the last block of len bytes of member data. Returns 0 or -1.
+static int tar_pad(struct archive_writer *out, uint64_t len) {
+    static const char zeros[TAR_BLOCK];
+    size_t pad = (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK;
+    return archive_write(out, zeros, pad);
+}
+
+// Write data followed by zeros up to the next block boundary. Returns 0 or -1.
+static int tar_write_padded(struct archive_writer *out, const void *data, size_t len) {
+    if (archive_write(out, data, len) != 0) {
+        return -1;
+    }
+    return tar_pad(out, len);
+}
+
+// User and group names for the header, looked up once per id
+static void tar_owner_names(uid_t uid, gid_t gid, char *uname, char *gname) {
+    static uid_t cached_uid = (uid_t)-1;
+    static gid_t cached_gid = (gid_t)-1;
+    static char cached_uname[32], cached_gname[32];
+    if (uid != cached_uid) {
+        struct passwd *pw = getpwuid(uid);
+        snprintf(cached_uname, sizeof(cached_uname), "%s", pw ? pw->pw_name : "");
+        cached_uid = uid;
+    }
+    if (gid != cached_gid) {
+        struct group *gr = getgrgid(gid);
+        snprintf(cached_gname, sizeof(cached_gname), "%s", gr ? gr->gr_name : "");
+        cached_gid = gid;
+    }
+    memcpy(uname, cached_uname, 32);
+    memcpy(gname, cached_gname, 32);
+}
+
+// Function to open the archive for the tar mode
+struct archive_writer *tar_open_archive(const char *path, int codec) {
+    return archive_open(path, codec); // Prints its own errors
+}
+
+// Function to finish the archive: end-of-archive marker, then flush and close the gzip stream
+int tar_close_archive(struct archive_writer *out) {
+    static const char end[TAR_BLOCK * 2]; // Two zero blocks end a tar archive
+    int rc = archive_write(out, end, sizeof(end));
+    if (archive_close(out) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error writing to tar file\n");
+    }
+    return rc;
+}
+
+// Function to add a file to the tar file
+int add_file_to_tar(const char *fpath, const char *name, const struct stat *sb, struct archive_writer *tarfile) {
+    int fd = open(fpath, O_RDONLY | O_CLOEXEC | O_NOFOLLOW); // Open the file for reading
+    if (fd < 0) {
+        perror(fpath); // Unreadable files are reported and left out, as tar does
+        return 0;
+    }
+    struct stat st;
+    if (!sb || sb->st_mode == 0) { // Metadata not fetched by the walker (index search or nftw without it)
+        if (fstat(fd, &st) != 0) {
+            perror(fpath);
+            close(fd);
+            return 0;
+        }
+        sb = &st;
+    }
+
+    // Header fields; what ustar cannot hold goes into PAX records
+    struct tar_header header;
+    memset(&header, 0, sizeof(header));
+    struct byte_buffer pax;
+    memset(&pax, 0, sizeof(pax));
+    char number[32];
+    int rc = 0;
+    size_t name_len = strlen(name);
+    if (name_len <= sizeof(header.name)) {
+        memcpy(header.name, name, name_len); // Fits as is (a 100-byte name needs no terminator)
+    } else {
+        // Split at a '/' so that the directory part goes into prefix (at most 155 bytes) and the rest into name
+        const char *split = NULL;
+        for (const char *p = name + name_len - sizeof(header.name) - 1; p < name + name_len; p++) {
+            if (p >= name && *p == '/' && (size_t)(p - name) <= sizeof(header.prefix)) {
+                split = p;
+                break;
+            }
+        }
+        if (split && split > name) {
+            memcpy(header.prefix, name, (size_t)(split - name));
+            memcpy(header.name, split + 1, name_len - (size_t)(split - name) - 1);
+        } else {
+            rc |= tar_pax_record(&pax, "path", name); // Too long for ustar: the full name is in the PAX header
+            memcpy(header.name, name + name_len - (sizeof(header.name) - 1), sizeof(header.name) - 1); // Fallback for old readers
+        }
+    }
+    tar_octal(header.mode, sizeof(header.mode), sb->st_mode & 07777);
+    if (tar_octal(header.uid, sizeof(header.uid), sb->st_uid) != 0) {
+        snprintf(number, sizeof(number), "%llu", (unsigned long long)sb->st_uid);
+        rc |= tar_pax_record(&pax, "uid", number);
+        tar_octal(header.uid, sizeof(header.uid), 0);
+    }
+    if (tar_octal(header.gid, sizeof(header.gid), sb->st_gid) != 0) {
+        snprintf(number, sizeof(number), "%llu", (unsigned long long)sb->st_gid);
+        rc |= tar_pax_record(&pax, "gid", number);
+        tar_octal(header.gid, sizeof(header.gid), 0);
+    }
+    if (tar_octal(header.size, sizeof(header.size), (uint64_t)sb->st_size) != 0) {
+        snprintf(number, sizeof(number), "%lld", (long long)sb->st_size); // 8 GiB or more
+        rc |= tar_pax_record(&pax, "size", number);
+        tar_octal(header.size, sizeof(header.size), 0);
+    }
+    if (sb->st_mtim.tv_sec < 0 || tar_octal(header.mtime, sizeof(header.mtime), (uint64_t)sb->st_mtim.tv_sec) != 0) {
+        snprintf(number, sizeof(number), "%lld", (long long)sb->st_mtim.tv_sec);
+        rc |= tar_pax_record(&pax, "mtime", number);
+        tar_octal(header.mtime, sizeof(header.mtime), 0);
+    }
+    header.typeflag = '0'; // Regular file
+    memcpy(header.magic, "ustar", 6); // POSIX ustar: "ustar\0" followed by version "00"
+    memcpy(header.version, "00", 2);
+    tar_owner_names(sb->st_uid, sb->st_gid, header.uname, header.gname);
+    tar_checksum(&header);
+    if (rc != 0) {
+        fprintf(stderr, "Out of memory\n");
+        free(pax.data);
+        close(fd);
+        return -1;
+    }
+
+    if (archive_note_member(tarfile, name, (uint64_t)sb->st_size) != 0) { // Listed in the index of a bgzf archive
+        free(pax.data);
+        close(fd);
+        return -1;
+    }
+    if (pax.len > 0) { // Extended header member for this file
+        struct tar_header xheader = header;
+        memset(xheader.name, 0, sizeof(xheader.name));
+        memset(xheader.prefix, 0, sizeof(xheader.prefix));
+        snprintf(xheader.name, sizeof(xheader.name), "PaxHeaders/%.80s", name + name_len - (name_len < 80 ? name_len : 80));
+        tar_octal(xheader.size, sizeof(xheader.size), pax.len);
+        xheader.typeflag = 'x';
+        tar_checksum(&xheader);
+        rc = tar_write_padded(tarfile, &xheader, sizeof(xheader)) != 0 || tar_write_padded(tarfile, pax.data, pax.len) != 0 ? -1 : 0;
+    }
+    free(pax.data);
+    if (rc == 0 && archive_write(tarfile, &header, sizeof(header)) != 0) {
+        rc = -1;
+    }
+
+    // Exactly st_size bytes of data: a file that shrank meanwhile is padded with zeros, one that grew is cut off
+    char buffer[1 << 16]; // Buffer to store data read from the file
+    off_t left = sb->st_size;
+    while (rc == 0 && left > 0) {
+        ssize_t n = read(fd, buffer, left < (off_t)sizeof(buffer) ? (size_t)left : sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "%s: file shrank while being archived\n", fpath);
+            memset(buffer, 0, sizeof(buffer));
+            n = left < (off_t)sizeof(buffer) ? left : (off_t)sizeof(buffer);
+        }
+        if (archive_write(tarfile, buffer, (size_t)n) != 0) {
+            rc = -1;
+        }
+        left -= n;
+    }
+    if (rc == 0 && tar_pad(tarfile, (uint64_t)sb->st_size) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error writing to tar file\n"); // Print an error message if writing to the tar file fails
+    }
+    close(fd); // Close the file
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Tar archive reader
+//
+// --extract ARCHIVE storageDir [NAME] unpacks an archive written by the tar mode, or any ustar/PAX archive
+// compressed with a codec this build has. The format is recognized from the first bytes of the file.
+//
+// bgzf archives are inflated block by block. Given a NAME, the member index at the end of the file gives the BGZF
+// block and the offset within it at which each matching member starts, so only the blocks that hold it are read.
+// Unpacking everything, --archive-threads threads inflate the blocks ahead of the tar parser (the compressor ring in
+// reverse) and every directory named in the index is created before the first file. lz4 archives go through the
+// same threads one frame at a time: the tar mode writes an independent frame per block, and the parser finds where
+// each frame ends from its block headers without decoding it. gzip and zstd archives are decompressed by the parsing
+// thread, since the end of a gzip member or zstd frame is only known once it has been decompressed.
+//
+// File data goes to a pool of writer threads. The parser creates each file (fallocate()d when it is large) and
+// queues its data in chunks of up to EXTRACT_CHUNK bytes; whichever thread finishes the last chunk sets the file's
+// mode and mtime and closes it. Data in uncompressed archives is never read by the parser: the writers copy it
+// straight out of the archive with copy_file_range(), which filesystems can turn into shared extents or
+// server-side copies.
+
+#define ARCHIVE_READ_BUFFER (1 << 18) // Compressed input read at a time, and decompressed output produced at a time, for stream archives
+#define EXTRACT_CHUNK (1 << 20) // Most file data carried by one writer job
+
+enum archive_read_format { READ_BGZF, READ_GZIP, READ_ZSTD, READ_LZ4, READ_NONE };
+
+// One BGZF block or lz4 frame in the inflate pool
+struct inflate_slot {
+    unsigned char *in; // Compressed block or frame: in_len bytes of in_cap, grown by the parser
+    size_t in_len, in_cap;
+    off_t offset; // Its file offset, for error messages
+    unsigned char *out; // Decompressed data: out_len bytes of out_cap, grown by the thread that decompresses it
+    size_t out_cap;
+    long out_len;
+    size_t out_size; // lz4: size of the frame's content (from its header, or an upper bound from its block count)
+    int state; // enum archive_block_state, guarded by the pool's lock
+};
+
+// Inflater thread and its decompressor
+struct inflate_worker {
+    struct inflate_pool *pool;
+    z_stream strm; // bgzf
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz4; // lz4
+#endif
+    pthread_t thread;
+};
+
+// Threads inflating BGZF blocks ahead of the parser. Slots are used in sequence order: the parser reads each block
+// into the next free slot and queues it, then takes the inflated data from the slots in the same order.
+struct inflate_pool {
+    int format; // READ_BGZF or READ_LZ4
+    struct inflate_slot *slots;
+    int nslots;
+    long long queued; // Blocks read and queued
+    long long claimed; // Blocks an inflater has started on
+    long long released; // Blocks the parser is done with (their slots can be refilled)
+    int holding; // The parser is reading the data of slot released
+    int eof; // Every block of the file has been queued
+    struct inflate_worker *workers;
+    int nworkers;
+    int shutdown; // Tells the inflaters to exit once the queue is empty
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when a block is queued or on shutdown
+    pthread_cond_t done; // Signalled when a block has been inflated
+};
+
+// Sequential reader of the uncompressed tar stream of an archive
+struct archive_reader {
+    int fd;
+    int format; // enum archive_read_format
+    off_t next; // File offset of the next compressed input (for bgzf, of the next block)
+    unsigned char *in; // Compressed input: in_len bytes, of which in_pos have been consumed
+    size_t in_pos, in_len;
+    int in_frame; // A gzip/zstd/lz4 frame has started but not ended (so the file must not end here)
+    unsigned char *data; // Uncompressed data: len bytes, of which pos have been consumed
+    size_t pos, len;
+    unsigned char *buffer; // Where data is decompressed, unless the inflate pool provides it
+    z_stream strm;
+    int strm_ready;
+    struct inflate_pool *pool; // bgzf only; NULL: blocks are inflated by the parsing thread
+    int failed; // Reading failed: the stream cannot be parsed any further
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx *lz4;
+#endif
+};
+
+// Tar member as described by its headers
+struct tar_member {
+    char name[PATH_MAX]; // Path inside the archive (from the PAX header when there is one)
+    uint64_t size; // Bytes of data
+    mode_t mode; // Permission bits
+    long long mtime; // Modification time in seconds
+    char typeflag; // '0' (or NUL) for regular files, '5' for directories
+};
+
+// File being written by the writer pool
+struct extract_file {
+    int fd;
+    mode_t mode;
+    long long mtime;
+    atomic_int pending; // Jobs not finished yet, plus one while the parser is still queuing
+    atomic_int failed; // A write failed: the file is closed without setting its mode and mtime
+    struct extract_file *next; // In the pool's open_files
+    char path[]; // For messages, and to find a later member with the same path
+};
+
+// One chunk of file data for the writer pool
+struct extract_job {
+    struct extract_file *file;
+    off_t offset; // Where the data goes in the file
+    size_t len;
+    int copy; // Copy the data from the archive at src_offset (uncompressed archives) instead of writing buffer
+    off_t src_offset;
+    unsigned char *buffer; // EXTRACT_CHUNK bytes, owned by the slot
+    int state; // BLOCK_FREE or BLOCK_QUEUED, guarded by the pool's lock
+};
+
+// Writer threads. Jobs go round a ring of slots like the compressor's blocks; with no threads the parser runs
+// every job itself as soon as it is queued.
+struct extract_pool {
+    int archive_fd; // Source of copy jobs
+    struct extract_job *jobs;
+    int njobs;
+    long long queued; // Jobs handed to the writers
+    long long claimed; // Jobs a writer has started on
+    pthread_t *threads;
+    int nthreads;
+    int shutdown; // Tells the writers to exit once the queue is empty
+    atomic_int failed; // Some file could not be written
+    struct extract_file *open_files; // Files not closed yet, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when a job is queued or on shutdown
+    pthread_cond_t done; // Signalled when a job or a file has finished
+};
+
+// Find the extra subfield si1 si2 in the gzip member header at buf (avail bytes readable). Returns its data and
+// sets *len, or NULL if the header has no such subfield.
+static const unsigned char *gzip_subfield(const unsigned char *buf, size_t avail, char si1, char si2, size_t *len) {
+    if (avail < 12 || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8 || !(buf[3] & 4)) {
+        return NULL; // Not a gzip member with an extra field
+    }
+    size_t end = 12 + (size_t)get_le(buf + 10, 2);
+    if (end > avail) {
+        return NULL;
+    }
+    for (size_t at = 12; at + 4 <= end;) {
+        size_t sublen = (size_t)get_le(buf + at + 2, 2);
+        if (at + 4 + sublen > end) {
+            break;
+        }
+        if (buf[at] == si1 && buf[at + 1] == si2) {
+            *len = sublen;
+            return buf + at + 4;
+        }
+        at += 4 + sublen;
+    }
+    return NULL;
+}
+
+// Total size of the BGZF block at buf (avail bytes readable), or 0 if it is not one
+static size_t bgzf_block_size(const unsigned char *buf, size_t avail) {
+    size_t len;
+    const unsigned char *bc = gzip_subfield(buf, avail, 'B', 'C', &len);
+    return bc && len == 2 ? (size_t)get_le(bc, 2) + 1 : 0;
+}
+
+// Inflate the BGZF block of len bytes at block into out (BGZF_BLOCK_MAX bytes) and check its CRC-32 and length.
+// Returns the number of uncompressed bytes, or -1 if the block is damaged.
+static long bgzf_inflate_block(z_stream *strm, const unsigned char *block, size_t len, unsigned char *out) {
+    size_t start = 12 + (size_t)get_le(block + 10, 2);
+    if (len < start + 8 || inflateReset(strm) != Z_OK) {
+        return -1;
+    }
+    strm->next_in = (unsigned char *)block + start;
+    strm->avail_in = (uInt)(len - start - 8);
+    strm->next_out = out;
+    strm->avail_out = BGZF_BLOCK_MAX;
+    if (inflate(strm, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    size_t n = BGZF_BLOCK_MAX - strm->avail_out;
+    if (crc32(0L, out, (uInt)n) != get_le(block + len - 8, 4) || n != get_le(block + len - 4, 4)) {
+        return -1;
+    }
+    return (long)n;
+}
+
+// Decompress the block or frame in slot (on an inflater thread). Returns the bytes produced, or -1 if it is damaged.
+static long inflate_slot_run(struct inflate_worker *worker, struct inflate_slot *slot) {
+    size_t need = worker->pool->format == READ_BGZF ? BGZF_BLOCK_MAX : slot->out_size;
+    if (slot->out_cap < need || !slot->out) {
+        unsigned char *grown = realloc(slot->out, need ? need : 1);
+        if (!grown) {
+            return -1;
+        }
+        slot->out = grown;
+        slot->out_cap = need;
+    }
+    if (worker->pool->format == READ_BGZF) {
+        return bgzf_inflate_block(&worker->strm, slot->in, slot->in_len, slot->out);
+    }
+#ifdef HAVE_LZ4
+    size_t out_len = slot->out_cap, in_len = slot->in_len;
+    size_t rc = LZ4F_decompress(worker->lz4, slot->out, &out_len, slot->in, &in_len, NULL);
+    if (LZ4F_isError(rc) || rc != 0 || in_len != slot->in_len) { // rc is 0 once the whole frame has been decoded
+        LZ4F_resetDecompressionContext(worker->lz4); // Ready for the next frame
+        return -1;
+    }
+    return (long)out_len;
+#else
+    return -1;
+#endif
+}
+
+// Thread body: decompress queued slots in sequence order until the pool shuts down
+static void *inflate_thread(void *arg) {
+    struct inflate_worker *worker = arg;
+    struct inflate_pool *pool = worker->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->claimed == pool->queued && !pool->shutdown) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->claimed == pool->queued) {
+            break; // Shut down and nothing left to do
+        }
+        struct inflate_slot *slot = &pool->slots[pool->claimed++ % pool->nslots];
+        pthread_mutex_unlock(&pool->lock);
+        long len = inflate_slot_run(worker, slot);
+        pthread_mutex_lock(&pool->lock);
+        slot->out_len = len;
+        slot->state = len >= 0 ? BLOCK_DONE : BLOCK_FAILED;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Stop the inflaters and release the pool
+static void inflate_pool_free(struct inflate_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        inflateEnd(&pool->workers[i].strm);
+#ifdef HAVE_LZ4
+        LZ4F_freeDecompressionContext(pool->workers[i].lz4);
+#endif
+    }
+    for (int i = 0; pool->slots && i < pool->nslots; i++) {
+        free(pool->slots[i].in);
+        free(pool->slots[i].out);
+    }
+    free(pool->workers);
+    free(pool->slots);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+// Start nthreads inflaters for format (READ_BGZF or READ_LZ4). Returns NULL if none could be started (the parser
+// then decompresses the archive itself).
+static struct inflate_pool *inflate_pool_start(int format, int nthreads) {
+    struct inflate_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->format = format;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->nslots = 2 * nthreads; // Enough blocks in flight to keep every thread busy while the parser reads one
+    pool->slots = calloc((size_t)pool->nslots, sizeof(*pool->slots));
+    pool->workers = calloc((size_t)nthreads, sizeof(*pool->workers));
+    while (pool->slots && pool->workers && pool->nworkers < nthreads) {
+        struct inflate_worker *worker = &pool->workers[pool->nworkers];
+        worker->pool = pool;
+        if (inflateInit2(&worker->strm, -15) != Z_OK) {
+            break;
+        }
+#ifdef HAVE_LZ4
+        if (format == READ_LZ4 && LZ4F_isError(LZ4F_createDecompressionContext(&worker->lz4, LZ4F_VERSION))) {
+            inflateEnd(&worker->strm);
+            break;
+        }
+#endif
+        if (pthread_create(&worker->thread, NULL, inflate_thread, worker) != 0) {
+            inflateEnd(&worker->strm);
+#ifdef HAVE_LZ4
+            LZ4F_freeDecompressionContext(worker->lz4);
+#endif
+            break;
+        }
+        pool->nworkers++;
+    }
+    if (pool->nworkers == 0) {
+        inflate_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Append len bytes of the archive, read at the end of what slot holds so far, to slot->in. Returns 0, or -1 after
+// printing an error.
+static int inflate_slot_append(struct archive_reader *r, struct inflate_slot *slot, size_t len) {
+    if (slot->in_len + len > slot->in_cap) {
+        size_t cap = slot->in_cap ? slot->in_cap : BGZF_BLOCK_MAX;
+        while (cap < slot->in_len + len) {
+            cap *= 2;
+        }
+        unsigned char *grown = realloc(slot->in, cap);
+        if (!grown) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        slot->in = grown;
+        slot->in_cap = cap;
+    }
+    while (len > 0) {
+        ssize_t n = pread(r->fd, slot->in + slot->in_len, len, r->next + (off_t)slot->in_len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                perror("pread");
+            } else {
+                fprintf(stderr, "Archive is truncated\n");
+            }
+            return -1;
+        }
+        slot->in_len += (size_t)n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Read the lz4 frame at r->next into slot, following its block headers to its end (nothing is decoded here). Sets
+// slot->out_size. Returns 1, 0 at the end of the file, or -1 after printing an error.
+static int lz4_read_frame(struct archive_reader *r, struct inflate_slot *slot) {
+    unsigned char magic[4];
+    ssize_t n = pread(r->fd, magic, sizeof(magic), r->next);
+    if (n <= 0) {
+        if (n < 0) {
+            perror("pread");
+        }
+        return n < 0 ? -1 : 0;
+    }
+    if (inflate_slot_append(r, slot, sizeof(magic)) != 0) {
+        return -1;
+    }
+    uint64_t tag = get_le(slot->in, 4);
+    if ((tag & 0xFFFFFFF0) == 0x184D2A50) { // Skippable frame: its length follows, and it decodes to nothing
+        if (inflate_slot_append(r, slot, 4) != 0 || inflate_slot_append(r, slot, (size_t)get_le(slot->in + 4, 4)) != 0) {
+            return -1;
+        }
+        slot->out_size = 0;
+        return 1;
+    }
+    if (tag != 0x184D2204 || inflate_slot_append(r, slot, 2) != 0) {
+        fprintf(stderr, "Damaged lz4 frame at offset %lld\n", (long long)r->next);
+        return -1;
+    }
+    unsigned flags = slot->in[4], block_id = (slot->in[5] >> 4) & 7;
+    if ((flags >> 6) != 1 || block_id < 4) {
+        fprintf(stderr, "Damaged lz4 frame at offset %lld\n", (long long)r->next);
+        return -1;
+    }
+    size_t header_rest = (flags & 0x08 ? 8 : 0) + (flags & 0x01 ? 4 : 0) + 1; // Content size, dictionary id, header checksum
+    if (inflate_slot_append(r, slot, header_rest) != 0) {
+        return -1;
+    }
+    uint64_t content_size = flags & 0x08 ? get_le(slot->in + 6, 8) : UINT64_MAX;
+    size_t block_max = (size_t)1 << (8 + 2 * block_id); // 64 KiB to 4 MiB
+    uint64_t blocks = 0;
+    for (;;) {
+        if (inflate_slot_append(r, slot, 4) != 0) {
+            return -1;
+        }
+        size_t size = (size_t)(get_le(slot->in + slot->in_len - 4, 4) & 0x7FFFFFFF); // The top bit marks a stored block
+        if (size == 0) {
+            break; // End mark
+        }
+        if (size > block_max) {
+            fprintf(stderr, "Damaged lz4 frame at offset %lld\n", (long long)r->next);
+            return -1;
+        }
+        if (inflate_slot_append(r, slot, size + (flags & 0x10 ? 4 : 0)) != 0) { // Block data and checksum
+            return -1;
+        }
+        blocks++;
+    }
+    if ((flags & 0x04) && inflate_slot_append(r, slot, 4) != 0) { // Content checksum
+        return -1;
+    }
+    uint64_t bound = blocks * block_max;
+    slot->out_size = (size_t)(content_size <= bound ? content_size : bound);
+    return 1;
+}
+
+// Read the next BGZF block or lz4 frame into slot. Returns 1, 0 at the end of the file, or -1 after printing an error.
+static int inflate_slot_read(struct archive_reader *r, struct inflate_slot *slot) {
+    slot->in_len = 0;
+    slot->offset = r->next;
+    if (r->format == READ_LZ4) {
+        return lz4_read_frame(r, slot);
+    }
+    if (!slot->in && !(slot->in = malloc(BGZF_BLOCK_MAX))) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    slot->in_cap = BGZF_BLOCK_MAX;
+    ssize_t n = pread(r->fd, slot->in, BGZF_BLOCK_MAX, r->next);
+    if (n <= 0) {
+        if (n < 0) {
+            perror("pread");
+        }
+        return n < 0 ? -1 : 0;
+    }
+    size_t size = bgzf_block_size(slot->in, (size_t)n);
+    if (size == 0 || size > (size_t)n) {
+        fprintf(stderr, "Damaged archive block at offset %lld\n", (long long)r->next);
+        return -1;
+    }
+    slot->in_len = size;
+    return 1;
+}
+
+// Next decompressed block or frame from the pool: release the one the parser has finished, read ahead into every
+// free slot, then wait for the oldest. Returns 1, 0 at the end of the file, or -1 after printing an error.
+static int inflate_pool_next(struct archive_reader *r) {
+    struct inflate_pool *pool = r->pool;
+    if (pool->holding) {
+        pool->released++;
+        pool->holding = 0;
+    }
+    while (!pool->eof && pool->queued < pool->released + pool->nslots) {
+        struct inflate_slot *slot = &pool->slots[pool->queued % pool->nslots];
+        int rc = inflate_slot_read(r, slot);
+        if (rc < 0) {
+            return -1;
+        }
+        if (rc == 0) {
+            pool->eof = 1;
+            break;
+        }
+        r->next += (off_t)slot->in_len;
+        pthread_mutex_lock(&pool->lock);
+        slot->state = BLOCK_QUEUED;
+        pool->queued++;
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (pool->released == pool->queued) {
+        return 0; // Every block has been read
+    }
+    struct inflate_slot *slot = &pool->slots[pool->released % pool->nslots];
+    pthread_mutex_lock(&pool->lock);
+    while (slot->state == BLOCK_QUEUED) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    int state = slot->state;
+    pthread_mutex_unlock(&pool->lock);
+    if (state == BLOCK_FAILED) {
+        fprintf(stderr, "Damaged archive %s at offset %lld\n", pool->format == READ_LZ4 ? "frame" : "block",
+                (long long)slot->offset);
+        return -1;
+    }
+    pool->holding = 1;
+    r->data = slot->out;
+    r->pos = 0;
+    r->len = (size_t)slot->out_len;
+    return 1;
+}
+
+// Open the archive at fd for reading from its start: recognize the format and set up its decompressor, with
+// nthreads inflaters for bgzf and lz4 archives (1 or less: everything is decompressed by the calling thread).
+// Returns 0, or -1 after printing an error.
+static int archive_reader_open(struct archive_reader *r, int fd, int nthreads) {
+    static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+    static const unsigned char lz4_magic[4] = { 0x04, 0x22, 0x4d, 0x18 };
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->in = malloc(ARCHIVE_READ_BUFFER); // Both hold a whole BGZF block too
+    r->buffer = malloc(ARCHIVE_READ_BUFFER);
+    r->data = r->buffer;
+    if (!r->in || !r->buffer) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    ssize_t n = pread(fd, r->in, BGZF_HEADER, 0);
+    if (n < 0) {
+        perror("pread");
+        return -1;
+    }
+    size_t len;
+    if (n >= 2 && r->in[0] == 0x1f && r->in[1] == 0x8b) {
+        r->format = gzip_subfield(r->in, (size_t)n, 'B', 'C', &len) ? READ_BGZF : READ_GZIP;
+    } else if (n >= 4 && memcmp(r->in, zstd_magic, 4) == 0) {
+        r->format = READ_ZSTD;
+    } else if (n >= 4 && memcmp(r->in, lz4_magic, 4) == 0) {
+        r->format = READ_LZ4;
+    } else {
+        r->format = READ_NONE; // A plain tar archive
+    }
+
+    switch (r->format) {
+    case READ_BGZF:
+    case READ_GZIP:
+        if (inflateInit2(&r->strm, r->format == READ_BGZF ? -15 : 15 + 16) != Z_OK) { // Raw blocks, or gzip framing
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        r->strm_ready = 1;
+        if (r->format == READ_BGZF && nthreads > 1) {
+            r->pool = inflate_pool_start(READ_BGZF, nthreads);
+        }
+        return 0;
+    case READ_ZSTD:
+#ifdef HAVE_ZSTD
+        r->zstd = ZSTD_createDCtx();
+        if (!r->zstd || ZSTD_isError(ZSTD_DCtx_setParameter(r->zstd, ZSTD_d_windowLogMax, 31))) { // Long-distance windows
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        return 0;
+#else
+        fprintf(stderr, "zstd support was not compiled in (build with -DHAVE_ZSTD -lzstd)\n");
+        return -1;
+#endif
+    case READ_LZ4:
+#ifdef HAVE_LZ4
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&r->lz4, LZ4F_VERSION))) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        if (nthreads > 1) {
+            r->pool = inflate_pool_start(READ_LZ4, nthreads);
+        }
+        return 0;
+#else
+        fprintf(stderr, "lz4 support was not compiled in (build with -DHAVE_LZ4 -llz4)\n");
+        return -1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+// Release the decompressor and buffers (the file descriptor stays open)
+static void archive_reader_close(struct archive_reader *r) {
+    if (r->pool) {
+        inflate_pool_free(r->pool);
+    }
+    if (r->strm_ready) {
+        inflateEnd(&r->strm);
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(r->zstd);
+#endif
+#ifdef HAVE_LZ4
+    if (r->lz4) {
+        LZ4F_freeDecompressionContext(r->lz4);
+    }
+#endif
+    free(r->in);
+    free(r->buffer);
+}
+
+// Continue reading a bgzf archive (without an inflate pool) at the block at offset
+static void archive_reader_seek(struct archive_reader *r, off_t offset) {
+    r->next = offset;
+    r->data = r->buffer;
+    r->pos = r->len = 0;
+    r->failed = 0;
+}
+
+// Decompress the next piece of the tar stream into data (possibly nothing yet). Returns 1, 0 at the end of the
+// file, or -1 after printing an error.
+static int archive_next_chunk(struct archive_reader *r) {
+    if (r->pool) {
+        return inflate_pool_next(r);
+    }
+    if (r->format == READ_BGZF || r->format == READ_NONE) {
+        ssize_t n = pread(r->fd, r->format == READ_BGZF ? r->in : r->buffer, ARCHIVE_READ_BUFFER, r->next);
+        if (n <= 0) {
+            if (n < 0) {
+                perror("pread");
+            }
+            return n < 0 ? -1 : 0;
+        }
+        r->data = r->buffer;
+        r->pos = 0;
+        if (r->format == READ_NONE) {
+            r->next += n;
+            r->len = (size_t)n;
+            return 1;
+        }
+        size_t size = bgzf_block_size(r->in, (size_t)n);
+        long len = size > 0 && size <= (size_t)n ? bgzf_inflate_block(&r->strm, r->in, size, r->buffer) : -1;
+        if (len < 0) {
+            fprintf(stderr, "Damaged archive block at offset %lld\n", (long long)r->next);
+            return -1;
+        }
+        r->next += (off_t)size;
+        r->len = (size_t)len;
+        return 1;
+    }
+
+    // Stream formats: decompress buffered input, reading more when it runs out
+    if (r->in_pos == r->in_len) {
+        ssize_t n = pread(r->fd, r->in, ARCHIVE_READ_BUFFER, r->next);
+        if (n < 0) {
+            perror("pread");
+            return -1;
+        }
+        if (n == 0) {
+            if (r->in_frame) {
+                fprintf(stderr, "Archive is truncated\n");
+                return -1;
+            }
+            return 0;
+        }
+        r->next += n;
+        r->in_pos = 0;
+        r->in_len = (size_t)n;
+    }
+    size_t produced = 0;
+    if (r->format == READ_GZIP) {
+        r->strm.next_in = r->in + r->in_pos;
+        r->strm.avail_in = (uInt)(r->in_len - r->in_pos);
+        r->strm.next_out = r->buffer;
+        r->strm.avail_out = ARCHIVE_READ_BUFFER;
+        int rc = inflate(&r->strm, Z_NO_FLUSH);
+        r->in_pos = r->in_len - r->strm.avail_in;
+        produced = ARCHIVE_READ_BUFFER - r->strm.avail_out;
+        if (rc == Z_STREAM_END) {
+            r->in_frame = 0;
+            inflateReset(&r->strm); // Concatenated gzip members continue the stream
+        } else if (rc == Z_OK || rc == Z_BUF_ERROR) {
+            r->in_frame = 1;
+        } else {
+            fprintf(stderr, "Damaged archive: %s\n", r->strm.msg ? r->strm.msg : "inflate failed");
+            return -1;
+        }
+    }
+#ifdef HAVE_ZSTD
+    if (r->format == READ_ZSTD) {
+        ZSTD_inBuffer in = { r->in, r->in_len, r->in_pos };
+        ZSTD_outBuffer out = { r->buffer, ARCHIVE_READ_BUFFER, 0 };
+        size_t rc = ZSTD_decompressStream(r->zstd, &out, &in);
+        if (ZSTD_isError(rc)) {
+            fprintf(stderr, "Damaged archive: %s\n", ZSTD_getErrorName(rc));
+            return -1;
+        }
+        r->in_pos = in.pos;
+        produced = out.pos;
+        r->in_frame = rc != 0; // 0 once a frame is complete
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (r->format == READ_LZ4) {
+        size_t out_len = ARCHIVE_READ_BUFFER, in_len = r->in_len - r->in_pos;
+        size_t rc = LZ4F_decompress(r->lz4, r->buffer, &out_len, r->in + r->in_pos, &in_len, NULL);
+        if (LZ4F_isError(rc)) {
+            fprintf(stderr, "Damaged archive: %s\n", LZ4F_getErrorName(rc));
+            return -1;
+        }
+        r->in_pos += in_len;
+        produced = out_len;
+        r->in_frame = rc != 0; // 0 once a frame is complete; the next frame starts with the following call
+    }
+#endif
+    r->data = r->buffer;
+    r->pos = 0;
+    r->len = produced;
+    return 1;
+}
+
+// Make sure unread data is buffered, passing over empty pieces (such as the bgzf index members). Returns 0, or -1
+// after printing an error (also when the file ends, since callers only ask for data a header promised).
+static int archive_fill(struct archive_reader *r) {
+    while (r->pos == r->len) {
+        int rc = r->failed ? -1 : archive_next_chunk(r);
+        if (rc <= 0) {
+            if (rc == 0) {
+                fprintf(stderr, "Archive ends in the middle of a member\n");
+            }
+            r->failed = 1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read exactly len bytes of the tar stream. Returns 0, or -1 after printing an error.
+static int archive_read(struct archive_reader *r, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        if (archive_fill(r) != 0) {
+            return -1;
+        }
+        size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+        memcpy(p, r->data + r->pos, n);
+        p += n;
+        r->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Skip len bytes of the tar stream (without reading them at all in uncompressed archives). Returns 0 or -1.
+static int archive_skip(struct archive_reader *r, uint64_t len) {
+    while (len > 0) {
+        if (r->pos == r->len && r->format == READ_NONE) {
+            r->next += (off_t)len; // Nothing to decompress: just move on
+            return 0;
+        }
+        if (archive_fill(r) != 0) {
+            return -1;
+        }
+        size_t n = r->len - r->pos < len ? r->len - r->pos : (size_t)len;
+        r->pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// File offset of the next unread byte of an uncompressed archive
+static off_t archive_data_offset(const struct archive_reader *r) {
+    return r->next - (off_t)(r->len - r->pos);
+}
+
+// Tar data is padded to whole blocks
+static uint64_t tar_padded(uint64_t size) {
+    return size + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+// Value of a numeric tar header field: octal digits, or base-256 when the high bit of the first byte is set
+static uint64_t tar_parse_number(const char *field, size_t len) {
+    const unsigned char *p = (const unsigned char *)field;
+    uint64_t value = 0;
+    if (p[0] & 0x80) {
+        for (size_t i = 1; i < len; i++) {
+            value = value << 8 | p[i];
+        }
+        return value;
+    }
+    for (size_t i = 0; i < len && (p[i] == ' ' || (p[i] >= '0' && p[i] <= '7')); i++) {
+        if (p[i] != ' ') {
+            value = value << 3 | (uint64_t)(p[i] - '0');
+        }
+    }
+    return value;
+}
+
+// Apply the records of a PAX extended header that the reader uses (path, size, mtime) to member
+static void tar_apply_pax(struct tar_member *member, char *records, size_t len, int *have_path, int *have_size) {
+    size_t at = 0;
+    while (at < len) {
+        char *end;
+        unsigned long long record_len = strtoull(records + at, &end, 10);
+        if (record_len == 0 || record_len > len - at || *end != ' ') {
+            return; // Malformed: use the ustar fields
+        }
+        char *key = end + 1;
+        char *record_end = records + at + record_len - 1; // The newline
+        char *eq = memchr(key, '=', (size_t)(record_end - key));
+        if (eq) {
+            *eq = '\0';
+            *record_end = '\0';
+            const char *value = eq + 1;
+            if (strcmp(key, "path") == 0) {
+                snprintf(member->name, sizeof(member->name), "%s", value);
+                *have_path = 1;
+            } else if (strcmp(key, "size") == 0) {
+                member->size = strtoull(value, NULL, 10);
+                *have_size = 1;
+            } else if (strcmp(key, "mtime") == 0) {
+                member->mtime = strtoll(value, NULL, 10); // Fractions of a second are dropped
+            }
+        }
+        at += record_len;
+    }
+}
+
+// Read the headers of the next member (applying any PAX header before it). Returns 1, 0 at the end of the archive,
+// or -1 after printing an error. The member's data follows in the stream.
+static int tar_read_member(struct archive_reader *r, struct tar_member *member) {
+    int have_path = 0, have_size = 0;
+    memset(member, 0, sizeof(*member));
+    for (;;) {
+        struct tar_header header;
+        if (archive_read(r, &header, sizeof(header)) != 0) {
+            return -1;
+        }
+        static const struct tar_header zero;
+        if (memcmp(&header, &zero, sizeof(header)) == 0) {
+            return 0; // End of archive
+        }
+        uint64_t stored = tar_parse_number(header.chksum, sizeof(header.chksum));
+        tar_checksum(&header);
+        if (tar_parse_number(header.chksum, sizeof(header.chksum)) != stored) {
+            fprintf(stderr, "Damaged tar header\n");
+            return -1;
+        }
+        uint64_t size = tar_parse_number(header.size, sizeof(header.size));
+        if (header.typeflag == 'x' || header.typeflag == 'g') { // PAX header for the next member, or global (ignored)
+            char *records = size < (1 << 20) ? malloc((size_t)size + 1) : NULL;
+            if (!records) {
+                fprintf(stderr, "Unsupported PAX header\n");
+                return -1;
+            }
+            int rc = archive_read(r, records, (size_t)size);
+            if (rc == 0 && header.typeflag == 'x') {
+                records[size] = '\0';
+                tar_apply_pax(member, records, (size_t)size, &have_path, &have_size);
+            }
+            free(records);
+            if (rc != 0 || archive_skip(r, tar_padded(size) - size) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (!have_path) {
+            if (header.prefix[0]) {
+                snprintf(member->name, sizeof(member->name), "%.*s/%.*s", (int)strnlen(header.prefix, sizeof(header.prefix)),
+                         header.prefix, (int)strnlen(header.name, sizeof(header.name)), header.name);
+            } else {
+                snprintf(member->name, sizeof(member->name), "%.*s", (int)strnlen(header.name, sizeof(header.name)), header.name);
+            }
+        }
+        if (!have_size) {
+            member->size = size;
+        }
+        if (member->mtime == 0) {
+            member->mtime = (long long)tar_parse_number(header.mtime, sizeof(header.mtime));
+        }
+        member->mode = (mode_t)tar_parse_number(header.mode, sizeof(header.mode)) & 07777;
+        member->typeflag = header.typeflag;
+        return 1;
+    }
+}
+
+// Whether name is a relative path without ".." components, i.e. stays below the directory it is unpacked into
+static int tar_name_is_safe(const char *name) {
+    if (name[0] == '/' || name[0] == '\0') {
+        return 0;
+    }
+    for (const char *p = name; *p;) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return 0;
+        }
+        p += len;
+        p += *p == '/';
+    }
+    return 1;
+}
+
+// Create the directories leading to path (like mkdir -p on its dirname). Returns 0, or -1 with errno set.
+static int make_parent_dirs(char *path) {
+    for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int rc = mkdir(path, 0777);
+        int err = errno;
+        *p = '/';
+        if (rc != 0 && err != EEXIST) {
+            errno = err;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read the member index of the bgzf archive open at fd into index (NUL-terminated records, see bgzf_write_index)
+// Returns 0, 1 if the file has no index, or -1 after printing an error.
+static int bgzf_load_index(int fd, struct byte_buffer *index) {
+    struct stat st;
+    unsigned char tail[BGZF_LOCATOR + sizeof(bgzf_eof)];
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(tail) || pread(fd, tail, sizeof(tail), st.st_size - (off_t)sizeof(tail)) != (ssize_t)sizeof(tail) ||
+        memcmp(tail + BGZF_LOCATOR, bgzf_eof, sizeof(bgzf_eof)) != 0) {
+        return 1;
+    }
+    size_t len;
+    const unsigned char *locator = gzip_subfield(tail, BGZF_LOCATOR, 'F', 'L', &len);
+    if (!locator || len != 16) {
+        return 1;
+    }
+    uint64_t start = get_le(locator, 8);
+    uint64_t index_len = get_le(locator + 8, 8);
+    if (start > (uint64_t)st.st_size || index_len > (uint64_t)st.st_size - start) {
+        fprintf(stderr, "Damaged archive index\n");
+        return -1;
+    }
+    unsigned char *block = malloc(BGZF_BLOCK_MAX);
+    if (!block) {
+        perror("malloc");
+        return -1;
+    }
+    int rc = 0;
+    for (off_t at = (off_t)start; rc == 0 && index->len < index_len;) {
+        ssize_t n = pread(fd, block, BGZF_BLOCK_MAX, at);
+        size_t size = n > 0 ? bgzf_block_size(block, (size_t)n) : 0;
+        const unsigned char *chunk = size > 0 ? gzip_subfield(block, (size_t)n, 'F', 'I', &len) : NULL;
+        if (!chunk || index->len + len > index_len) {
+            fprintf(stderr, "Damaged archive index\n");
+            rc = -1;
+        } else if (byte_buffer_append(index, chunk, len) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            rc = -1;
+        }
+        at += (off_t)size;
+    }
+    free(block);
+    if (rc == 0 && index->len > 0 && index->data[index->len - 1] != '\0') {
+        fprintf(stderr, "Damaged archive index\n");
+        rc = -1;
+    }
+    return rc;
+}
+
+// Drop one reference to file; the last one sets its mode and mtime (unless a write failed) and closes it
+static void extract_file_release(struct extract_pool *pool, struct extract_file *file) {
+    if (atomic_fetch_sub(&file->pending, 1) != 1) {
+        return;
+    }
+    int failed = atomic_load(&file->failed);
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { (time_t)file->mtime, 0 } };
+    if (!failed && (fchmod(file->fd, file->mode) != 0 || futimens(file->fd, times) != 0)) {
+        perror(file->path);
+        failed = 1;
+    }
+    if (close(file->fd) != 0 && !failed) {
+        perror(file->path);
+        failed = 1;
+    }
+    if (failed) {
+        atomic_store(&pool->failed, 1);
+    }
+    pthread_mutex_lock(&pool->lock);
+    struct extract_file **link = &pool->open_files;
+    while (*link != file) {
+        link = &(*link)->next;
+    }
+    *link = file->next;
+    pthread_cond_broadcast(&pool->done); // A later member with the same path may be waiting
+    pthread_mutex_unlock(&pool->lock);
+    free(file);
+}
+
+// Write one chunk: copy jobs move the data inside the kernel with copy_file_range() and read whatever it could not
+// copy (other filesystem types, old kernels) into the job's buffer; then the buffer is written with pwrite()
+static void extract_job_run(struct extract_pool *pool, struct extract_job *job) {
+    struct extract_file *file = job->file;
+    size_t done = 0, have = job->len;
+    if (!atomic_load(&file->failed) && job->copy) {
+        off_t in = job->src_offset, out = job->offset;
+        while (done < job->len) {
+            ssize_t n = copy_file_range(pool->archive_fd, &in, file->fd, &out, job->len - done, 0);
+            if (n <= 0) {
+                break; // Not supported here (or the archive is short): fall back to reading
+            }
+            done += (size_t)n;
+        }
+        have = 0;
+        while (done + have < job->len) {
+            ssize_t n = pread(pool->archive_fd, job->buffer + have, job->len - done - have, job->src_offset + (off_t)(done + have));
+            if (n <= 0) {
+                if (atomic_exchange(&file->failed, 1)) {
+                    break; // Already reported by another chunk
+                }
+                if (n == 0) {
+                    fprintf(stderr, "%s: archive is truncated\n", file->path);
+                } else {
+                    perror(file->path);
+                }
+                break;
+            }
+            have += (size_t)n;
+        }
+    }
+    for (size_t written = 0; !atomic_load(&file->failed) && written < have;) {
+        ssize_t n = pwrite(file->fd, job->buffer + written, have - written, job->offset + (off_t)(done + written));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror(file->path);
+            atomic_store(&file->failed, 1);
+            break;
+        }
+        written += (size_t)n;
+    }
+    extract_file_release(pool, file);
+}
+
+// Thread body: run queued jobs in order until the pool shuts down
+static void *extract_thread(void *arg) {
+    struct extract_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->claimed == pool->queued && !pool->shutdown) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->claimed == pool->queued) {
+            break; // Shut down and nothing left to do
+        }
+        struct extract_job *job = &pool->jobs[pool->claimed++ % pool->njobs];
+        pthread_mutex_unlock(&pool->lock);
+        extract_job_run(pool, job);
+        pthread_mutex_lock(&pool->lock);
+        job->state = BLOCK_FREE;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Start nthreads writers copying from archive_fd (0 or 1: the parser runs every job itself). Returns NULL if out of memory.
+static struct extract_pool *extract_pool_start(int archive_fd, int nthreads) {
+    struct extract_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->archive_fd = archive_fd;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->njobs = nthreads > 1 ? 2 * nthreads : 1; // Enough jobs to keep every thread busy while the parser fills one
+    pool->jobs = calloc((size_t)pool->njobs, sizeof(*pool->jobs));
+    pool->threads = nthreads > 1 ? calloc((size_t)nthreads, sizeof(*pool->threads)) : NULL;
+    int rc = pool->jobs && (nthreads <= 1 || pool->threads) ? 0 : -1;
+    for (int i = 0; rc == 0 && i < pool->njobs; i++) {
+        pool->jobs[i].buffer = malloc(EXTRACT_CHUNK);
+        rc = pool->jobs[i].buffer ? 0 : -1;
+    }
+    while (rc == 0 && nthreads > 1 && pool->nthreads < nthreads &&
+           pthread_create(&pool->threads[pool->nthreads], NULL, extract_thread, pool) == 0) {
+        pool->nthreads++; // With fewer threads than asked for (or none), the remaining work is just done by fewer hands
+    }
+    if (rc != 0) {
+        for (int i = 0; pool->jobs && i < pool->njobs; i++) {
+            free(pool->jobs[i].buffer);
+        }
+        free(pool->jobs);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Next job slot to fill, once the writers are done with it
+static struct extract_job *extract_pool_slot(struct extract_pool *pool) {
+    struct extract_job *job = &pool->jobs[pool->queued % pool->njobs];
+    pthread_mutex_lock(&pool->lock);
+    while (job->state != BLOCK_FREE) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+// Wait until no file at path is open in the pool. An archive can hold the same path twice (tar -r appends a new
+// version), and truncating the file while the writers still have chunks of the earlier member would mix the two.
+static void extract_pool_wait_path(struct extract_pool *pool, const char *path) {
+    pthread_mutex_lock(&pool->lock);
+    for (struct extract_file *file = pool->open_files; file;) {
+        if (strcmp(file->path, path) == 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+            file = pool->open_files; // The list may have changed
+        } else {
+            file = file->next;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Hand the slot returned by extract_pool_slot() (filled in) to the writers, or run it here when there are none
+static void extract_pool_queue(struct extract_pool *pool, struct extract_job *job) {
+    atomic_fetch_add(&job->file->pending, 1);
+    if (pool->nthreads == 0) {
+        pool->queued++;
+        extract_job_run(pool, job);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    job->state = BLOCK_QUEUED;
+    pool->queued++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait for every queued job, stop the writers and release the pool. Returns 0, or -1 if some file failed.
+static int extract_pool_finish(struct extract_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    int rc = atomic_load(&pool->failed) ? -1 : 0;
+    for (int i = 0; i < pool->njobs; i++) {
+        free(pool->jobs[i].buffer);
+    }
+    free(pool->jobs);
+    free(pool->threads);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return rc;
+}
+
+// make_parent_dirs() for the files of an archive, which mostly come directory by directory: nothing is done when
+// path is in the same directory as the previous file (last_dir, PATH_MAX bytes). Returns 0 or -1 (errno set).
+static int ensure_parent_dirs(char *path, char *last_dir) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    if (last_dir[0] && strlen(last_dir) == len && memcmp(last_dir, path, len) == 0) {
+        return 0;
+    }
+    if (make_parent_dirs(path) != 0) {
+        last_dir[0] = '\0';
+        return -1;
+    }
+    memcpy(last_dir, path, len);
+    last_dir[len] = '\0';
+    return 0;
+}
+
+// Unpack the member whose headers were just read into dest_dir: directories are created, regular files are created
+// and their data queued on pool, anything else is skipped with a warning. Always consumes the member's data.
+// Prints the path of every file written. Returns 0, or -1 after printing an error.
+static int extract_member(struct archive_reader *r, struct extract_pool *pool, const char *dest_dir, const struct tar_member *member,
+                          char *last_dir) {
+    int regular = member->typeflag == '0' || member->typeflag == '\0';
+    uint64_t padded = tar_padded(member->size);
+    char path[PATH_MAX];
+    if (!tar_name_is_safe(member->name)) {
+        fprintf(stderr, "%s: unsafe member name\n", member->name);
+        archive_skip(r, padded);
+        return -1;
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", dest_dir, member->name) >= (int)sizeof(path)) {
+        fprintf(stderr, "%s: path too long\n", member->name);
+        archive_skip(r, padded);
+        return -1;
+    }
+    if (member->typeflag == '5') {
+        size_t len = strlen(path);
+        while (len > 0 && path[len - 1] == '/') {
+            path[--len] = '\0';
+        }
+        if (make_parent_dirs(path) != 0 || (mkdir(path, 0755) != 0 && errno != EEXIST)) {
+            perror(path);
+            return -1;
+        }
+        return archive_skip(r, padded);
+    }
+    if (!regular) {
+        fprintf(stderr, "%s: not a regular file, skipped\n", member->name);
+        return archive_skip(r, padded);
+    }
+    if (ensure_parent_dirs(path, last_dir) != 0) {
+        perror(path);
+        archive_skip(r, padded);
+        return -1;
+    }
+    extract_pool_wait_path(pool, path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(path);
+        archive_skip(r, padded);
+        return -1;
+    }
+    if (member->size >= EXTRACT_CHUNK) {
+        fallocate(fd, 0, 0, (off_t)member->size); // Contiguous space for the chunks that land in any order; best effort
+    }
+    size_t path_len = strlen(path);
+    struct extract_file *file = malloc(sizeof(*file) + path_len + 1);
+    if (!file) {
+        fprintf(stderr, "Out of memory\n");
+        close(fd);
+        return -1;
+    }
+    file->fd = fd;
+    file->mode = member->mode;
+    file->mtime = member->mtime;
+    atomic_init(&file->pending, 1); // The parser's reference, dropped once every chunk is queued
+    atomic_init(&file->failed, 0);
+    memcpy(file->path, path, path_len + 1);
+    pthread_mutex_lock(&pool->lock);
+    file->next = pool->open_files;
+    pool->open_files = file;
+    pthread_mutex_unlock(&pool->lock);
+
+    // Queue the data in chunks: offsets for the writers to copy in uncompressed archives, decompressed bytes otherwise
+    int rc = 0;
+    for (uint64_t offset = 0; offset < member->size;) {
+        struct extract_job *job = extract_pool_slot(pool);
+        uint64_t left = member->size - offset;
+        job->file = file;
+        job->offset = (off_t)offset;
+        job->len = left < EXTRACT_CHUNK ? (size_t)left : EXTRACT_CHUNK;
+        job->copy = r->format == READ_NONE && r->len - r->pos < job->len; // Unless it is already in the read buffer
+        if (job->copy) {
+            job->src_offset = archive_data_offset(r);
+            r->next = job->src_offset + (off_t)job->len; // Drop the buffer and carry on after the chunk
+            r->pos = r->len = 0;
+        } else if (archive_read(r, job->buffer, job->len) != 0) {
+            atomic_store(&file->failed, 1);
+            rc = -1;
+            break;
+        }
+        extract_pool_queue(pool, job);
+        offset += job->len;
+    }
+    extract_file_release(pool, file);
+    if (rc == 0 && archive_skip(r, padded - member->size) != 0) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        printf("%s\n", path); // Print the path of the extracted file
+    }
+    return rc;
+}
+
+// Create the parent directories of every file named in the bgzf member index under dest_dir, before any data is read
+static void extract_index_dirs(const struct byte_buffer *index, const char *dest_dir) {
+    char path[PATH_MAX], last_dir[PATH_MAX] = "";
+    for (size_t at = 0; at < index->len;) {
+        char *record = (char *)index->data + at;
+        at += strlen(record) + 1;
+        char *end;
+        strtoull(record, &end, 10); // Block offset
+        strtoull(end, &end, 10); // Offset within the block
+        strtoull(end, &end, 10); // Size
+        const char *member_name = *end == ' ' ? end + 1 : end;
+        if (tar_name_is_safe(member_name) && snprintf(path, sizeof(path), "%s/%s", dest_dir, member_name) < (int)sizeof(path)) {
+            ensure_parent_dirs(path, last_dir); // Failures are reported when the member itself is extracted
+        }
+    }
+}
+
+// Does member (archive path) match the name asked for, as a whole path or as a file name?
+static int member_name_matches(const char *member_name, const char *name) {
+    const char *base = strrchr(member_name, '/');
+    return strcmp(member_name, name) == 0 || strcmp(base ? base + 1 : member_name, name) == 0;
+}
+
+int archive_extract(const char *archive_path, const char *dest_dir, const char *name) {
+    int fd = open(archive_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(archive_path);
+        return -1;
+    }
+    int nthreads = archive_threads; // Thread count from --archive-threads
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN); // Default to one thread per online CPU
+        nthreads = cpus > 0 ? (int)cpus : 1;
+    }
+    struct byte_buffer index;
+    memset(&index, 0, sizeof(index));
+    struct archive_reader r;
+    int rc = archive_reader_open(&r, fd, name ? 1 : nthreads); // Seeking to single members needs the plain reader
+    int have_index = 0;
+    if (rc == 0 && r.format == READ_BGZF) {
+        rc = bgzf_load_index(fd, &index);
+        have_index = rc == 0;
+        rc = rc < 0 ? -1 : 0;
+    }
+    struct extract_pool *pool = NULL;
+    if (rc == 0) {
+        pool = extract_pool_start(fd, name ? 1 : nthreads); // Single members are written by this thread
+        if (!pool) {
+            fprintf(stderr, "Out of memory\n");
+            rc = -1;
+        }
+    }
+    char last_dir[PATH_MAX] = "";
+    long found = 0;
+    struct tar_member member;
+
+    if (rc == 0 && name && have_index) {
+        // Look the name up in the index and unpack every member it names, reading only the blocks that hold it
+        for (size_t at = 0; at < index.len;) {
+            char *record = (char *)index.data + at;
+            char *end;
+            unsigned long long block_offset = strtoull(record, &end, 10);
+            unsigned long long within = strtoull(end, &end, 10);
+            strtoull(end, &end, 10); // Size, read from the member's own header
+            const char *member_name = *end == ' ' ? end + 1 : end;
+            at += strlen(record) + 1;
+            if (!member_name_matches(member_name, name)) {
+                continue;
+            }
+            archive_reader_seek(&r, (off_t)block_offset);
+            if (archive_skip(&r, within) != 0 || tar_read_member(&r, &member) != 1 || strcmp(member.name, member_name) != 0) {
+                fprintf(stderr, "%s: index does not match the archive\n", member_name);
+                rc = -1;
+            } else if (extract_member(&r, pool, dest_dir, &member, last_dir) != 0) {
+                rc = -1;
+            } else {
+                found++;
+            }
+        }
+    } else if (rc == 0) {
+        // Read the whole archive, unpacking every member (or those matching name)
+        if (have_index) {
+            extract_index_dirs(&index, dest_dir);
+        }
+        int more;
+        while ((more = tar_read_member(&r, &member)) == 1) {
+            if (name && !member_name_matches(member.name, name)) {
+                if (archive_skip(&r, tar_padded(member.size)) != 0) {
+                    more = -1;
+                    break;
+                }
+                continue;
+            }
+            if (extract_member(&r, pool, dest_dir, &member, last_dir) != 0) {
+                rc = -1; // Carry on with the other members, unless the archive itself cannot be read
+                if (r.failed) {
+                    break;
+                }
+            } else if (member.typeflag != '5') {
+                found++;
+            }
+        }
+        if (more < 0) {
+            rc = -1;
+        }
+    }
+    if (pool && extract_pool_finish(pool) != 0) {
+        rc = -1;
+    }
+    archive_reader_close(&r);
+    free(index.data);
+    close(fd);
+    if (rc == 0 && name && found == 0) {
+        printf("Search Unsuccessful\n"); // No member of that name
+        return -1;
+    }
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+// Copy engine
+//
+// copy_range() copies a byte range between two file descriptors with the fastest mechanism the pair of files
+// supports. It tries the in-kernel methods first and falls back one step at a time when the kernel refuses one:
+//     reflink          FICLONERANGE: the destination shares the source's extents copy-on-write (btrfs, XFS), O(1)
+//     copy_file_range  no data through user space; filesystems can share extents or copy server-side (NFS, CIFS)
+//     sendfile         page cache to page cache, for kernels or filesystems without copy_file_range
+//     splice           through a pipe, for file types that sendfile rejects
+//     read/write       pread/pwrite with a large buffer, which works everywhere
+// The method is chosen per file: each copy starts from the top (or from --copy-method) and keeps the method that
+// worked for the rest of the range. Whole-file copies clone with FICLONE first; --reflink never skips cloning and
+// --reflink always fails instead of copying data when the files cannot share extents (e.g. different filesystems).
+
+#define COPY_BUFFER_SIZE (1 << 20) // Buffer of the read/write fallback and chunk size of the kernel methods
+
+// CRC32C (Castagnoli), the checksum of --checksum/--verify. x86 CPUs with SSE4.2 compute it with the crc32
+// instruction, eight bytes per instruction; other CPUs use a slicing-by-8 table. Every copy path computes it: chunks
+// copied in parallel and io_uring pieces keep one CRC each and are combined in file order, and the holes skipped by
+// sparse copies are folded in as zeros, both in O(log n) polynomial arithmetic without touching any data.
+
+static uint32_t crc32c_table[8][256]; // Slicing-by-8 tables (reflected polynomial 0x82F63B78)
+static int crc32c_table_ready = 0;
+
+// Build the lookup tables
+static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+        }
+    }
+    crc32c_table_ready = 1;
+}
+
+// Table-driven update of a raw (not inverted) CRC
+static uint32_t crc32c_update_table(uint32_t crc, const unsigned char *p, size_t len) {
+    if (!crc32c_table_ready) {
+        crc32c_init_table();
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc; // Little-endian: the CRC covers the first four bytes
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+              crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF] ^
+              crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF] ^
+              crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// Hardware update of a raw CRC with the SSE4.2 crc32 instruction (only called when the CPU has it)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_update_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+// Function to extend a CRC32C (0 for no data yet) with len more bytes, like zlib's crc32()
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static int has_sse42 = -1; // Checked once
+    if (has_sse42 < 0) {
+        has_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    }
+    if (has_sse42) {
+        return ~crc32c_update_sse42(crc, buf, len);
+    }
+#endif
+    return ~crc32c_update_table(crc, buf, len);
+}
+
+// Multiply two polynomials modulo the CRC32C polynomial (bit-reflected, like the register)
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31, p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ 0x82F63B78 : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * len) modulo the polynomial: the operator that appends len zero bytes to a CRC register
+static uint32_t crc32c_shift(uint64_t len) {
+    uint32_t p = (uint32_t)1 << 31, square = (uint32_t)1 << 30; // x^0, and x^1 to be squared up
+    for (int i = 0; i < 3; i++) {
+        square = crc32c_multmodp(square, square); // x^8: one byte
+    }
+    for (; len; len >>= 1) {
+        if (len & 1) {
+            p = crc32c_multmodp(square, p);
+        }
+        square = crc32c_multmodp(square, square);
+    }
+    return p;
+}
+
+// Function to get the CRC32C of A followed by B from crc1 (of A), crc2 (of B) and B's length, like crc32_combine()
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    return crc32c_multmodp(crc32c_shift(len2), crc1) ^ crc2;
+}
+
+// Function to extend a CRC32C with len zero bytes (the holes of a sparse copy) without touching the data
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len) {
+    uint32_t op = crc32c_shift(len);
+    return crc32c_multmodp(op, crc) ^ ~crc32c_multmodp(op, 0xFFFFFFFF); // The second term is the CRC of the zeros alone
+}
+
+// Extend *crc with len bytes of fd at offset, read through *buffer (allocated on first use). Returns 0 or -1 (errno set).
+static int crc32c_file_range(int fd, off_t offset, off_t len, uint32_t *crc, char **buffer) {
+    if (!*buffer && !(*buffer = malloc(COPY_BUFFER_SIZE))) {
+        return -1;
+    }
+    for (off_t done = 0; done < len;) {
+        ssize_t n = pread(fd, *buffer, len - done < COPY_BUFFER_SIZE ? (size_t)(len - done) : COPY_BUFFER_SIZE, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 ? -1 : 0; // Error, or the file ended early
+        }
+        *crc = crc32c(*crc, *buffer, (size_t)n);
+        done += n;
+    }
+    return 0;
+}
+
+
+// Whether an error means "this method cannot copy between these files" rather than a real I/O failure
+static int copy_method_unsupported(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOTSUP || err == EBADF ||
+           err == EPERM || err == ENOTTY; // ENOTTY: no clone ioctl on this file type
+}
+
+// Move up to len bytes with one call of the given method, extending *crc (unless NULL) with them. Returns the bytes
+// copied (0 at end of file), -1 on failure, or -2 on a failure that must not be retried with another method.
+static ssize_t copy_chunk(int method, int src_fd, int dst_fd, off_t offset, size_t len, int pipe_fds[2], char **buffer,
+                          uint32_t *crc) {
+    off_t in_off = offset, out_off = offset;
+    switch (method) {
+    case COPY_METHOD_CLONE: {
+        // The range must be block aligned except where it ends at the source's end of file
+        struct file_clone_range range = { .src_fd = src_fd, .src_offset = (uint64_t)offset, .src_length = len,
+                                          .dest_offset = (uint64_t)offset };
+        if (ioctl(dst_fd, FICLONERANGE, &range) != 0) {
+            return -1;
+        }
+        if (crc && crc32c_file_range(src_fd, offset, (off_t)len, crc, buffer) != 0) {
+            return -2; // Cloned but not checksummed: copying again would not help
+        }
+        return (ssize_t)len;
+    }
+    case COPY_METHOD_RANGE:
+        return copy_file_range(src_fd, &in_off, dst_fd, &out_off, len, 0);
+    case COPY_METHOD_SENDFILE:
+        if (lseek(dst_fd, offset, SEEK_SET) < 0) { // sendfile() writes at the output's file position
+            return -1;
+        }
+        return sendfile(dst_fd, src_fd, &in_off, len);
+    case COPY_METHOD_SPLICE: {
+        if (pipe_fds[0] < 0) {
+            if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+                return -1;
+            }
+            fcntl(pipe_fds[1], F_SETPIPE_SZ, COPY_BUFFER_SIZE); // A larger pipe means fewer round trips; best effort
+        }
+        ssize_t in = splice(src_fd, &in_off, pipe_fds[1], NULL, len, SPLICE_F_MOVE);
+        if (in <= 0) {
+            return in;
+        }
+        for (ssize_t out = 0; out < in;) { // Drain the pipe completely so it is empty for the next chunk
+            ssize_t n = splice(pipe_fds[0], NULL, dst_fd, &out_off, (size_t)(in - out), SPLICE_F_MOVE);
+            if (n <= 0) {
+                if (n == 0) {
+                    errno = EIO;
+                }
+                return -2; // The pipe still holds data, so this cannot fall back to another method
+            }
+            out += n;
+        }
+        return in;
+    }
+    default: {
+        if (!*buffer && !(*buffer = malloc(COPY_BUFFER_SIZE))) {
+            return -1;
+        }
+        ssize_t in = pread(src_fd, *buffer, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE, offset);
+        if (in <= 0) {
+            return in;
+        }
+        if (crc) {
+            *crc = crc32c(*crc, *buffer, (size_t)in); // Checksum while the data is in cache
+        }
+        for (ssize_t out = 0; out < in;) {
+            ssize_t n = pwrite(dst_fd, *buffer + out, (size_t)(in - out), offset + out);
+            if (n < 0) {
+                return -1;
+            }
+            out += n;
+        }
+        return in;
+    }
+    }
+}
+
+// Function to copy len bytes at offset from src_fd to the same offset of dst_fd
+int copy_range(int src_fd, int dst_fd, off_t offset, off_t len, int *method, int concurrent, uint32_t *crc) {
+    int pipe_fds[2] = { -1, -1 }; // Created on first use by the splice method
+    char *buffer = NULL; // Allocated on first use by the read/write method
+    int rc = 0;
+    off_t done = 0;
+    while (done < len) {
+        if (concurrent && *method == COPY_METHOD_SENDFILE) {
+            (*method)++; // sendfile() writes at the shared file position, which other threads move as well
+        }
+        if (crc && *method > COPY_METHOD_CLONE && *method < COPY_METHOD_READWRITE) {
+            *method = COPY_METHOD_READWRITE; // The data has to pass through this process to be checksummed
+        }
+        size_t chunk = len - done < COPY_BUFFER_SIZE * 64 ? (size_t)(len - done) : (size_t)COPY_BUFFER_SIZE * 64;
+        ssize_t n = copy_chunk(*method, src_fd, dst_fd, offset + done, chunk, pipe_fds, &buffer, crc);
+        if (n > 0) {
+            done += n;
+        } else if (n == 0) {
+            break; // The source ended early (it shrank while being copied)
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && *method < COPY_METHOD_READWRITE && copy_method_unsupported(errno)) {
+            (*method)++; // Not supported between these files: continue from the same offset with the next method
+        } else {
+            rc = -1;
+            break;
+        }
+    }
+    int saved_errno = errno;
+    if (pipe_fds[0] >= 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    free(buffer);
+    errno = saved_errno;
+    return rc;
+}
+
+// Large files: the range is split into COPY_PARALLEL_CHUNK pieces that a pool of threads copies concurrently with
+// copy_range(), so several requests are in flight at once on devices (NVMe, RAID, parallel filesystems) that a
+// single stream cannot keep busy. The destination is preallocated first, so the chunks never extend the file
+// concurrently and the filesystem can lay the file out in one piece.
+
+#define COPY_PARALLEL_CHUNK ((off_t)64 << 20) // Size (and alignment) of the ranges handed to the copy threads
+
+// State shared by the threads copying one file
+struct copy_parallel_job {
+    int src_fd; // Source file
+    int dst_fd; // Destination file, preallocated to size
+    off_t size; // Bytes to copy
+    int start_method; // Method every thread starts with
+    atomic_llong next; // Offset of the next chunk nobody has claimed yet
+    atomic_int failed; // Set when a thread fails; the others stop claiming chunks
+    atomic_int method; // Furthest fallback any thread needed (reported as the method used)
+    atomic_int error; // errno of the first failure
+    uint32_t *crcs; // CRC32C of each chunk (--checksum), combined in order once every chunk is done; NULL otherwise
+};
+
+// Thread body: claim chunks until the file is done or a thread has failed
+static void *copy_parallel_worker(void *arg) {
+    struct copy_parallel_job *job = arg;
+    int method = job->start_method;
+    while (!atomic_load(&job->failed)) {
+        off_t offset = (off_t)atomic_fetch_add(&job->next, (long long)COPY_PARALLEL_CHUNK);
+        if (offset >= job->size) {
+            break;
+        }
+        off_t len = job->size - offset < COPY_PARALLEL_CHUNK ? job->size - offset : COPY_PARALLEL_CHUNK;
+        uint32_t *crc = job->crcs ? &job->crcs[offset / COPY_PARALLEL_CHUNK] : NULL;
+        if (copy_range(job->src_fd, job->dst_fd, offset, len, &method, 1, crc) != 0) {
+            int expected = 0;
+            atomic_compare_exchange_strong(&job->error, &expected, errno);
+            atomic_store(&job->failed, 1);
+        }
+    }
+    int current = atomic_load(&job->method);
+    while (method > current && !atomic_compare_exchange_weak(&job->method, &current, method)) {
+    }
+    return NULL;
+}
+
+// Copy size bytes with a pool of threads, extending *crc (unless NULL) with the data. Returns 0 on success, -1 with
+// errno set.
+static int copy_parallel(int src_fd, int dst_fd, off_t size, int *method, uint32_t *crc) {
+    int nthreads = copy_threads; // Thread count from --copy-threads
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN); // Default to one thread per online CPU
+        nthreads = cpus > 0 ? (int)cpus : 1;
+    }
+    off_t chunks = (size + COPY_PARALLEL_CHUNK - 1) / COPY_PARALLEL_CHUNK;
+    if (nthreads > chunks) {
+        nthreads = (int)chunks;
+    }
+    if (nthreads <= 1) {
+        return copy_range(src_fd, dst_fd, 0, size, method, 0, crc);
+    }
+    uint32_t *crcs = crc ? calloc((size_t)chunks, sizeof(*crcs)) : NULL;
+    if (crc && !crcs) {
+        return -1;
+    }
+
+    // Clone the first chunk on this thread: if the files can share extents the other chunks are cloned too and
+    // preallocating would only have allocated blocks for nothing. Otherwise it steps down to a data copy.
+    off_t start = 0;
+    if (*method == COPY_METHOD_CLONE) {
+        start = COPY_PARALLEL_CHUNK;
+        if (copy_range(src_fd, dst_fd, 0, start, method, 0, crcs) != 0) {
+            free(crcs);
+            return -1;
+        }
+    }
+
+    // Reserve the whole file up front: ENOSPC shows up before any data is copied and the threads write into
+    // allocated blocks. This is only an optimisation: if fallocate() fails for any other reason (no support, EINVAL
+    // on some filesystems) the file simply grows as the chunks land. Only running out of space or quota stops here.
+    if (*method != COPY_METHOD_CLONE && fallocate(dst_fd, 0, 0, size) != 0 && (errno == ENOSPC || errno == EDQUOT)) {
+        free(crcs);
+        return -1;
+    }
+
+    struct copy_parallel_job job = { .src_fd = src_fd, .dst_fd = dst_fd, .size = size, .start_method = *method, .crcs = crcs };
+    atomic_init(&job.next, (long long)start);
+    atomic_init(&job.failed, 0);
+    atomic_init(&job.method, *method);
+    atomic_init(&job.error, 0);
+    pthread_t *threads = malloc((size_t)nthreads * sizeof(*threads));
+    if (!threads) {
+        free(crcs);
+        return -1;
+    }
+    int started = 0;
+    while (started < nthreads && pthread_create(&threads[started], NULL, copy_parallel_worker, &job) == 0) {
+        started++;
+    }
+    if (started == 0) { // No threads at all: copy on this one
+        copy_parallel_worker(&job);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    *method = atomic_load(&job.method);
+    for (off_t i = 0; crcs && i < chunks; i++) {
+        off_t len = size - i * COPY_PARALLEL_CHUNK < COPY_PARALLEL_CHUNK ? size - i * COPY_PARALLEL_CHUNK : COPY_PARALLEL_CHUNK;
+        *crc = crc32c_combine(*crc, crcs[i], (uint64_t)len);
+    }
+    free(crcs);
+    if (atomic_load(&job.failed)) {
+        errno = atomic_load(&job.error);
+        return -1;
+    }
+    return 0;
+}
+
+// Sparse files: only the data extents reported by lseek(SEEK_DATA/SEEK_HOLE) are copied into the (empty)
+// destination and the size is set at the end, so the holes in between are recreated instead of being written out as
+// zeros. --sparse always also skips every all-zero block inside the data extents, which turns files full of
+// written zeros (e.g. images copied by tools unaware of holes) into sparse files.
+
+// Whether a buffer holds only zero bytes
+static int block_is_zero(const char *buf, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= len; i += 64) { // OR four vectors together and test them with a single compare
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+                                                _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+                                   _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+                                                _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) {
+            return 0;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (buf[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Copy a range with pread/pwrite, leaving out every all-zero block of block_size bytes, and extend *crc (unless NULL)
+// with it. Returns 0, or -1 with errno set (EIO if the source ends before len bytes).
+static int copy_range_skip_zeros(int src_fd, int dst_fd, off_t offset, off_t len, size_t block_size, uint32_t *crc) {
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    int rc = 0;
+    off_t done = 0;
+    while (done < len && rc == 0) {
+        size_t want = len - done < COPY_BUFFER_SIZE ? (size_t)(len - done) : COPY_BUFFER_SIZE;
+        ssize_t in = pread(src_fd, buffer, want, offset + done);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in <= 0) {
+            if (in == 0) {
+                errno = EIO; // The source shrank: the hole left behind would read as zeros it never had
+            }
+            rc = -1;
+            break;
+        }
+        if (crc) {
+            *crc = crc32c(*crc, buffer, (size_t)in); // The skipped zero blocks are part of the file's data
+        }
+        // Write each run of nonzero blocks with one pwrite(); zero blocks are skipped and stay holes
+        size_t run_start = 0;
+        for (size_t pos = 0; rc == 0; pos += block_size) {
+            int at_end = pos >= (size_t)in;
+            if (!at_end && !block_is_zero(buffer + pos, (size_t)in - pos < block_size ? (size_t)in - pos : block_size)) {
+                continue; // Part of the current run of data
+            }
+            size_t run_end = at_end ? (size_t)in : pos;
+            for (size_t out = run_start; out < run_end && rc == 0;) { // Flush the run that ends here
+                ssize_t n = pwrite(dst_fd, buffer + out, run_end - out, offset + done + (off_t)out);
+                if (n > 0) {
+                    out += (size_t)n;
+                } else if (n == 0 || errno != EINTR) {
+                    rc = -1;
+                }
+            }
+            if (at_end) {
+                break;
+            }
+            run_start = pos + block_size;
+        }
+        done += in;
+    }
+    free(buffer);
+    return rc;
+}
+
+// Copy only the data extents of src_fd and give dst_fd the source's size, extending *crc (unless NULL) with the whole
+// file, holes included. Returns 0, or -1 with errno set (EIO if the source shrank while being copied).
+static int copy_sparse(int src_fd, int dst_fd, off_t size, int *method, uint32_t *crc) {
+    struct stat dst_st;
+    size_t block_size = fstat(dst_fd, &dst_st) == 0 && dst_st.st_blksize > 0 ? (size_t)dst_st.st_blksize : 4096;
+    if (sparse_mode == SPARSE_ALWAYS) {
+        *method = COPY_METHOD_READWRITE; // Zero blocks can only be found by looking at the data
+    }
+    off_t data = 0, covered = 0; // covered: end of the part of the file already copied (or known to be a hole)
+    while (data < size) {
+        data = lseek(src_fd, data, SEEK_DATA); // Start of the next data extent
+        if (data < 0) {
+            if (errno != ENXIO) {
+                return -1;
+            }
+            break; // Only a hole is left
+        }
+        if (data >= size) {
+            break; // Data the file gained while being copied
+        }
+        off_t hole = lseek(src_fd, data, SEEK_HOLE); // End of that extent (the end of the file counts as a hole)
+        if (hole < 0) {
+            return -1;
+        }
+        if (hole > size) {
+            hole = size; // The file grew while being copied; copy what it had when it was opened
+        }
+        if (crc) {
+            *crc = crc32c_zeros(*crc, (uint64_t)(data - covered)); // The hole before this extent reads as zeros
+        }
+        int rc = sparse_mode == SPARSE_ALWAYS ? copy_range_skip_zeros(src_fd, dst_fd, data, hole - data, block_size, crc)
+                                              : copy_range(src_fd, dst_fd, data, hole - data, method, 0, crc);
+        if (rc != 0) {
+            return -1;
+        }
+        data = covered = hole;
+    }
+    if (crc) {
+        *crc = crc32c_zeros(*crc, (uint64_t)(size - covered)); // Trailing hole
+    }
+    struct stat src_st;
+    if (fstat(src_fd, &src_st) != 0) {
+        return -1;
+    }
+    if (src_st.st_size < size) {
+        errno = EIO; // Shrank while being copied (copy_range() stops quietly at the end): do not pad it with zeros
+        return -1;
+    }
+    return ftruncate(dst_fd, size); // Recreates a trailing hole, which no write above extended the file into
+}
+
+// O_DIRECT copies (--copy-method direct): the data moves between the disks and a small pool of aligned buffers
+// without passing through the page cache, so copying a huge file does not evict the cached working set of other
+// processes. A reader thread fills one buffer while the caller writes the other. The pool is allocated on first use
+// and kept for later copies (the query server copies many files); with --direct-hugepages it is backed by huge pages
+// when the system has them reserved. The last block is written padded to the alignment and the destination is then
+// truncated to the real size. Filesystems that refuse O_DIRECT (e.g. tmpfs) get the normal fallback chain.
+
+#define DIRECT_ALIGN 4096 // Alignment of O_DIRECT offsets, lengths and buffers (covers 512-byte and 4K-sector disks)
+#define DIRECT_BUFFER_SIZE ((size_t)8 << 20) // Size of each pool buffer (a multiple of the 2 MiB huge page size)
+#define DIRECT_POOL_BUFFERS 2 // One being read while the other is written
+
+// Reusable aligned buffers for O_DIRECT copies
+struct direct_buffer_pool {
+    char *buffers[DIRECT_POOL_BUFFERS]; // Aligned buffers of DIRECT_BUFFER_SIZE bytes
+    int mapped; // The buffers come from one mmap() (huge pages) rather than posix_memalign()
+};
+
+struct direct_buffer_pool direct_pool; // Allocated by the first O_DIRECT copy
+
+// Allocate the buffer pool if it does not exist yet. Returns 0 on success, -1 if memory runs out.
+static int direct_pool_init(void) {
+    if (direct_pool.buffers[0]) {
+        return 0; // Already allocated by an earlier copy
+    }
+    if (direct_hugepages) {
+        char *block = mmap(NULL, DIRECT_BUFFER_SIZE * DIRECT_POOL_BUFFERS, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (block != MAP_FAILED) {
+            for (int i = 0; i < DIRECT_POOL_BUFFERS; i++) {
+                direct_pool.buffers[i] = block + (size_t)i * DIRECT_BUFFER_SIZE;
+            }
+            direct_pool.mapped = 1;
+            return 0;
+        }
+        // No huge pages reserved (vm.nr_hugepages): use normal pages
+    }
+    for (int i = 0; i < DIRECT_POOL_BUFFERS; i++) {
+        void *buffer;
+        if (posix_memalign(&buffer, DIRECT_ALIGN, DIRECT_BUFFER_SIZE) != 0) {
+            return -1; // Buffers allocated so far stay in the pool and are reused by the next attempt
+        }
+        direct_pool.buffers[i] = buffer;
+    }
+    return 0;
+}
+
+// A buffer of the pool on its way from the reader thread to the writer
+struct direct_slot {
+    size_t len; // Bytes read into the buffer
+    int full; // Holds data the writer has not written yet
+};
+
+// State shared by the reader thread and the writer of one O_DIRECT copy
+struct direct_copy {
+    int src_fd; // Source, opened with O_DIRECT
+    off_t size; // Bytes to copy
+    struct direct_slot slots[DIRECT_POOL_BUFFERS]; // One per pool buffer
+    int done; // The reader has finished (end of file, error or cancellation)
+    int cancel; // The writer failed; the reader stops
+    int error; // errno of a read error
+    pthread_mutex_t lock; // Protects everything above except src_fd and size
+    pthread_cond_t changed; // Signalled whenever a slot fills or empties, or done/cancel is set
+};
+
+// Reader thread: fill the pool buffers in turn until the end of the file
+static void *direct_reader(void *arg) {
+    struct direct_copy *copy = arg;
+    off_t offset = 0;
+    for (int i = 0;; i = (i + 1) % DIRECT_POOL_BUFFERS) {
+        pthread_mutex_lock(&copy->lock);
+        while (copy->slots[i].full && !copy->cancel) {
+            pthread_cond_wait(&copy->changed, &copy->lock); // Wait for the writer to hand this buffer back
+        }
+        int stop = copy->cancel || offset >= copy->size;
+        pthread_mutex_unlock(&copy->lock);
+        if (stop) {
+            break;
+        }
+
+        // Read whole aligned blocks; the last read of the file comes back short
+        off_t left = copy->size - offset;
+        size_t want = left < (off_t)DIRECT_BUFFER_SIZE ? ((size_t)left + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1)
+                                                       : DIRECT_BUFFER_SIZE;
+        ssize_t n;
+        do {
+            n = pread(copy->src_fd, direct_pool.buffers[i], want, offset);
+        } while (n < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&copy->lock);
+        if (n < 0) {
+            copy->error = errno;
+        } else if (n > 0) {
+            copy->slots[i].len = (size_t)n;
+            copy->slots[i].full = 1;
+            offset += n;
+        }
+        pthread_cond_broadcast(&copy->changed);
+        pthread_mutex_unlock(&copy->lock);
+        if (n <= 0 || (size_t)n % DIRECT_ALIGN != 0) {
+            break; // Error, or the end of the file (a short read leaves the offset unaligned)
+        }
+    }
+    pthread_mutex_lock(&copy->lock);
+    copy->done = 1;
+    pthread_cond_broadcast(&copy->changed);
+    pthread_mutex_unlock(&copy->lock);
+    return NULL;
+}
+
+// Copy src_fd to dst_fd with O_DIRECT, extending *crc (unless NULL) with the data. Returns 0 on success, 1 if the
+// files do not support O_DIRECT (nothing has been written), or -1 on failure with errno set.
+static int copy_direct(int src_fd, int dst_fd, off_t size, uint32_t *crc) {
+    int src_flags = fcntl(src_fd, F_GETFL), dst_flags = fcntl(dst_fd, F_GETFL);
+    if (src_flags < 0 || dst_flags < 0) {
+        return -1;
+    }
+    if (fcntl(src_fd, F_SETFL, src_flags | O_DIRECT) != 0 || fcntl(dst_fd, F_SETFL, dst_flags | O_DIRECT) != 0) {
+        fcntl(src_fd, F_SETFL, src_flags);
+        return 1; // The filesystem does not do direct I/O
+    }
+    int rc = direct_pool_init();
+    if (rc != 0) {
+        errno = ENOMEM;
+    }
+
+    struct direct_copy copy = { .src_fd = src_fd, .size = size };
+    pthread_mutex_init(&copy.lock, NULL);
+    pthread_cond_init(&copy.changed, NULL);
+    pthread_t reader;
+    int reader_started = 0;
+    if (rc == 0) {
+        int err = pthread_create(&reader, NULL, direct_reader, &copy);
+        if (err != 0) {
+            errno = err;
+            rc = -1;
+        }
+        reader_started = err == 0;
+    }
+
+    off_t written = 0;
+    for (int i = 0; rc == 0; i = (i + 1) % DIRECT_POOL_BUFFERS) {
+        pthread_mutex_lock(&copy.lock);
+        while (!copy.slots[i].full && !copy.done) {
+            pthread_cond_wait(&copy.changed, &copy.lock); // Wait for the reader to fill this buffer
+        }
+        int have = copy.slots[i].full;
+        size_t len = copy.slots[i].len;
+        if (!have && copy.error) {
+            errno = copy.error;
+            rc = -1;
+        }
+        pthread_mutex_unlock(&copy.lock);
+        if (!have) {
+            break; // The reader is done and every buffer has been written
+        }
+
+        if (crc) {
+            *crc = crc32c(*crc, direct_pool.buffers[i], len); // The buffers are written in file order
+        }
+        // A short last block is padded with zeros to the alignment; the file is truncated afterwards
+        size_t padded = (len + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        memset(direct_pool.buffers[i] + len, 0, padded - len);
+        for (size_t out = 0; out < padded && rc == 0;) {
+            ssize_t n = pwrite(dst_fd, direct_pool.buffers[i] + out, padded - out, written + (off_t)out);
+            if (n > 0) {
+                out += (size_t)n;
+            } else if (n == 0 || errno != EINTR) {
+                rc = -1;
+            }
+        }
+        written += (off_t)len;
+
+        pthread_mutex_lock(&copy.lock);
+        copy.slots[i].full = 0; // Hand the buffer back to the reader
+        if (rc != 0) {
+            copy.cancel = 1;
+        }
+        pthread_cond_broadcast(&copy.changed);
+        pthread_mutex_unlock(&copy.lock);
+    }
+    if (reader_started) {
+        int saved_errno = errno;
+        pthread_join(reader, NULL);
+        errno = saved_errno;
+    }
+    pthread_cond_destroy(&copy.changed);
+    pthread_mutex_destroy(&copy.lock);
+
+    if (rc == 0 && ftruncate(dst_fd, written) != 0) { // Drop the padding of the last block
+        rc = -1;
+    }
+    int saved_errno = errno;
+    fcntl(src_fd, F_SETFL, src_flags);
+    fcntl(dst_fd, F_SETFL, dst_flags);
+    errno = saved_errno;
+    return rc;
+}
+
+// io_uring copies (--copy-method uring): the file is split into buffer-sized pieces and every piece is submitted as a
+// READ_FIXED linked to a WRITE_FIXED, so the kernel starts the write as soon as the read completes without a round
+// trip through this process. --copy-uring-depth pairs are kept in flight. The buffers are registered with the ring
+// once and both files are used through the registered file table, which saves the kernel from mapping the pages and
+// looking up the descriptors on every request. The ring, its buffers and its file table are set up by the first copy
+// and reused by every later copy of the process (the query server copies many files). A piece whose read comes back
+// short breaks its link; it is finished with pread/pwrite.
+
+// The io_uring copier shared by all copies of the process
+struct uring_copier {
+    struct uring ring; // Ring with two entries per piece in flight
+    char *buffers; // depth buffers of buffer_size bytes, registered with the ring
+    unsigned depth; // Pieces in flight
+    size_t buffer_size; // Bytes per piece
+    int state; // 0: not set up yet, 1: ready, -1: io_uring is unavailable
+};
+
+struct uring_copier copier; // Set up by the first io_uring copy
+
+// One piece of the file being copied
+struct uring_copy_piece {
+    off_t offset; // Where the piece starts in both files
+    size_t len; // Bytes in the piece
+    int active; // A read/write pair is in flight
+    int completions; // Completions of the pair still to come (2 when it is submitted)
+    int short_read; // The read returned fewer bytes, so the linked write is cancelled
+};
+
+// Wrapper for io_uring_register(). Returns 0 or -1 with errno set.
+static int uring_register(struct uring *ring, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr_args) < 0 ? -1 : 0;
+}
+
+// Set up the shared copier. Returns 0 when it is ready, -1 if io_uring cannot be used.
+static int uring_copier_init(void) {
+    if (copier.state != 0) {
+        return copier.state == 1 ? 0 : -1;
+    }
+    copier.state = -1;
+    copier.depth = (unsigned)copy_uring_depth;
+    copier.buffer_size = copy_uring_buffer_size;
+    if (uring_init(&copier.ring, copier.depth * 2) != 0) {
+        return -1;
+    }
+    struct iovec *iov = malloc(copier.depth * sizeof(*iov));
+    if (posix_memalign((void **)&copier.buffers, 4096, copier.depth * copier.buffer_size) != 0) {
+        copier.buffers = NULL;
+    }
+    int rc = iov && copier.buffers ? 0 : -1;
+    for (unsigned i = 0; rc == 0 && i < copier.depth; i++) {
+        iov[i].iov_base = copier.buffers + i * copier.buffer_size;
+        iov[i].iov_len = copier.buffer_size;
+    }
+    int no_files[2] = { -1, -1 }; // Slot 0 holds the source and slot 1 the destination of the running copy
+    if (rc == 0 && (uring_register(&copier.ring, IORING_REGISTER_BUFFERS, iov, copier.depth) != 0 ||
+                    uring_register(&copier.ring, IORING_REGISTER_FILES, no_files, 2) != 0)) {
+        rc = -1; // Too old a kernel, or RLIMIT_MEMLOCK is too small for the buffers
+    }
+    free(iov);
+    if (rc != 0) {
+        uring_exit(&copier.ring);
+        free(copier.buffers);
+        copier.buffers = NULL;
+        return -1;
+    }
+    copier.state = 1;
+    return 0;
+}
+
+// Point the registered file table at a pair of descriptors (-1 to release them). Returns 0 or -1 with errno set.
+static int uring_copier_set_files(int src_fd, int dst_fd) {
+    int fds[2] = { src_fd, dst_fd };
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = 0;
+    update.fds = (uint64_t)(uintptr_t)fds;
+    return uring_register(&copier.ring, IORING_REGISTER_FILES_UPDATE, &update, 2);
+}
+
+// Finish a piece with pread/pwrite from the start of its buffer, extending *crc (unless NULL) with what it reads.
+// Returns 0 or -1 with errno set.
+static int uring_copy_piece_sync(int src_fd, int dst_fd, char *buffer, const struct uring_copy_piece *piece, uint32_t *crc) {
+    size_t done = 0;
+    while (done < piece->len) {
+        ssize_t in = pread(src_fd, buffer, piece->len - done, piece->offset + (off_t)done);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in <= 0) {
+            return in < 0 ? -1 : 0; // Error, or the source ended early
+        }
+        if (crc) {
+            *crc = crc32c(*crc, buffer, (size_t)in);
+        }
+        for (ssize_t out = 0; out < in;) {
+            ssize_t n = pwrite(dst_fd, buffer + out, (size_t)(in - out), piece->offset + (off_t)done + out);
+            if (n <= 0 && !(n < 0 && errno == EINTR)) {
+                if (n == 0) {
+                    errno = EIO;
+                }
+                return -1;
+            }
+            out += n > 0 ? n : 0;
+        }
+        done += (size_t)in;
+    }
+    return 0;
+}
+
+// Queue the linked read and write of a piece (the ring always has room for every piece's pair)
+static void uring_copy_piece_submit(unsigned slot, struct uring_copy_piece *piece) {
+    char *buffer = copier.buffers + slot * copier.buffer_size;
+    struct io_uring_sqe *sqe = uring_get_sqe(&copier.ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK; // The write below starts when this read has completed in full
+    sqe->fd = 0; // Index of the source in the registered file table
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)piece->len;
+    sqe->off = (uint64_t)piece->offset;
+    sqe->buf_index = (uint16_t)slot;
+    sqe->user_data = (uint64_t)slot * 2;
+
+    sqe = uring_get_sqe(&copier.ring);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 1; // Index of the destination
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)piece->len;
+    sqe->off = (uint64_t)piece->offset;
+    sqe->buf_index = (uint16_t)slot;
+    sqe->user_data = (uint64_t)slot * 2 + 1;
+    piece->active = 1;
+    piece->completions = 2;
+    piece->short_read = 0;
+}
+
+// Release the shared copier; the next io_uring copy sets it up again. Closing the ring cancels whatever it still had.
+static void uring_copier_free(void) {
+    uring_exit(&copier.ring);
+    free(copier.buffers);
+    copier.buffers = NULL;
+    copier.state = 0;
+}
+
+// After a failed submission: take back the pairs that were never issued and wait out the completions of the others,
+// so that none of them lands in a later copy (or writes to its files after we return). If even waiting fails, the
+// ring is torn down instead.
+static void uring_copier_drain(struct uring_copy_piece *pieces) {
+    unsigned expected = 0;
+    for (unsigned slot = 0; slot < copier.depth; slot++) {
+        expected += pieces[slot].active ? (unsigned)pieces[slot].completions : 0;
+    }
+    expected -= uring_unsubmit(&copier.ring); // Entries of submitted pieces only, so never more than expected
+    while (expected > 0) {
+        if (!uring_wait_cqe(&copier.ring)) {
+            uring_copier_free();
+            return;
+        }
+        uring_cqe_seen(&copier.ring);
+        expected--;
+    }
+}
+
+// Copy src_fd to dst_fd through the shared io_uring copier, extending *crc (unless NULL) with the data. Returns 0 on
+// success, 1 if io_uring cannot be used (nothing has been written), or -1 on failure with errno set.
+static int copy_uring(int src_fd, int dst_fd, off_t size, uint32_t *crc) {
+    if (uring_copier_init() != 0 || uring_copier_set_files(src_fd, dst_fd) != 0) {
+        return 1;
+    }
+    // Pieces complete out of order: each one's CRC32C is kept by its index and they are combined at the end
+    size_t npieces = (size_t)((size + (off_t)copier.buffer_size - 1) / (off_t)copier.buffer_size);
+    struct uring_copy_piece *pieces = calloc(copier.depth, sizeof(*pieces));
+    uint32_t *crcs = crc ? calloc(npieces ? npieces : 1, sizeof(*crcs)) : NULL;
+    if (!pieces || (crc && !crcs)) {
+        uring_copier_set_files(-1, -1);
+        free(pieces);
+        free(crcs);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    off_t next = 0; // Start of the first piece not submitted yet
+    unsigned active = 0; // Pieces in flight
+    int err = 0; // First error; no new pieces are submitted once it is set
+    for (;;) {
+        for (unsigned slot = 0; slot < copier.depth && next < size && err == 0; slot++) {
+            if (!pieces[slot].active) { // Refill every free slot
+                pieces[slot].offset = next;
+                pieces[slot].len = size - next < (off_t)copier.buffer_size ? (size_t)(size - next) : copier.buffer_size;
+                next += (off_t)pieces[slot].len;
+                uring_copy_piece_submit(slot, &pieces[slot]);
+                active++;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+        int rc = uring_submit_and_wait(&copier.ring, 1);
+        if (rc != 0) {
+            err = -rc; // The ring itself failed: settle the requests in flight before giving up
+            uring_copier_drain(pieces);
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&copier.ring)) != NULL) {
+            unsigned slot = (unsigned)(cqe->user_data / 2);
+            int is_write = (int)(cqe->user_data % 2);
+            int res = cqe->res;
+            uring_cqe_seen(&copier.ring);
+            struct uring_copy_piece *piece = &pieces[slot];
+            piece->completions--;
+            if (!is_write) {
+                if (res >= 0 && (size_t)res < piece->len) {
+                    piece->short_read = 1; // The linked write completes with -ECANCELED
+                } else if (res < 0 && res != -ECANCELED && err == 0) {
+                    err = -res;
+                }
+                continue;
+            }
+            // The write is the last completion of the piece
+            char *buffer = copier.buffers + slot * copier.buffer_size;
+            uint32_t *piece_crc = crcs ? &crcs[piece->offset / (off_t)copier.buffer_size] : NULL;
+            if (res == -ECANCELED && piece->short_read && err == 0) {
+                if (uring_copy_piece_sync(src_fd, dst_fd, buffer, piece, piece_crc) != 0) {
+                    err = errno;
+                }
+            } else if (res >= 0 && err == 0) {
+                if (piece_crc) {
+                    *piece_crc = crc32c(0, buffer, piece->len); // The read filled the buffer completely
+                }
+                struct uring_copy_piece rest = { piece->offset + res, piece->len - (size_t)res, 0, 0, 0 };
+                if (rest.len > 0 && uring_copy_piece_sync(src_fd, dst_fd, buffer, &rest, NULL) != 0) {
+                    err = errno; // Short write: finish the rest synchronously
+                }
+            } else if (res < 0 && res != -ECANCELED && err == 0) {
+                err = -res;
+            }
+            piece->active = 0;
+            active--;
+        }
+    }
+
+    if (copier.state == 1) {
+        uring_copier_set_files(-1, -1); // Drop the kernel's references to the files
+    }
+    for (size_t i = 0; crcs && err == 0 && i < npieces; i++) {
+        off_t offset = (off_t)i * (off_t)copier.buffer_size;
+        size_t len = size - offset < (off_t)copier.buffer_size ? (size_t)(size - offset) : copier.buffer_size;
+        *crc = crc32c_combine(*crc, crcs[i], len);
+    }
+    free(crcs);
+    free(pieces);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to check a copy: re-read path, bypassing the page cache where the filesystem allows it, and compare its
+// CRC32C with the one computed while copying. Returns 0 if it matches, -1 after printing an error.
+int verify_copy(const char *path, uint32_t expected) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT); // Read what reached the disk, not the cached pages
+    int direct = fd >= 0;
+    if (!direct) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        perror("open copy for verification");
+        return -1;
+    }
+    if (!direct) {
+        fdatasync(fd); // Without O_DIRECT: write back and drop the cached pages so they are read from the device
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (direct_pool_init() != 0) {
+        perror("posix_memalign");
+        close(fd);
+        return -1;
+    }
+
+    uint32_t crc = 0;
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = pread(fd, direct_pool.buffers[0], DIRECT_BUFFER_SIZE, offset)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read copy for verification");
+            close(fd);
+            return -1;
+        }
+        crc = crc32c(crc, direct_pool.buffers[0], (size_t)n);
+        offset += n;
+    }
+    close(fd);
+    if (crc != expected) {
+        fprintf(stderr, "Checksum mismatch: copied data has crc32c %08x, the copy reads back as %08x\n", expected, crc);
+        return -1;
+    }
+    return 0;
+}
+
+// Update copies (--update): a destination left by an earlier run is not rewritten when it already holds the
+// source's data. "fast" trusts size and modification time, like make or rsync's default: updated copies get the
+// source's mtime, so an unchanged pair compares equal next time. "strict" reads both files and rewrites only the
+// blocks that differ, then trims or extends the destination to the source's size. The blocks are compared directly
+// rather than through a hash, since both files are local and have to be read either way.
+
+#define UPDATE_BLOCK_SIZE ((size_t)1 << 20) // Unit compared and rewritten by --update strict
+
+// Give path the access and modification times of st. Returns 0 or -1 with errno set.
+static int copy_times(const char *path, const struct stat *st) {
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    return utimensat(AT_FDCWD, path, times, 0);
+}
+
+// Rewrite the blocks of dst_fd that differ from src_fd, extending copy_crc with the source's data (with --checksum).
+// Returns 0 or -1 with errno set.
+static int update_blocks(int src_fd, int dst_fd, off_t size, long *rewritten, long *blocks) {
+    char *src_buf = malloc(UPDATE_BLOCK_SIZE), *dst_buf = malloc(UPDATE_BLOCK_SIZE);
+    int rc = src_buf && dst_buf ? 0 : -1;
+    if (rc != 0) {
+        errno = ENOMEM;
+    }
+    for (off_t offset = 0; rc == 0 && offset < size; offset += (off_t)UPDATE_BLOCK_SIZE) {
+        size_t want = size - offset < (off_t)UPDATE_BLOCK_SIZE ? (size_t)(size - offset) : UPDATE_BLOCK_SIZE;
+        ssize_t in = pread(src_fd, src_buf, want, offset);
+        ssize_t have = pread(dst_fd, dst_buf, want, offset); // Short (or 0) where the destination is shorter
+        if (in < 0 || have < 0) {
+            rc = -1;
+            break;
+        }
+        if (in == 0) {
+            break; // The source shrank while being compared
+        }
+        (*blocks)++;
+        if (copy_checksum) {
+            copy_crc = crc32c(copy_crc, src_buf, (size_t)in);
+        }
+        if (have == in && memcmp(src_buf, dst_buf, (size_t)in) == 0) {
+            continue; // Identical block: no write
+        }
+        (*rewritten)++;
+        for (ssize_t out = 0; out < in && rc == 0;) {
+            ssize_t n = pwrite(dst_fd, src_buf + out, (size_t)(in - out), offset + out);
+            if (n > 0) {
+                out += n;
+            } else if (n == 0 || errno != EINTR) {
+                rc = -1;
+            }
+        }
+    }
+    free(src_buf);
+    free(dst_buf);
+    return rc;
+}
+
+// Compute the CRC32C of the whole file at path. Returns 0 or -1 with errno set.
+static int checksum_file(const char *path, uint32_t *crc) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *buffer = fd >= 0 ? malloc(COPY_BUFFER_SIZE) : NULL;
+    int rc = buffer ? 0 : -1;
+    if (fd >= 0 && !buffer) {
+        errno = ENOMEM;
+    }
+    *crc = 0;
+    for (off_t offset = 0; rc == 0;) {
+        ssize_t n = pread(fd, buffer, COPY_BUFFER_SIZE, offset);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno != EINTR) {
+                rc = -1;
+            }
+            continue;
+        }
+        *crc = crc32c(*crc, buffer, (size_t)n);
+        offset += n;
+    }
+    free(buffer);
+    if (fd >= 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    return rc;
+}
+
+// Function to bring an existing copy up to date
+int update_file(const char *src_path, const char *dest_path, long *rewritten, long *blocks) {
+    *rewritten = 0;
+    *blocks = 0;
+    struct stat src_st, dst_st;
+    if (stat(src_path, &src_st) != 0) {
+        perror("stat source file");
+        return -1;
+    }
+    if (stat(dest_path, &dst_st) != 0) {
+        if (errno == ENOENT) {
+            return 2; // Nothing to compare with: copy it
+        }
+        perror("stat destination file");
+        return -1;
+    }
+    int same_stamp = dst_st.st_size == src_st.st_size && dst_st.st_mtim.tv_sec == src_st.st_mtim.tv_sec &&
+                     dst_st.st_mtim.tv_nsec == src_st.st_mtim.tv_nsec;
+    copy_crc = 0;
+    if (update_mode == UPDATE_FAST) {
+        if (!same_stamp) {
+            return 2;
+        }
+        // Left alone: the digest (and --verify) still need the source's data, read once here
+        if (copy_checksum && checksum_file(src_path, &copy_crc) != 0) {
+            perror("read source file");
+            return -1;
+        }
+        return copy_verify && verify_copy(dest_path, copy_crc) != 0 ? -1 : 1;
+    }
+
+    int src_fd = open(src_path, O_RDONLY | O_CLOEXEC);
+    if (src_fd < 0) {
+        perror("open source file");
+        return -1;
+    }
+    int dst_fd = open(dest_path, O_RDWR | O_CLOEXEC); // No O_TRUNC: the matching blocks stay as they are
+    if (dst_fd < 0) {
+        perror("open destination file");
+        close(src_fd);
+        return -1;
+    }
+    int rc = update_blocks(src_fd, dst_fd, src_st.st_size, rewritten, blocks);
+    if (rc == 0 && dst_st.st_size != src_st.st_size && ftruncate(dst_fd, src_st.st_size) != 0) {
+        rc = -1; // Drop the extra tail (or extend to the source's size)
+    }
+    if (rc != 0) {
+        perror("update destination file");
+    }
+    if (close(dst_fd) != 0 && rc == 0) {
+        perror("close destination file");
+        rc = -1;
+    }
+    close(src_fd);
+    if (rc == 0 && copy_times(dest_path, &src_st) != 0) {
+        perror("utimensat");
+        rc = -1;
+    }
+    if (rc == 0 && copy_verify) {
+        rc = verify_copy(dest_path, copy_crc); // Covers the kept blocks as well as the rewritten ones
+    }
+    if (rc != 0) {
+        return -1;
+    }
+    return *rewritten == 0 && dst_st.st_size == src_st.st_size && same_stamp ? 1 : 0;
+}
+
+// Resumable copies (--resume): the data goes to "<dest>.part" and "<dest>.journal" records how far it has safely got.
+// Every COPY_JOURNAL_INTERVAL bytes the part file is synced and then the journal is rewritten with the committed
+// offset, the CRC32C of the last committed segment and the running CRC32C of everything committed so far. When a
+// copy finds a journal written for the same source (same size, mtime, inode and device) it re-reads the last
+// committed segment of the part file, and if its CRC matches continues from the committed offset; anything after
+// that offset is discarded. A complete copy is synced, renamed over dest and the journal removed.
+// Unless --reflink never (or another --copy-method) is given, each segment is first cloned with FICLONERANGE; the
+// source is then still read once, for the CRCs, but nothing is written.
+
+#define COPY_JOURNAL_INTERVAL ((off_t)64 << 20) // Bytes copied between two journal commits
+#define COPY_JOURNAL_MAGIC "FUJRNL1" // First bytes of a journal (7 characters and a NUL)
+
+// On-disk journal record (host byte order; a journal is only read back on the machine that wrote it)
+struct copy_journal {
+    char magic[8]; // COPY_JOURNAL_MAGIC
+    uint64_t src_size; // Identity of the source being copied
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+    uint64_t src_ino;
+    uint64_t src_dev;
+    uint64_t committed; // Bytes of the part file known to be on disk
+    uint64_t segment_start; // Start of the last committed segment
+    uint32_t segment_crc; // CRC32C of [segment_start, committed)
+    uint32_t rolling_crc; // CRC32C of [0, committed)
+    uint32_t record_crc; // CRC32C of the fields above, to detect a torn journal write
+};
+
+// Fill the identity fields of a journal from the source's status
+static void copy_journal_identity(struct copy_journal *journal, const struct stat *st) {
+    memset(journal, 0, sizeof(*journal));
+    memcpy(journal->magic, COPY_JOURNAL_MAGIC, sizeof(journal->magic));
+    journal->src_size = (uint64_t)st->st_size;
+    journal->src_mtime_sec = st->st_mtim.tv_sec;
+    journal->src_mtime_nsec = st->st_mtim.tv_nsec;
+    journal->src_ino = st->st_ino;
+    journal->src_dev = st->st_dev;
+}
+
+// Write the journal record in place and make it durable. Returns 0 or -1 with errno set.
+static int copy_journal_commit(int journal_fd, struct copy_journal *journal) {
+    journal->record_crc = crc32c(0, journal, offsetof(struct copy_journal, record_crc));
+    if (pwrite(journal_fd, journal, sizeof(*journal), 0) != (ssize_t)sizeof(*journal)) {
+        return -1;
+    }
+    return fdatasync(journal_fd);
+}
+
+// Read back the journal of an interrupted copy of the same source and check its last segment against the part file.
+// Returns the offset to resume from (0 when there is nothing usable) and restores *journal to that point.
+static off_t copy_journal_recover(int journal_fd, int part_fd, struct copy_journal *journal, char *buffer) {
+    struct copy_journal saved;
+    struct stat part_st;
+    if (pread(journal_fd, &saved, sizeof(saved), 0) != (ssize_t)sizeof(saved) ||
+        saved.record_crc != crc32c(0, &saved, offsetof(struct copy_journal, record_crc)) ||
+        memcmp(saved.magic, journal->magic, sizeof(saved.magic)) != 0 || saved.src_size != journal->src_size ||
+        saved.src_mtime_sec != journal->src_mtime_sec || saved.src_mtime_nsec != journal->src_mtime_nsec ||
+        saved.src_ino != journal->src_ino || saved.src_dev != journal->src_dev || fstat(part_fd, &part_st) != 0 ||
+        (uint64_t)part_st.st_size < saved.committed || saved.segment_start > saved.committed) {
+        return 0; // No journal, a torn one, a different source, or a part file shorter than recorded
+    }
+    uint32_t crc = 0;
+    for (uint64_t offset = saved.segment_start; offset < saved.committed;) { // Re-read the last committed segment
+        size_t want = saved.committed - offset < COPY_BUFFER_SIZE ? (size_t)(saved.committed - offset) : COPY_BUFFER_SIZE;
+        ssize_t n = pread(part_fd, buffer, want, (off_t)offset);
+        if (n <= 0) {
+            return 0;
+        }
+        crc = crc32c(crc, buffer, (size_t)n);
+        offset += (uint64_t)n;
+    }
+    if (crc != saved.segment_crc) {
+        return 0; // The data on disk is not what was committed: start over
+    }
+    *journal = saved;
+    return (off_t)saved.committed;
+}
+
+// Function to copy a file so that an interrupted copy can be resumed
+int copy_resumable(const char *src_path, const char *dest_path, off_t *resumed_from) {
+    *resumed_from = 0;
+    int src_fd = open(src_path, O_RDONLY | O_CLOEXEC); // Open the source file for reading
+    if (src_fd < 0) {
+        perror("open source file"); // Print an error message
+        return -1;
+    }
+    struct stat st;
+    if (fstat(src_fd, &st) != 0) {
+        perror("fstat source file");
+        close(src_fd);
+        return -1;
+    }
+
+    size_t dest_len = strlen(dest_path);
+    char *part_path = malloc(dest_len + sizeof(".journal"));
+    char *journal_path = malloc(dest_len + sizeof(".journal"));
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (!part_path || !journal_path || !buffer) {
+        perror("malloc");
+        free(part_path);
+        free(journal_path);
+        free(buffer);
+        close(src_fd);
+        return -1;
+    }
+    snprintf(part_path, dest_len + sizeof(".journal"), "%s.part", dest_path);
+    snprintf(journal_path, dest_len + sizeof(".journal"), "%s.journal", dest_path);
+
+    int part_fd = open(part_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    int journal_fd = part_fd >= 0 ? open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666) : -1;
+    int rc = 0;
+    if (part_fd < 0 || journal_fd < 0) {
+        perror("open part file");
+        rc = -1;
+    }
+
+    struct copy_journal journal;
+    copy_journal_identity(&journal, &st);
+    off_t offset = 0;
+    if (rc == 0) {
+        offset = copy_journal_recover(journal_fd, part_fd, &journal, buffer);
+        *resumed_from = offset;
+        if (offset == 0) {
+            copy_journal_identity(&journal, &st); // Fresh start
+        }
+        if (ftruncate(part_fd, offset) != 0) { // Discard whatever was written after the last commit
+            perror("ftruncate part file");
+            rc = -1;
+        }
+    }
+
+    uint32_t segment_crc = 0; // CRC32C of the data copied since the last commit
+    off_t segment_start = offset;
+    int clone = reflink_mode == REFLINK_ALWAYS || (reflink_mode == REFLINK_AUTO && copy_method == COPY_METHOD_CLONE);
+    off_t cloned_until = offset; // Data before this offset is already shared with the source
+    while (rc == 0 && offset < st.st_size) {
+        if (clone && offset == segment_start) {
+            // Segments start at multiples of COPY_JOURNAL_INTERVAL, so the range is block aligned
+            off_t len = st.st_size - offset < COPY_JOURNAL_INTERVAL ? st.st_size - offset : COPY_JOURNAL_INTERVAL;
+            struct file_clone_range range = { .src_fd = src_fd, .src_offset = (uint64_t)offset, .src_length = (uint64_t)len,
+                                              .dest_offset = (uint64_t)offset };
+            if (ioctl(part_fd, FICLONERANGE, &range) == 0) {
+                cloned_until = offset + len;
+            } else if (reflink_mode == REFLINK_ALWAYS || !copy_method_unsupported(errno)) {
+                perror("reflink");
+                rc = -1;
+                break;
+            } else {
+                clone = 0; // These files cannot share extents: copy the data from here on
+            }
+        }
+        size_t want = st.st_size - offset < COPY_BUFFER_SIZE ? (size_t)(st.st_size - offset) : COPY_BUFFER_SIZE;
+        ssize_t in = pread(src_fd, buffer, want, offset);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in <= 0) {
+            if (in < 0) {
+                perror("read source file");
+                rc = -1;
+            }
+            break; // The source ended early: checked below
+        }
+        for (ssize_t out = 0; out < in && rc == 0 && offset >= cloned_until;) { // Cloned data is only read
+            ssize_t n = pwrite(part_fd, buffer + out, (size_t)(in - out), offset + out);
+            if (n > 0) {
+                out += n;
+            } else if (n == 0 || errno != EINTR) {
+                perror("write part file");
+                rc = -1;
+            }
+        }
+        segment_crc = crc32c(segment_crc, buffer, (size_t)in);
+        journal.rolling_crc = crc32c(journal.rolling_crc, buffer, (size_t)in);
+        offset += in;
+
+        if (rc == 0 && (offset - segment_start >= COPY_JOURNAL_INTERVAL || offset == st.st_size)) {
+            // Commit: the data must be durable before the journal says it is
+            journal.committed = (uint64_t)offset;
+            journal.segment_start = (uint64_t)segment_start;
+            journal.segment_crc = segment_crc;
+            if (fdatasync(part_fd) != 0 || copy_journal_commit(journal_fd, &journal) != 0) {
+                perror("commit copy journal");
+                rc = -1;
+            }
+            segment_crc = 0;
+            segment_start = offset;
+        }
+    }
+
+    if (rc == 0 && offset < st.st_size) {
+        // Shrank while being copied: keep the part file and journal rather than install a truncated copy
+        fprintf(stderr, "%s: source file shrank during the copy\n", src_path);
+        rc = -1;
+    }
+    if (rc == 0 && (fchmod(part_fd, st.st_mode & 07777) != 0 || fsync(part_fd) != 0)) {
+        perror("finish part file");
+        rc = -1;
+    }
+    if (part_fd >= 0 && close(part_fd) != 0 && rc == 0) {
+        perror("close part file");
+        rc = -1;
+    }
+    if (journal_fd >= 0) {
+        close(journal_fd);
+    }
+    if (rc == 0 && copy_verify) {
+        rc = verify_copy(part_path, journal.rolling_crc); // Covers the resumed and the newly copied data alike
+    }
+    if (rc == 0 && rename(part_path, dest_path) != 0) { // The destination only ever appears complete
+        perror("rename");
+        rc = -1;
+    }
+    if (rc == 0) {
+        // Persist the new directory entry before the journal goes away
+        char *slash = strrchr(part_path, '/');
+        if (slash) {
+            *slash = '\0';
+        }
+        int dir_fd = open(slash ? (slash == part_path ? "/" : part_path) : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0 || fsync(dir_fd) != 0) {
+            perror("fsync destination directory");
+            rc = -1;
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+    }
+    if (rc == 0) {
+        unlink(journal_path); // Done: nothing left to resume
+        copy_crc = journal.rolling_crc; // Digest of the whole file, for --checksum
+    }
+    free(part_path);
+    free(journal_path);
+    free(buffer);
+    close(src_fd);
+    return rc;
+}
+
+static int copy_fd_contents(int src_fd, int dst_fd, const struct stat *st, int *method_out);
+
+// Create an empty file next to path for a copy that is renamed over path once it is complete. It gets the permission
+// bits of an existing regular file at path, or 0666 less the umask like a new destination. Returns its fd and sets
+// *temp_path (malloc'd), or returns -1 after printing an error.
+static int open_temp_next_to(const char *path, char **temp_path) {
+    size_t len = strlen(path) + sizeof(".fileutil-") + 2 * 3 * sizeof(unsigned); // Room for two decimal numbers
+    *temp_path = malloc(len);
+    if (!*temp_path) {
+        perror("malloc");
+        return -1;
+    }
+    struct stat st;
+    int existing = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    static unsigned counter = 0; // Distinguishes the temporary files of one process (server mode runs many copies)
+    for (;;) {
+        snprintf(*temp_path, len, "%s.fileutil-%u-%u", path, (unsigned)getpid(), counter++);
+        int fd = open(*temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666); // The umask applies, as for a new file
+        if (fd >= 0) {
+            if (existing && fchmod(fd, st.st_mode & 07777) != 0) {
+                perror("fchmod");
+                close(fd);
+                unlink(*temp_path);
+                break;
+            }
+            return fd;
+        }
+        if (errno != EEXIST) {
+            perror("open destination file");
+            break;
+        }
+    }
+    free(*temp_path);
+    *temp_path = NULL;
+    return -1;
+}
+
+// Function to copy the contents of one file to another
+int copy_file_data(const char *src_path, const char *dest_path, const char **method_used) {
+    int src_fd = open(src_path, O_RDONLY | O_CLOEXEC); // Open the source file for reading
+    if (src_fd < 0) {
+        perror("open source file"); // Print an error message
+        return -1;
+    }
+    struct stat st;
+    if (fstat(src_fd, &st) != 0) {
+        perror("fstat source file");
+        close(src_fd);
+        return -1;
+    }
+    // --reflink always fails wherever the files cannot share extents: clone into a temporary file and rename it into
+    // place, so that a refused clone (or a failed --verify) leaves an existing destination as it was
+    char *temp_path = NULL;
+    int dst_fd = reflink_mode == REFLINK_ALWAYS ? open_temp_next_to(dest_path, &temp_path)
+                                                : open(dest_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666); // Same mode as fopen("wb")
+    if (dst_fd < 0) {
+        if (reflink_mode != REFLINK_ALWAYS) {
+            perror("open destination file"); // Print an error message (open_temp_next_to() prints its own)
+        }
+        close(src_fd);
+        return -1;
+    }
+    const char *written_path = temp_path ? temp_path : dest_path;
+
+    int method;
+    int rc = copy_fd_contents(src_fd, dst_fd, &st, &method);
+    if (close(dst_fd) != 0 && rc == 0) { // Delayed write errors (e.g. on NFS) are reported at close
+        perror("close destination file");
+        rc = -1;
+    }
+    close(src_fd);
+    if (rc == 0 && copy_verify) {
+        rc = verify_copy(written_path, copy_crc); // Second pass over the destination only; the source was read once
+    }
+    if (temp_path) {
+        if (rc == 0 && rename(temp_path, dest_path) != 0) {
+            perror("rename");
+            rc = -1;
+        }
+        if (rc != 0) {
+            unlink(temp_path);
+        }
+        free(temp_path);
+    }
+    *method_used = copy_method_names[method];
+    return rc;
+}
+
+// Copy the contents of src_fd (whose status is st) to the empty dst_fd with the --reflink policy, the --sparse
+// policy and the --copy-method fallback chain. Sets *method to the method used. Returns 0 on success, -1 after
+// printing an error.
+static int copy_fd_contents(int src_fd, int dst_fd, const struct stat *st, int *method_out) {
+    off_t size = st->st_size;
+    int method = copy_method; // Start from the preferred method and step down if the kernel refuses it
+    uint32_t *crc = copy_checksum ? &copy_crc : NULL; // Every path below extends it with the file's data, in order
+    copy_crc = 0;
+    char *buffer = NULL; // Used to checksum a cloned file
+    if (reflink_mode == REFLINK_ALWAYS) {
+        method = COPY_METHOD_CLONE;
+    } else if (reflink_mode == REFLINK_NEVER && method == COPY_METHOD_CLONE) {
+        method = COPY_METHOD_RANGE;
+    }
+    int rc = 0;
+    if (method == COPY_METHOD_CLONE && ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        // Cloned: the whole file now shares the source's extents, no data was copied (only read, for --checksum)
+        if (crc && crc32c_file_range(src_fd, 0, size, crc, &buffer) != 0) {
+            perror("checksum");
+            rc = -1;
+        }
+    } else if (method == COPY_METHOD_CLONE && reflink_mode == REFLINK_ALWAYS) {
+        perror("reflink"); // Different filesystems, or a filesystem without reflink support
+        rc = -1;
+    } else {
+        // A refused whole-file clone leaves method at COPY_METHOD_CLONE: the range copies below try FICLONERANGE on
+        // their first range and step down to copy_file_range if that is refused too
+        if (method == COPY_METHOD_DIRECT || method == COPY_METHOD_URING) {
+            // Bypass the page cache, or keep many linked reads and writes in flight
+            rc = method == COPY_METHOD_DIRECT ? copy_direct(src_fd, dst_fd, size, crc) : copy_uring(src_fd, dst_fd, size, crc);
+            if (rc == 1) {
+                method = COPY_METHOD_RANGE; // No O_DIRECT on these files, or no io_uring: copy the normal way
+                rc = copy_range(src_fd, dst_fd, 0, size, &method, 0, crc);
+            }
+        } else if (sparse_mode == SPARSE_ALWAYS || (sparse_mode == SPARSE_AUTO && st->st_blocks * 512 < size)) {
+            rc = copy_sparse(src_fd, dst_fd, size, &method, crc); // Holes in the source (or zero blocks) stay holes
+        } else if (size >= copy_parallel_threshold) {
+            rc = copy_parallel(src_fd, dst_fd, size, &method, crc);
+        } else {
+            rc = copy_range(src_fd, dst_fd, 0, size, &method, 0, crc);
+        }
+        if (rc != 0) {
+            perror(copy_method_names[method]);
+        }
+    }
+    free(buffer);
+    *method_out = method;
+    return rc;
+}
+
+// Copy the extended attributes of src_fd to dst_fd. Returns 0 on success, -1 with errno set.
+static int copy_xattrs(int src_fd, int dst_fd) {
+    ssize_t list_len = flistxattr(src_fd, NULL, 0);
+    if (list_len <= 0) {
+        return list_len == 0 || errno == ENOTSUP ? 0 : -1; // No attributes, or a filesystem without them
+    }
+    char *names = malloc((size_t)list_len);
+    char *value = NULL;
+    size_t value_cap = 0;
+    int rc = -1;
+    if (names && (list_len = flistxattr(src_fd, names, (size_t)list_len)) >= 0) {
+        rc = 0;
+        for (char *name = names; name < names + list_len && rc == 0; name += strlen(name) + 1) {
+            ssize_t value_len = fgetxattr(src_fd, name, NULL, 0);
+            if (value_len < 0) {
+                rc = -1;
+                break;
+            }
+            if ((size_t)value_len > value_cap) {
+                char *grown = realloc(value, (size_t)value_len);
+                if (!grown) {
+                    rc = -1;
+                    break;
+                }
+                value = grown;
+                value_cap = (size_t)value_len;
+            }
+            value_len = fgetxattr(src_fd, name, value, value_cap);
+            if (value_len < 0 || fsetxattr(dst_fd, name, value, (size_t)value_len, 0) != 0) {
+                // Attributes the destination filesystem or our privileges do not allow (e.g. security.*) are skipped
+                rc = value_len >= 0 && (errno == ENOTSUP || errno == EPERM) ? 0 : -1;
+            }
+        }
+    }
+    free(value);
+    free(names);
+    return rc;
+}
+
+// Function to move a file to another filesystem
+int move_file_across(const char *src_path, const char *dest_path, const char **method_used) {
+    int src_fd = open(src_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW); // Open the source file for reading
+    if (src_fd < 0) {
+        perror("open source file"); // Print an error message
+        return -1;
+    }
+    struct stat st;
+    if (fstat(src_fd, &st) != 0) {
+        perror("fstat source file");
+        close(src_fd);
+        return -1;
+    }
+
+    // Write a temporary file next to the destination, so the destination only ever appears complete
+    size_t dest_len = strlen(dest_path);
+    char *temp_path = malloc(dest_len + sizeof(".fileutil-XXXXXX"));
+    if (!temp_path) {
+        perror("malloc");
+        close(src_fd);
+        return -1;
+    }
+    memcpy(temp_path, dest_path, dest_len);
+    memcpy(temp_path + dest_len, ".fileutil-XXXXXX", sizeof(".fileutil-XXXXXX"));
+    int dst_fd = mkostemp(temp_path, O_CLOEXEC);
+    if (dst_fd < 0) {
+        perror("mkostemp");
+        free(temp_path);
+        close(src_fd);
+        return -1;
+    }
+
+    int method;
+    int rc = copy_fd_contents(src_fd, dst_fd, &st, &method);
+    if (rc == 0) {
+        // Keep owner, permissions, timestamps and extended attributes. Changing the owner needs privileges; without
+        // them the file belongs to the caller, as with cp -p.
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if (fchown(dst_fd, st.st_uid, st.st_gid) != 0 && errno != EPERM) {
+            perror("fchown");
+            rc = -1;
+        } else if (fchmod(dst_fd, st.st_mode & 07777) != 0) { // After fchown, which may clear set-user-ID bits
+            perror("fchmod");
+            rc = -1;
+        } else if (copy_xattrs(src_fd, dst_fd) != 0) {
+            perror("copy extended attributes");
+            rc = -1;
+        } else if (futimens(dst_fd, times) != 0) {
+            perror("futimens");
+            rc = -1;
+        } else if (fsync(dst_fd) != 0) { // The data must be on disk before the source is removed
+            perror("fsync");
+            rc = -1;
+        }
+    }
+    if (close(dst_fd) != 0 && rc == 0) {
+        perror("close destination file");
+        rc = -1;
+    }
+    if (rc == 0 && copy_verify) {
+        rc = verify_copy(temp_path, copy_crc); // Check the copy before the source is removed
+    }
+    if (rc == 0 && rename(temp_path, dest_path) != 0) { // Atomically replace the destination
+        perror("rename");
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(temp_path); // Leave the destination directory as it was
+    } else {
+        // Persist the new directory entry, then remove the source
+        char *slash = strrchr(temp_path, '/');
+        if (slash) {
+            *slash = '\0';
+        }
+        int dir_fd = open(slash ? (slash == temp_path ? "/" : temp_path) : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0 || fsync(dir_fd) != 0) {
+            perror("fsync destination directory");
+            rc = -1; // The copy may not survive a crash yet, so keep the source
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        if (rc == 0 && unlink(src_path) != 0) {
+            perror("unlink source file");
+            rc = -1;
+        }
+    }
+    free(temp_path);
+    close(src_fd);
+    *method_used = copy_method_names[method];
+    return rc;
+}
+
+// ---------------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+    // Main function accepts command-line arguments (argc and argv)
+    // argc is the number of arguments passed to the program, and argv is an array of strings containing the arguments.
+
+    // Strip "--option" flags first so the positional argument count below is unaffected by them
+    argc = parse_options(argc, argv);
+    if (argc < 0) {
+        return 1; // parse_options already printed the reason
+    }
+
+    if (daemon_socket) {
+        // Daemon: "--daemon SOCKET rootDir" serves lookups from a live in-memory index
+        if (argc != 2) {
+            fprintf(stderr, "Invalid number of arguments\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        rootDir = argv[1]; // Store the root directory path
+        if (!directory_exists(rootDir)) {
+            fprintf(stderr, "Invalid rootDir\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        return run_daemon(daemon_socket, rootDir) == 0 ? 0 : 1;
+    }
+
+    if (names_path) {
+        // Batch search: "--names FILE rootDir" resolves every listed name in one traversal
+        if (argc != 2) {
+            fprintf(stderr, "Invalid number of arguments\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        rootDir = argv[1]; // Store the root directory path
+        if (!directory_exists(rootDir)) {
+            fprintf(stderr, "Invalid rootDir\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        return search_names(names_path, rootDir) == 0 ? 0 : 1;
+    }
+
+    if (index_build_path || index_update_path) {
+        // Index build: "--index-build INDEX rootDir" walks rootDir once and writes the index
+        // Index refresh: "--index-update INDEX rootDir" re-reads only the directories that changed
+        if (argc != 2) {
+            fprintf(stderr, "Invalid number of arguments\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        rootDir = argv[1]; // Store the root directory path
+        if (!directory_exists(rootDir)) {
+            fprintf(stderr, "Invalid rootDir\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        if (index_update_path) {
+            return index_update(rootDir, index_update_path) == 0 ? 0 : 1;
+        }
+        return index_build(rootDir, index_build_path) == 0 ? 0 : 1;
+    }
+
+    if (extract_archive) {
+        // Extraction: "--extract ARCHIVE storageDir [NAME]" unpacks the archive, or the member NAME (archive path or file name)
+        if (argc != 2 && argc != 3) {
+            fprintf(stderr, "Invalid number of arguments\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        storageDir = argv[1]; // Store the storage directory path
+        if (!directory_exists(storageDir)) {
+            fprintf(stderr, "Invalid storageDir\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        return archive_extract(extract_archive, storageDir, argc == 3 ? argv[2] : NULL) == 0 ? 0 : 1;
+    }
+
+    if (serve_socket || client_socket) {
+        // Query server: "--serve SOCKET"; client: "--client SOCKET" with request lines on standard input
+        if (argc != 1) {
+            fprintf(stderr, "Invalid number of arguments\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+        if (client_socket) {
+            return run_client(client_socket) == 0 ? 0 : 1;
+        }
+        return run_server(serve_socket) == 0 ? 0 : 1;
+    }
+
+    return run_command(argc, argv);
+}
+
+// Function to run one search, copy/move or archive request
+int run_command(int argc, char *argv[]) {
+    // Check the number of arguments passed
+    // Depending on the number of arguments, different parts of the program logic will be executed.
+
+    if (argc == 3) {
+        // Part 1: Search for a file in the specified directory subtree
+        // If the number of arguments is 3, the program searches for a file in the specified directory subtree.
+
+        // It retrieves the root directory path (rootDir) and the entered file name (enteredFileName) from the command-line arguments.
+        rootDir = argv[1]; // Store the root directory path
+        enteredFileName = argv[2]; // Store the entered file name
+
+        // Check if the root directory exists
+        if (!directory_exists(rootDir)) {
+            fprintf(stderr, "Invalid rootDir\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+
+        // Search for the file using the index given with --index, or else the selected walker
+        // (parallel by default, nftw with --walker nftw) with the search_and_process callback.
+        if (search_file() == -1) {
+            return 1; // Return to indicate failure (search_file already printed the reason)
+        }
+
+        // Print a message if the file is not found
+        if (found_file == NULL) {
+            printf("Search Unsuccessful\n"); // Print a message indicating that the search was unsuccessful
+        }
+    } else if (argc == 5) {
+        // If the number of arguments is 5, the program searches for a file and performs a copy or move operation based on options.
+
+        // Part 2: Search for a file and copy/move it to another directory based on options
+        rootDir = argv[1]; // Store the root directory path
+        storageDir = argv[2]; // Store the storage directory path
+        operation = argv[3]; // Store the operation
+        enteredFileName = argv[4]; // Store the entered file name
+
+        // Check if the root directory exists
+        if (!directory_exists(rootDir)) {
+            fprintf(stderr, "Invalid rootDir\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+
+        // Check if the operation is valid
+        if (strcmp(operation, "-cp") != 0 && strcmp(operation, "-mv") != 0) {
+            fprintf(stderr, "Invalid operation\n"); // Print an error message
+            return 1; // Return to indicate failure
+        }
+
+        // Search for the file using the index given with --index, or else the selected walker
+        if (search_file() == -1) {
+            return 1; // Return to indicate failure (search_file already printed the reason)
+        }
+
+        // Print a message if the file is not found
+        if (found_file == NULL) {
+            printf("Search Unsuccessful\n"); // Print a message indicating that the search was unsuccessful
+        }
+    } else if (argc == 4) {
+        // If the number of arguments is 4, the program searches for files with a specific extension and creates a tar file.
+        // It retrieves the root directory path, storage directory path, and file extension from the command-line arguments.
+        // Part 3: Search for files with a specific extension and create a tar file
+        rootDir = argv[1]; // Store the root directory path
+        storageDir = argv[2]; // Store the storage directory path
+        extension = argv[3]; // Store the file extension
+
+        // Check if the root directory and storage directory exist
+        if (!directory_exists(rootDir) || !directory_exists(storageDir)) {
+            if (!directory_exists(rootDir)) {
+                fprintf(stderr, "Invalid rootDir\n"); // Print an error message
+            }
+            if (!directory_exists(storageDir)) {
+                printf("Search Successful: Invalid storageDir\n"); // Print a message indicating that the storage directory is invalid
+            }
+            return 1; // Return to indicate failure
+        }
+
+        // Archiving needs the size and mode of the matching files, so ask the walker for full metadata of those only
+        walk_need_stat = 1;
+        walk_stat_filter = tar_name_matches;
+
+        // Open the archive once; every matching file is appended to it. --codec-bench collects the plain tar stream
+        // in a scratch file instead and compresses that with every codec afterwards.
+        char tarfilename[PATH_MAX]; // Buffer to store the tar file name
+        snprintf(tarfilename, sizeof(tarfilename), codec_bench ? "%s/%s.bench" : "%s/%s", storageDir, archive_name); // Create the tar file name
+        int codec = archive_codec != -1 ? archive_codec : archive_codec_for_name(archive_name);
+        if (archive_format == FORMAT_BGZF && codec != CODEC_GZIP) {
+            fprintf(stderr, "--archive-format bgzf needs the gzip codec\n");
+            return 1; // Return to indicate failure
+        }
+        tar_archive = tar_open_archive(tarfilename, codec_bench ? CODEC_NONE : codec);
+        if (!tar_archive) {
+            return 1; // Return to indicate failure (tar_open_archive already printed the reason)
+        }
+
+        // Search for files with the specified extension using the index given with --index, or else the selected walker
+        int rc;
+        if (index_path) {
+            rc = index_search_substring(index_path, rootDir, extension); // Prints its own errors
+        } else {
+            rc = walk_tree(rootDir, search_and_create_tar);
+            if (rc == -1) {
+                perror("walk_tree"); // Print an error message
+            }
+        }
+        int close_rc = tar_close_archive(tar_archive); // End-of-archive marker
+        tar_archive = NULL;
+        if (codec_bench) {
+            if (rc == 0 && close_rc == 0 && archive_benchmark(tarfilename) != 0) {
+                rc = 1;
+            }
+            unlink(tarfilename); // The scratch copy is not kept
+        }
+        if (rc != 0 || close_rc != 0) {
             return 1; // Return to indicate failure
         }
     } else {